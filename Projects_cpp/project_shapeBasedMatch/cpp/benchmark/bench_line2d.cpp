@@ -0,0 +1,89 @@
+#include "../line2d.hpp"
+#include "benchmark.hpp"
+
+using namespace std;
+using namespace cv;
+using namespace line2d;
+
+/// @brief 与 line2d 内部一致的梯度输入: 7x7 高斯平滑后 Sobel, 幅值归一化到
+/// [0, 100], 角度为 0~360 度. line2d 没有公开这一步, 因此只作为输入而不计时
+static void gradients(const Mat &src, Mat &magnitude, Mat &angle) {
+  Mat gray, smoothed, dx, dy;
+  if (src.channels() == 3)
+    cvtColor(src, gray, COLOR_BGR2GRAY);
+  else
+    gray = src;
+  GaussianBlur(gray, smoothed, Size(7, 7), 0, 0, BORDER_REPLICATE);
+  Sobel(smoothed, dx, CV_32F, 1, 0, 3, 1.0, 0, BORDER_REPLICATE);
+  Sobel(smoothed, dy, CV_32F, 0, 1, 3, 1.0, 0, BORDER_REPLICATE);
+  magnitude = dx.mul(dx) + dy.mul(dy);
+  normalize(magnitude, magnitude, 0, 100.0f, NORM_MINMAX, CV_32F);
+  phase(dx, dy, angle, true);
+}
+
+/// @brief 逐阶段计时: 量化, 扩散, 响应图, 线性化, 相似度, 以及模板创建
+static void stages(const String &title, const Mat &templ_image,
+                   const Mat &src, int iterations) {
+  if (templ_image.empty() || src.empty()) {
+    printf("\n%s: images not found, skipped\n", title.c_str());
+    return;
+  }
+  // 线性化按 4x4 分块, 裁掉不足一块的边缘
+  const Mat source = src(Rect(0, 0, src.cols & ~3, src.rows & ~3));
+  const double pixels = source.total();
+  bench::header(cv::format("line2d stages, %s, source %dx%d", title.c_str(),
+                           source.cols, source.rows));
+
+  Ptr<Template> templ;
+  bench::report("Template::createPtr_from", bench::measure([&] {
+                  templ = Template::createPtr_from(templ_image);
+                }, iterations), templ_image.total());
+
+  Mat magnitude, angle;
+  gradients(source, magnitude, angle);
+
+  Mat ori_bit, spread_ori;
+  bench::report("quantize (3x3 vote)", bench::measure([&] {
+                  Detector::quantize(magnitude, angle, ori_bit, 3, 0.2f);
+                }, iterations), pixels);
+
+  bench::report("spread (T = 3)", bench::measure([&] {
+                  Detector::spread(ori_bit, spread_ori, 3);
+                }, iterations), pixels);
+
+  vector<Mat> response_maps;
+  bench::report("response maps", bench::measure([&] {
+                  Detector::computeResponseMaps(spread_ori, response_maps);
+                }, iterations), pixels);
+
+  vector<Detector::LinearMemories> memories;
+  bench::report("linearize", bench::measure([&] {
+                  Detector::linearize(response_maps, memories);
+                }, iterations), pixels);
+
+  const vector<Template::Feature> &features = templ->pg_ptr();
+  Detector::SimilarityMemories similarity;
+  bench::report(cv::format("similarity (%d features)", (int)features.size()),
+                bench::measure([&] {
+                  Detector::computeSimilarityMap(memories, features, similarity);
+                }, iterations), pixels, features.size());
+
+  Mat similarity_map;
+  bench::report("unlinearize", bench::measure([&] {
+                  Detector::unlinearize(similarity, similarity_map);
+                }, iterations), pixels);
+}
+
+int main(int argc, char **argv) {
+  const bench::Options options = bench::Options::parse(argc, argv);
+
+  const Mat scene = bench::syntheticScene(options.size);
+  stages(cv::format("synthetic %dx%d", scene.cols, scene.rows),
+         bench::syntheticTemplate(scene), scene, options.iterations);
+  // Detector::addSourceImage 尚不可用, 以同一阶段链在样例上计时作为端到端结果
+  stages("imagelib template_0/source_0",
+         imread(options.image("template_0.bmp"), IMREAD_COLOR),
+         imread(options.image("source_0.bmp"), IMREAD_COLOR),
+         options.iterations);
+  return 0;
+}
@@ -0,0 +1,125 @@
+#include "../line2dup/line2dup.hpp"
+#include "benchmark.hpp"
+
+using namespace std;
+using namespace cv;
+using namespace line2Dup;
+
+/// @brief 随机特征的模板, 坐标位于 [-64, 64) 内
+static ShapeTemplate randomTemplate(int num_features, RNG &rng) {
+  ShapeTemplate templ(0, 1.0f, 0.0f);
+  for (int k = 0; k < num_features; k++) {
+    Gradient point;
+    point.x = rng.uniform(-64, 64);
+    point.y = rng.uniform(-64, 64);
+    point.label = rng.uniform(0, QUANTIZE_BASE);
+    templ.features.push_back(point);
+  }
+  return templ;
+}
+
+/// @brief 逐阶段计时: 梯度与量化, 扩散, 响应图, 线性化, 相似度
+static void stages(const bench::Options &options) {
+  const Mat src = bench::syntheticScene(options.size);
+  const double pixels = src.total();
+  const int n = options.iterations;
+  bench::header(cv::format("line2dup stages, synthetic %dx%d (%s)", src.cols,
+                           src.rows, mipp::InstructionFullType.c_str()));
+
+  // 方向投票使用与 Detector 相同规模的线程池
+  ThreadPool pool;
+  Mat quantized, spread_quantized;
+  bench::report("gradient + quantize", bench::measure([&] {
+                  ColorGradientPyramid modality(src, Mat(), 80.0f, 5, 100,
+                                                QUANTIZE_BASE, &pool);
+                  modality.quantize(quantized);
+                }, n), pixels);
+
+  bench::report("spread (T = 3)", bench::measure([&] {
+                  spread(quantized, spread_quantized, 3);
+                }, n), pixels);
+
+  vector<Mat> response_maps;
+  bench::report("response maps", bench::measure([&] {
+                  computeResponseMaps(spread_quantized, response_maps);
+                }, n), pixels);
+
+  vector<LinearMemory> memories(QUANTIZE_BASE, LinearMemory(4));
+  bench::report("linearize", bench::measure([&] {
+                  for (int i = 0; i < QUANTIZE_BASE; i++)
+                    memories[i].linearize(response_maps[i]);
+                }, n), pixels);
+
+  RNG rng(0x2023);
+  LinearMemory similarity(4);
+  for (int num_features : {64, 256, 1024}) {
+    const ShapeTemplate templ = randomTemplate(num_features, rng);
+    bench::report(cv::format("similarity (%d features)", num_features),
+                  bench::measure([&] {
+                    computeSimilarity(memories.data(), templ, similarity);
+                  }, n), pixels, num_features);
+  }
+}
+
+/// @brief 端到端计时: 训练, 源图像预处理, 匹配 (含逐层精化), 抑制, 位姿精化
+static void endToEnd(const String &title, const Mat &templ_image,
+                     const Mat &src, int iterations) {
+  if (templ_image.empty() || src.empty()) {
+    printf("\n%s: images not found, skipped\n", title.c_str());
+    return;
+  }
+  const double pixels = src.total();
+  bench::header(cv::format("line2dup end to end, %s, source %dx%d",
+                           title.c_str(), src.cols, src.rows));
+
+  Ptr<TemplateSet> templates;
+  bench::report("train (angle step 1)", bench::measure([&] {
+                  templates = makePtr<TemplateSet>();
+                  templates->addTemplate(templ_image, Mat(),
+                                         Search(line2Dup::Range(1.0f, 1.0f, 0.0f),
+                                                line2Dup::Range(0.0f, 359.0f, 1.0f)));
+                }, 1), templ_image.total());
+
+  line2Dup::Detector detector(templates);
+  MatchContext context;
+  bench::report("source pyramid", bench::measure([&] {
+                  detector.addSource(context, src);
+                }, iterations), pixels);
+
+  bench::report("match (top level + refine)", bench::measure([&] {
+                  detector.matchClass(context, "default", 80);
+                }, iterations), pixels);
+
+  vector<Vec6f> points;
+  vector<RotatedRect> boxes;
+  bench::report("detectBestMatch", bench::measure([&] {
+                  detector.detectBestMatch(context, points, boxes);
+                }, iterations), 0);
+
+  // 位姿精化按匹配数与模板特征数归一化
+  int features = 0;
+  for (const Vec6f &point : points)
+    features += templates->at("default").at(0, cvRound(point[5])).num_features;
+  vector<Vec6f> refined;
+  vector<RotatedRect> refined_boxes;
+  bench::report(cv::format("refineMatches (%d matches)", (int)points.size()),
+                bench::measure([&] {
+                  refined = points;
+                  refined_boxes = boxes;
+                  detector.refineMatches(context, refined, refined_boxes);
+                }, iterations), 0, features);
+}
+
+int main(int argc, char **argv) {
+  const bench::Options options = bench::Options::parse(argc, argv);
+  stages(options);
+
+  const Mat scene = bench::syntheticScene(options.size);
+  endToEnd("synthetic", bench::syntheticTemplate(scene), scene,
+           options.iterations);
+  endToEnd("imagelib template_0/source_0",
+           imread(options.image("template_0.bmp"), IMREAD_COLOR),
+           imread(options.image("source_0.bmp"), IMREAD_COLOR),
+           options.iterations);
+  return 0;
+}
@@ -0,0 +1,80 @@
+#include "../linemod/linemod.hpp"
+#include "benchmark.hpp"
+
+#include <opencv2/highgui.hpp>
+
+using namespace std;
+using namespace cv;
+
+/// @brief 逐阶段计时: 颜色梯度与量化, 量化图输出, 金字塔降采样.
+/// linemod 的扩散, 响应图与线性化在 match() 内部完成, 不单独计时
+static void stages(const bench::Options &options) {
+  const Mat src = bench::syntheticScene(options.size);
+  const double pixels = src.total();
+  const int n = options.iterations;
+  bench::header(cv::format("linemod stages, synthetic %dx%d", src.cols, src.rows));
+
+  const Ptr<linemod::Modality> modality =
+      linemod::getDefaultLINE()->getModalities()[0];
+
+  Ptr<linemod::QuantizedPyramid> pyramid;
+  bench::report("gradient + quantize", bench::measure([&] {
+                  pyramid = modality->process(src);
+                }, n), pixels);
+
+  Mat quantized;
+  bench::report("quantize (output)", bench::measure([&] {
+                  pyramid->quantize(quantized);
+                }, n), pixels);
+
+  bench::report("pyrDown + gradient + quantize", bench::measure([&] {
+                  modality->process(src)->pyrDown();
+                }, n), pixels);
+}
+
+/// @brief 端到端计时: 训练单个模板, 匹配 (含源图像预处理)
+static void endToEnd(const String &title, const Mat &templ_image,
+                     const Mat &src, int iterations) {
+  if (templ_image.empty() || src.empty()) {
+    printf("\n%s: images not found, skipped\n", title.c_str());
+    return;
+  }
+  const double pixels = src.total();
+  bench::header(cv::format("linemod end to end, %s, source %dx%d",
+                           title.c_str(), src.cols, src.rows));
+
+  const vector<Mat> templ_sources(1, templ_image);
+  const Mat object_mask(templ_image.size(), CV_8UC1, Scalar::all(255));
+  Ptr<linemod::Detector> detector;
+  bench::report("addTemplate", bench::measure([&] {
+                  detector = linemod::getDefaultLINE();
+                  detector->addTemplate(templ_sources, "default", object_mask);
+                }, iterations), templ_image.total());
+  if (detector->numTemplates() == 0) {
+    printf("%s: no template extracted, skipped\n", title.c_str());
+    return;
+  }
+
+  const int features =
+      static_cast<int>(detector->getTemplates("default", 0)[0].features.size());
+  const vector<Mat> sources(1, src);
+  vector<linemod::Match> matches;
+  bench::report(cv::format("match (%d features)", features),
+                bench::measure([&] {
+                  detector->match(sources, 80.0f, matches);
+                }, iterations), pixels, features);
+}
+
+int main(int argc, char **argv) {
+  const bench::Options options = bench::Options::parse(argc, argv);
+  stages(options);
+
+  const Mat scene = bench::syntheticScene(options.size);
+  endToEnd("synthetic", bench::syntheticTemplate(scene), scene,
+           options.iterations);
+  endToEnd("imagelib template_0/source_0",
+           imread(options.image("template_0.bmp"), IMREAD_COLOR),
+           imread(options.image("source_0.bmp"), IMREAD_COLOR),
+           options.iterations);
+  return 0;
+}
@@ -0,0 +1,121 @@
+#ifndef SHAPEMATCH_BENCHMARK_HPP
+#define SHAPEMATCH_BENCHMARK_HPP
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+
+/// 三种匹配引擎 (line2dup, line2d, linemod) 共用的基准测试工具. 每个引擎一个
+/// 可执行文件, 分阶段在可复现的合成图像上计时, 再在 imagelib 的样例上端到端
+/// 计时. 耗时取多次运行的中位数, 按像素与按特征归一化后输出
+namespace bench {
+
+/// @brief 命令行参数: bench [width height [iterations [imagelib]]]
+struct Options {
+  cv::Size size;        // 合成图像尺寸
+  int iterations;       // 每项的重复次数
+  std::string imagelib; // 样例图像目录
+
+  Options() : size(640, 480), iterations(20), imagelib("../../imagelib") {}
+
+  static Options parse(int argc, char **argv) {
+    Options options;
+    if (argc >= 3)
+      options.size = cv::Size(std::atoi(argv[1]), std::atoi(argv[2]));
+    if (argc >= 4)
+      options.iterations = std::max(1, std::atoi(argv[3]));
+    if (argc >= 5)
+      options.imagelib = argv[4];
+    CV_Assert(options.size.area() > 0);
+    return options;
+  }
+
+  std::string image(const std::string &name) const {
+    return imagelib + "/" + name;
+  }
+};
+
+/// @brief 预热一次后执行 fn iterations 次, 返回单次耗时的中位数 (纳秒)
+inline double measure(const std::function<void()> &fn, int iterations) {
+  fn();
+  std::vector<double> samples(iterations);
+  for (int i = 0; i < iterations; i++) {
+    const int64 start = cv::getTickCount();
+    fn();
+    samples[i] = (cv::getTickCount() - start) * 1e9 / cv::getTickFrequency();
+  }
+  std::nth_element(samples.begin(), samples.begin() + iterations / 2,
+                   samples.end());
+  return samples[iterations / 2];
+}
+
+inline void header(const std::string &title) {
+  std::printf("\n%s\n", title.c_str());
+  std::printf("%-36s %12s %12s %12s\n", "stage", "ms", "ns/pixel",
+              "ns/feature");
+  std::printf("%s\n", std::string(75, '-').c_str());
+}
+
+/// @brief 输出一行结果, pixels 或 features 不大于 0 时对应列留空
+inline void report(const std::string &name, double ns, double pixels,
+                   double features = 0) {
+  char per_pixel[32] = "", per_feature[32] = "";
+  if (pixels > 0)
+    std::snprintf(per_pixel, sizeof(per_pixel), "%.3f", ns / pixels);
+  if (features > 0)
+    std::snprintf(per_feature, sizeof(per_feature), "%.3f", ns / features);
+  std::printf("%-36s %12.3f %12s %12s\n", name.c_str(), ns * 1e-6, per_pixel,
+              per_feature);
+}
+
+/// @brief 可复现的合成场景: 随机的实心多边形与椭圆, 叠加高斯噪声
+inline cv::Mat syntheticScene(cv::Size size, uint64 seed = 0x2023,
+                              int type = CV_8UC3) {
+  cv::RNG rng(seed);
+  cv::Mat scene(size, type, cv::Scalar::all(32));
+  const int shapes = std::max(4, size.area() / 20000);
+  for (int i = 0; i < shapes; i++) {
+    const cv::Scalar color(rng.uniform(64, 256), rng.uniform(64, 256),
+                           rng.uniform(64, 256));
+    const cv::Point center(rng.uniform(0, size.width), rng.uniform(0, size.height));
+    const int radius = rng.uniform(10, std::max(11, std::min(size.width, size.height) / 6));
+    if (i % 2 == 0) {
+      std::vector<cv::Point> polygon;
+      const int vertices = rng.uniform(3, 8);
+      for (int k = 0; k < vertices; k++) {
+        const double theta = CV_2PI * (k + rng.uniform(0.0, 0.8)) / vertices;
+        const double r = radius * rng.uniform(0.5, 1.0);
+        polygon.push_back(center + cv::Point(cvRound(r * std::cos(theta)),
+                                             cvRound(r * std::sin(theta))));
+      }
+      cv::fillPoly(scene, std::vector<std::vector<cv::Point> >(1, polygon),
+                   color, cv::LINE_AA);
+    } else {
+      cv::ellipse(scene, center, cv::Size(radius, radius / 2 + 1),
+                  rng.uniform(0.0, 180.0), 0, 360, color, cv::FILLED,
+                  cv::LINE_AA);
+    }
+  }
+
+  cv::Mat noise(size, CV_MAKETYPE(CV_16S, scene.channels()));
+  rng.fill(noise, cv::RNG::NORMAL, cv::Scalar::all(0), cv::Scalar::all(4));
+  cv::add(scene, noise, scene, cv::noArray(), scene.type());
+  return scene;
+}
+
+/// @brief 合成场景中心的一块区域, 作为必定能匹配上的模板
+inline cv::Mat syntheticTemplate(const cv::Mat &scene, int side = 160) {
+  side = std::min(side, std::min(scene.cols, scene.rows));
+  const cv::Rect roi((scene.cols - side) / 2, (scene.rows - side) / 2, side, side);
+  return scene(roi).clone();
+}
+
+} // namespace bench
+
+#endif // SHAPEMATCH_BENCHMARK_HPP
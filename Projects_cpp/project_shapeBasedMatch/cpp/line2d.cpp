@@ -1,9 +1,10 @@
 #include "line2d.hpp"
+#include "line2dup/profiler.hpp"
+#include "line2dup/scatteredSelection.hpp"
 using namespace cv;
 using namespace std;
 using namespace line2d;
-double __time__relocate__ = 0.0;
-double __time__produceroi__ = 0.0;
+using line2Dup::ProfileScope;
 
 void __onMouse(int event, int x, int y, int flags, void *userdata) {
   if (event == EVENT_LBUTTONDOWN) {
@@ -18,7 +19,48 @@ void __onMouse(int event, int x, int y, int flags, void *userdata) {
   }
 }
 
-vector<float> Detector::cos_table;
+/// @brief 16 个方向两两之间余弦的最大值按半字节分解的量化响应表:
+/// data[ori][k][n] 为方向 ori 与第 k 个半字节取值为 n 的方向集合 (方向
+/// 4 * k + b, n 的第 b 位为 1) 之间余弦的最大值, 按 RESPONSE_SCALE 四舍五入
+/// 为整数, 负余弦与空集 (n = 0) 记为 0. 量化单调, 任意方向集合的响应仍为其
+/// 各半字节的表项取最大值. 编译期生成, 共 1 KB
+struct ResponseTable {
+  uchar data[16][4][16];
+
+  constexpr ResponseTable() : data() {
+    for (int ori = 0; ori < 16; ori++)
+      for (int k = 0; k < 4; k++)
+        for (int n = 0; n < 16; n++) {
+          float max_cos = -2.0f; // 小于任何余弦
+          for (int b = 0; b < 4; b++) {
+            const int d = ori - (4 * k + b);
+            const float c = static_cast<float>(cosine((d < 0 ? -d : d) *
+                                                      _degree_(11.25)));
+            if ((n & (1 << b)) && c > max_cos)
+              max_cos = c;
+          }
+          data[ori][k][n] =
+              max_cos <= 0.0f
+                  ? 0
+                  : static_cast<uchar>(
+                        max_cos * Detector::RESPONSE_SCALE + 0.5f);
+        }
+  }
+
+  /// @brief cos(x) = sin(pi / 2 - x), x 属于 [0, pi], 以泰勒级数求值.
+  /// pi / 2 分为 double 部分与余项, x 接近 pi / 2 时结果与 std::cos 一致
+  static constexpr double cosine(double x) {
+    const double y = (CV_PI / 2 - x) + 6.123233995736766e-17;
+    double sum = y, term = y;
+    for (int i = 1; i < 30; i++) {
+      term *= -y * y / ((2 * i) * (2 * i + 1));
+      sum += term;
+    }
+    return sum;
+  }
+};
+
+static constexpr ResponseTable response_table{};
 
 ImagePyramid::ImagePyramid() {
   pyramid_level = 0;
@@ -344,31 +386,12 @@ void Template::selectFeatures_from(vector<Feature> &candidates, float distance)
   CV_Assert(distance > 2.0f);
   CV_Assert(!candidates.empty());
 
-  features.clear();
-  float distance_sq = distance * distance;
-  int i = 0;
-
-  while (features.size() < num_features) {
-    const Feature &c = candidates[i];
-    bool keep = true;
-    for (int j = 0; (j < (int)features.size()) && keep; j++) {
-      Feature &fj = features[j];
-      keep = (c.x - fj.x) * (c.x - fj.x) + (c.y - fj.y) * (c.y - fj.y) >=
-             distance_sq;
-    }
-    if (keep)
-      features.push_back(c);
-
-    if (++i == (int)candidates.size()) {
-      i = 0;
-      distance -= 1.0f;
-      distance_sq = distance * distance;
-    }
-  }
+  line2Dup::selectScatteredFeatures(candidates, features, num_features,
+                                    distance);
 }
 
 vector<Template::Feature> Template::relocate_by(shapeInfo_producer::Info info) {
-  Timer time;
+  ProfileScope scope(line2Dup::STAGE_TEMPLATE_TRANSFORM);
   float theta = -info.angle / 180.0f * CV_PI;
   vector<Feature> new_prograds;
   for (const auto &pg : features) {
@@ -379,7 +402,6 @@ vector<Template::Feature> Template::relocate_by(shapeInfo_producer::Info info) {
                                    fmod(pg.angle - info.angle + 360.0f, 360.0f),
                                    pg.score));
   }
-  __time__relocate__ += time.elapsed();
   return new_prograds;
 }
 
@@ -408,13 +430,11 @@ void Template::show_in(Mat &background, Point center,
   circle(background, center, 1, Scalar(0, 255, 0), -1);
 }
 
-Detector::Detector() {
-  pyramid_level = 2;
-  init_costable();
-}
+Detector::Detector() { pyramid_level = 2; }
 
 void Detector::quantize(const Mat &edges, const Mat &angles,
                         Mat &ori_bit, int kernel_size, float magnitude_threshold) {
+  ProfileScope scope(line2Dup::STAGE_GRADIENT);
   ori_bit = Mat::zeros(angles.size(), CV_16U);
   // Mat ori_mat = Mat::ones(angles.size(), CV_8U);
   // ori_mat *= 125;
@@ -451,6 +471,7 @@ void Detector::quantize(const Mat &edges, const Mat &angles,
 }
 
 void Detector::spread(Mat &ori_bit, Mat &spread_ori, int kernel_size) {
+  ProfileScope scope(line2Dup::STAGE_SPREAD);
   spread_ori = Mat::zeros(ori_bit.size(), CV_16U);
   for (int i = 0; i < ori_bit.rows; i++) {
     for (int j = 0; j < ori_bit.cols; j++) {
@@ -476,40 +497,35 @@ void Detector::spread(Mat &ori_bit, Mat &spread_ori, int kernel_size) {
 
 void Detector::computeResponseMaps(Mat &spread_ori,
                                    vector<Mat> &response_maps) {
+  ProfileScope scope(line2Dup::STAGE_RESPONSE_MAPS);
   response_maps.resize(16);
   for (int i = 0; i < 16; i++)
-    response_maps[i] = Mat::zeros(spread_ori.size(), CV_32F);
+    response_maps[i] = Mat::zeros(spread_ori.size(), CV_8U);
 
-  int maxValue = numeric_limits<ushort>::max();
   for (int i = 0; i < spread_ori.rows; i++) {
+    const ushort *spread_r = spread_ori.ptr<ushort>(i);
     for (int j = 0; j < spread_ori.cols; j++) {
-      if (!spread_ori.at<ushort>(i, j)) continue;
+      const int bits = spread_r[j];
+      if (!bits) continue;
+      // 四个半字节各查一次表, 取最大值
+      const int n0 = bits & 15, n1 = (bits >> 4) & 15, n2 = (bits >> 8) & 15,
+                n3 = bits >> 12;
       for (int orientation = 0; orientation < 16; orientation++) {
-        // cout << "(debug)" << endl;
-        response_maps[orientation].at<float>(i, j) =
-            cos_table[orientation * maxValue +
-                      (int)spread_ori.at<ushort>(i, j)];
-        // for (int k = 0; k < 16; k++) {
-        //   cout << "cos_table at [" << k << "," << i << "," << j
-        //        << "]:" << cos_table[k * maxValue +
-        //               (int)spread_ori.at<ushort>(i, j)] << endl;
-        // }
-        // for (int k = 0; k < 16; k++) {
-        //   cout << "response_map at [" << k << "," << i << "," << j
-        //        << "]:" << response_maps[k].at<float>(i, j) << endl;
-        // }
-        // cin.get();
+        const uchar(*lut)[16] = response_table.data[orientation];
+        response_maps[orientation].at<uchar>(i, j) =
+            max(max(lut[0][n0], lut[1][n1]), max(lut[2][n2], lut[3][n3]));
       }
-      // cin.get();
     }
   }
 }
 
 void Detector::para_computeSimilarityMap(
     vector<LinearMemories> &memories, const vector<Template::Feature> &features,
-    LinearMemories &similarity, int start, int end) {
+    SimilarityMemories &similarity, int start, int end) {
+  const int length = similarity.linear_size();
   // 并行计算
   for (int i = start; i < end; i++) {
+    int *dst = similarity.ptr(i);
     for (const auto &point : features) {
       Point cur = Point(point.x + i % 4, point.y + i / 4);
 
@@ -519,22 +535,32 @@ void Detector::para_computeSimilarityMap(
       int offset =
           ((cur.y - mod_y) / 4) * similarity.cols + (cur.x - mod_x) / 4;
 
-      for (int j = 0; j < similarity.linear_size(); j++) {
-        similarity.at(i, j) +=
-            memories[point.label].at(mod_y * 4 + mod_x, j + offset);
-      }
+      // 线性存储器之外的位置响应为 0, 只累加 [j_begin, j_end), 连续的字节
+      // 加到 int 上, 可被编译器向量化
+      const uchar *src = memories[point.label].ptr(mod_y * 4 + mod_x);
+      const int j_begin = max(0, -offset);
+      const int j_end = min(length, length - offset);
+      for (int j = j_begin; j < j_end; j++)
+        dst[j] += src[j + offset];
     }
   }
 }
 
 void Detector::computeSimilarityMap(vector<LinearMemories> &memories,
                                     const vector<Template::Feature> &features,
-                                    LinearMemories &similarity) {
+                                    SimilarityMemories &similarity) {
+  ProfileScope scope(line2Dup::STAGE_SIMILARITY);
+  line2Dup::profileCount(line2Dup::COUNTER_TEMPLATES_EVALUATED, 1);
+  line2Dup::profileCount(line2Dup::COUNTER_FEATURES_EVALUATED, features.size());
   // similarity[i][j]
   // i -> order in kernel ; j -> index in linear vector
-  similarity.create(16, memories[0].linear_size(), 0.0f);
+  similarity.create(16, memories[0].linear_size(), 0);
   similarity.rows = memories[0].rows;
   similarity.cols = memories[0].cols;
+  // 累加值只在 unlinearize 输出时转化为 100 分制
+  similarity.score_scale =
+      features.empty() ? 0.0f
+                       : 100.0f / ((float)features.size() * RESPONSE_SCALE);
 
   const int numThreads = thread::hardware_concurrency();
   const int workloadPerThread = (16 + numThreads - 1) / numThreads;
@@ -547,7 +573,9 @@ void Detector::computeSimilarityMap(vector<LinearMemories> &memories,
     int start = t * workloadPerThread;
     int end = min(start + workloadPerThread, 16);
 
-    threads.emplace_back([&memories, &features, &similarity, start, end] {
+    line2Dup::Profile *profile = line2Dup::Profile::current();
+    threads.emplace_back([&memories, &features, &similarity, start, end, profile] {
+      line2Dup::ProfileBinding binding(profile);
       para_computeSimilarityMap(memories, features, similarity, start, end);
     });
 
@@ -558,14 +586,6 @@ void Detector::computeSimilarityMap(vector<LinearMemories> &memories,
   for (auto &thread : threads) {
     thread.join();
   }
-
-  // 转化为 100 分制
-  for (int i = 0; i < 16; i++) {
-    for (int j = 0; j < memories[0].linear_size(); j++) {
-      similarity.at(i, j) =
-          similarity.at(i, j) / (float)features.size() * 100.0f;
-    }
-  }
 }
 
 void Detector::localSimilarityMap(vector<LinearMemories> &memories,
@@ -573,10 +593,12 @@ void Detector::localSimilarityMap(vector<LinearMemories> &memories,
                                   Mat &similarity_map,
                                   vector<Rect> &rois) {
   CV_Assert(!rois.empty());
+  ProfileScope scope(line2Dup::STAGE_PYRAMID_REFINE);
   int n_rows = memories[0].rows * 4;
   int n_cols = memories[0].cols * 4;
 
-  similarity_map = Mat::zeros(n_rows, n_cols, CV_32F);
+  // 以 int 累加量化响应, 最后转化为 100 分制
+  Mat similarity_sum = Mat::zeros(n_rows, n_cols, CV_32S);
 
   for (size_t k = 0; k < rois.size(); k++) {
     for (int i = rois[k].y; i <= rois[k].y + rois[k].height; i++) {
@@ -592,7 +614,7 @@ void Detector::localSimilarityMap(vector<LinearMemories> &memories,
           // 计算坐标在 TxT 分块中的顺序索引
           int order_kernel = (cur.y % 4) * 4 + cur.x % 4;
           // 计算相似度矩阵
-          similarity_map.at<float>(i, j) +=
+          similarity_sum.at<int>(i, j) +=
               memories[point.label].at(order_kernel, position_cur);
         }
       }
@@ -600,11 +622,13 @@ void Detector::localSimilarityMap(vector<LinearMemories> &memories,
   }
 
   // 转化为 100 分制
-  similarity_map = similarity_map / (float)features.size() * 100.0f;
+  similarity_sum.convertTo(similarity_map, CV_32F,
+                           100.0 / ((double)features.size() * RESPONSE_SCALE));
 }
 
 void Detector::linearize(std::vector<Mat> &response_maps,
                          vector<LinearMemories> &linearized_memories) {
+  ProfileScope scope(line2Dup::STAGE_LINEARIZE);
   // 计算分块后矩阵的行数, 列数
   int n_rows = response_maps[0].rows / 4;
   int n_cols = response_maps[0].cols / 4;
@@ -637,7 +661,7 @@ void Detector::linearize(std::vector<Mat> &response_maps,
             int order_in_kernel = di * 4 + dj;
             linearized_memories[orientation].at(order_in_kernel,
                                                 i * n_cols + j) =
-                response_maps[orientation].at<float>(4 * i + di, 4 * j + dj);
+                response_maps[orientation].at<uchar>(4 * i + di, 4 * j + dj);
             // cout << "linearized_memories:" <<
             // linearized_memories[orientation].at(di * 4 + dj,
             //                                     i * n_cols + j) << endl;
@@ -649,7 +673,7 @@ void Detector::linearize(std::vector<Mat> &response_maps,
   }
 }
 
-void Detector::unlinearize(LinearMemories &similarity,
+void Detector::unlinearize(SimilarityMemories &similarity,
                            Mat &similarity_map) {
   similarity_map =
       Mat::zeros(similarity.rows * 4, similarity.cols * 4, CV_32F);
@@ -657,14 +681,15 @@ void Detector::unlinearize(LinearMemories &similarity,
     for (int j = 0; j < similarity.linear_size(); j++) {
       int u = (j / similarity.cols) * 4 + i / 4;
       int v = (j % similarity.cols) * 4 + i % 4;
-      similarity_map.at<float>(u, v) = similarity.at(i, j);
+      similarity_map.at<float>(u, v) =
+          similarity.at(i, j) * similarity.score_scale;
     }
   }
 }
 
 void Detector::produceRoi(Mat &similarity_map,
                           std::vector<Rect> &roi_list, int lower_score) {
-  Timer time;
+  ProfileScope scope(line2Dup::STAGE_CANDIDATE_REGIONS);
   Mat binary_mat;
   Mat labels, stats, centroids;
 
@@ -683,11 +708,11 @@ void Detector::produceRoi(Mat &similarity_map,
                  stats.at<int>(i, CC_STAT_HEIGHT));
     roi_list.push_back(roi);
   }
-  __time__produceroi__ += time.elapsed();
 }
 
 void Detector::addSourceImage(const Mat &src, int pyramid_level, Mat mask,
                               const String &memories_id) {
+  ProfileScope scope(line2Dup::STAGE_PREPROCESS);
   ImagePyramid src_pyramid;
   Mat target_src;
   if (!mask.empty())
@@ -803,6 +828,7 @@ void Detector::match(const Mat &sourceImage,
 }
 
 void line2d::Detector::matchClass(const cv::String &match_id) {
+  ProfileScope scope(line2Dup::STAGE_MATCH);
   memory_pyramid mp = memories_map[match_id];
   vector<template_pyramid> vtp = templates_map[match_id];
   matches points = matches_map[match_id];
@@ -840,27 +866,3 @@ void Detector::draw(cv::Mat background, const cv::String &match_id, int template
   waitKey();
   destroyWindow("matchImage");
 }
-
-/// @todo 转为离线存储计算
-void Detector::init_costable() {
-  int maxValue = std::numeric_limits<ushort>::max();
-  cos_table.resize(16 * maxValue);
-  float maxCos;
-  // Timer time;
-  for (int i = 0; i < 16; i++) {
-    // time.out(to_string(i+1)+"轮循环 65535 * 16 计算开始");
-    for (int bit = 1; bit <= maxValue; bit++) {
-      maxCos = -2.0f;  // < -1 = min_theta cos theta
-      for (int k = 0; k < 16; k++) {
-        if (bit & (1 << k)) {
-          maxCos = maxCos < cos(abs(i - k) * _degree_(11.25f))
-                       ? cos(abs(i - k) * _degree_(11.25f))
-                       : maxCos;
-        }
-      }
-      cos_table[i * maxValue + bit] = maxCos;
-    }
-    // time.out(to_string(i+1)+"轮循环 65535 * 16 计算结束");
-    // cin.get();
-  }
-}
\ No newline at end of file
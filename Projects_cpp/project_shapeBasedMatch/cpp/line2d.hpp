@@ -239,27 +239,35 @@ public:
     }
   };
 
-  class LinearMemories {
+  /// @brief 线性存储器: 4x4 分块内的 16 个位置各一个长度为 rows * cols 的
+  /// 线性数组. 响应以字节存储, 相似度以 int 累加, 只在输出时换算为 100 分制
+  template <typename _Tp> class LinearMemoriesT {
   private:
-    std::vector<std::vector<float>> memories; // 线性存储器
+    std::vector<std::vector<_Tp>> memories; // 线性存储器
 
   public:
     int rows;
     int cols;
+    float score_scale; // 相似度乘以该系数为 100 分制得分, 响应不使用
+
+    LinearMemoriesT() : rows(0), cols(0), score_scale(1.0f) {}
 
     int linear_size() { return memories[0].size(); }
 
-    void create(size_t x, size_t y, float value = 0.0f) {
-      memories =
-          std::vector<std::vector<float>>(x, std::vector<float>(y, value));
+    void create(size_t x, size_t y, _Tp value = _Tp()) {
+      memories = std::vector<std::vector<_Tp>>(x, std::vector<_Tp>(y, value));
     }
 
+    /// @brief 第 i 个线性存储器的起始地址
+    _Tp *ptr(size_t i) { return memories[i].data(); }
+    const _Tp *ptr(size_t i) const { return memories[i].data(); }
+
     /// @brief memories[i][j] -> linearized Mat S_{orientaion}(c)
     /// @param i -> order in TxT kernel
     /// @param j -> index in linear vector
     /// @return &memories[i][j]
-    float &at(size_t i, size_t j) {
-      static float default_value = 0.0f; // 静态的默认值
+    _Tp &at(size_t i, size_t j) {
+      static _Tp default_value = _Tp(); // 静态的默认值
       if (i < 0 || i >= memories.size())
         return default_value;
       if (j < 0 || j >= memories[0].size())
@@ -268,6 +276,12 @@ public:
     }
   };
 
+  /// 响应的量化级数: 余弦 [0, 1] 线性量化为 [0, RESPONSE_SCALE], 负余弦记为 0
+  static const int RESPONSE_SCALE = 100;
+
+  typedef LinearMemoriesT<uchar> LinearMemories;   // 8 位响应
+  typedef LinearMemoriesT<int> SimilarityMemories; // 32 位相似度
+
   Detector();
 
   static void quantize(const cv::Mat &edges, const cv::Mat &angles,
@@ -283,12 +297,12 @@ public:
   static void
   para_computeSimilarityMap(std::vector<LinearMemories> &memories,
                             const std::vector<Template::Feature> &features,
-                            LinearMemories &similarity, int start, int end);
+                            SimilarityMemories &similarity, int start, int end);
 
   static void
   computeSimilarityMap(std::vector<LinearMemories> &memories,
                        const std::vector<Template::Feature> &features,
-                       LinearMemories &similarity);
+                       SimilarityMemories &similarity);
 
   static void localSimilarityMap(std::vector<LinearMemories> &memories,
                                  const std::vector<Template::Feature> &features,
@@ -298,7 +312,8 @@ public:
   static void linearize(std::vector<cv::Mat> &response_maps,
                         std::vector<LinearMemories> &linearized_memories);
 
-  static void unlinearize(LinearMemories &similarity, cv::Mat &similarity_map);
+  /// @brief 还原为 100 分制的 CV_32F 相似度图
+  static void unlinearize(SimilarityMemories &similarity, cv::Mat &similarity_map);
 
   static void produceRoi(cv::Mat &similarity_map,
                          std::vector<cv::Rect> &roi_list, int lower_score);
@@ -328,12 +343,8 @@ private:
   typedef std::vector<cv::Ptr<Template>> template_pyramid;
   typedef std::vector<MatchPoint> matches;
   std::map<cv::String, memory_pyramid> memories_map;
-  std::map<cv::String, vector<template_pyramid>> templates_map;
+  std::map<cv::String, std::vector<template_pyramid>> templates_map;
   std::map<cv::String, matches> matches_map;
-
-  static std::vector<float> cos_table;
-
-  void init_costable();
 };
 
 } // namespace line2d
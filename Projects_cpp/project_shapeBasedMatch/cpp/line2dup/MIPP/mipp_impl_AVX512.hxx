@@ -333,7 +333,7 @@
 
 	template <>
 	inline reg set1<uint8_t>(const uint8_t val) {
-		return _mm512_castsi512_ps(_mm512_set1_epi8(reinterpret_cast<const int8_t&>(val));
+		return _mm512_castsi512_ps(_mm512_set1_epi8(reinterpret_cast<const int8_t&>(val)));
 	}
 
 #elif defined(__MIC__) || defined(__KNCNI__)
@@ -0,0 +1,68 @@
+#ifndef LINE2DUP_KERNELS_HPP
+#define LINE2DUP_KERNELS_HPP
+
+#include <cstdint>
+#include <vector>
+
+namespace line2Dup {
+
+/// @brief 热点内核 (扩散, 响应图, 全图与窗口相似度) 的一组实现. 同一份源码
+/// kernels.simd.hpp 按指令集各编译一次, 运行时按 CPU 支持的最高指令集选用
+/// 一组, 同一个可执行文件可在不同代的 CPU 上以各自的最高速度运行.
+///
+/// 构建方式: kernels_sse2.cpp 与其余源文件以目标机器的最低指令集编译 (x86-64
+/// 默认即为 SSE2, 不要对整个工程使用 -mavx2 等选项), 其余内核文件分别加上
+///   kernels_sse42.cpp   -msse4.2
+///   kernels_avx2.cpp    -mavx2
+///   kernels_avx512.cpp  -mavx512f -mavx512bw
+/// 未以相应选项编译的内核文件不提供实现, 运行时自动跳过
+struct KernelTable {
+  const char *name; // 指令集名称, 如 "AVX2"
+
+  /// @brief dst(r, c) |= src(r, c), 行步长以元素为单位. 分别用于 16 个
+  /// 与 8 个方向的量化图像
+  void (*orRows16u)(const uint16_t *src, int src_stride, uint16_t *dst,
+                    int dst_stride, int width, int height);
+  void (*orRows8u)(const uint8_t *src, int src_stride, uint8_t *dst,
+                   int dst_stride, int width, int height);
+
+  /// @brief dst[i] = max_k lut[16 * k + nibbles[k][i]], k 属于 [0, n_nibbles)
+  /// @param nibbles n_nibbles (不大于 4) 行连续存放的半字节 (取值 [0, 16)),
+  /// 行步长为 total
+  void (*lookupResponses)(const uint8_t *nibbles, int n_nibbles,
+                          const uint8_t *lut, uint8_t *dst, int total);
+
+  /// @brief dst[j] = saturate(dst[j] + sum_k src[k][j]), j 属于 [begin, end),
+  /// 单个响应不超过 8
+  void (*accumulateSimilarity)(const uint8_t *const *src, int n_src,
+                               int16_t *dst, int begin, int end);
+
+  /// @brief 16 个位置的窗口行: dst[j] = saturate(sum_k src[k][j]), 按特征
+  /// 顺序逐个饱和累加, j 属于 [0, 16)
+  void (*accumulateWindowRow)(const uint8_t *const *src, int n_src,
+                              int16_t *dst);
+};
+
+/// @brief 当前 CPU 可用的最高指令集的内核, 首次调用时选定. 环境变量
+/// LINE2DUP_CPU 为某个指令集名称 (如 SSE4.2) 时不使用更高的指令集, 见
+/// selectKernels
+const KernelTable &kernels();
+
+/// @brief 本程序中编译进来且当前 CPU 支持的全部内核, 指令集由低到高
+std::vector<const KernelTable *> availableKernels();
+
+/// @brief 从 tables (指令集由低到高, 至少一组) 中选出不高于 limit 的最高
+/// 一组. limit 为空时选最高的一组; limit 为 SSE2, SSE4.2, AVX2, AVX-512
+/// 之外的名称时输出警告并选最低的一组
+const KernelTable *selectKernels(const std::vector<const KernelTable *> &tables,
+                                 const char *limit);
+
+/// 各指令集的内核, 未以相应选项编译时为空
+const KernelTable *kernelsSSE2();
+const KernelTable *kernelsSSE42();
+const KernelTable *kernelsAVX2();
+const KernelTable *kernelsAVX512();
+
+} // namespace line2Dup
+
+#endif // LINE2DUP_KERNELS_HPP
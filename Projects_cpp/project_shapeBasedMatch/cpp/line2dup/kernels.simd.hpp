@@ -0,0 +1,245 @@
+// 热点内核的实现, 由 kernels_*.cpp 在定义以下宏后包含, 每个指令集一次:
+//   LINE2DUP_KERNELS_NAMESPACE  存放本指令集实现的命名空间
+//   LINE2DUP_KERNELS_NAME       指令集名称
+// MIPP 的寄存器宽度由编译选项决定, 且全部为内联函数. 为避免不同指令集编译出
+// 的同名内联函数在链接时被合并成一份, MIPP 也包含在该命名空间中, 因此本文件
+// 不能与其他包含 MIPP 的头文件出现在同一个编译单元中
+
+#include "kernels.hpp"
+
+#include <algorithm>
+#include <cstring>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+// MIPP 包含的标准库头文件先在全局命名空间中包含, 之后的重复包含不生效
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <typeindex>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__linux__)
+#include <execinfo.h>
+#include <unistd.h>
+#endif
+
+namespace line2Dup {
+namespace LINE2DUP_KERNELS_NAMESPACE {
+
+#include "MIPP/mipp.h"
+
+static inline int16_t saturate16(int v) {
+  return static_cast<int16_t>(std::min(std::max(v, -32768), 32767));
+}
+
+template <typename T>
+static void orRows(const T *src, const int src_stride, T *dst,
+                   const int dst_stride, const int width, const int height) {
+  // MIPP 的整数寄存器只有有符号类型, 按位或与符号无关
+  typedef typename std::make_signed<T>::type S;
+  const int N = mipp::N<S>();
+  const bool src_aligned =
+      reinterpret_cast<uintptr_t>(src) % mipp::RequiredAlignment == 0 &&
+      (src_stride * sizeof(T)) % mipp::RequiredAlignment == 0;
+
+  for (int r = 0; r < height; ++r) {
+    const S *src_r = reinterpret_cast<const S *>(src);
+    S *dst_r = reinterpret_cast<S *>(dst);
+    int c = 0;
+
+    mipp::Reg<S> src_v, dst_v;
+    // 源地址对齐时使用对齐读取
+    if (src_aligned) {
+      for (; c < width - N + 1; c += N) {
+        src_v.load(src_r + c);
+        dst_v.loadu(dst_r + c);
+        mipp::orb(dst_v, src_v).storeu(dst_r + c);
+      }
+    }
+    // 否则退回非对齐读取
+    else {
+      for (; c < width - N + 1; c += N) {
+        src_v.loadu(src_r + c);
+        dst_v.loadu(dst_r + c);
+        mipp::orb(dst_v, src_v).storeu(dst_r + c);
+      }
+    }
+    // 处理行末不足一个寄存器宽度的像素
+    for (; c < width; ++c)
+      dst[c] |= src[c];
+
+    src += src_stride;
+    dst += dst_stride;
+  }
+}
+
+#if defined(has_shuff_int8_t) && defined(has_max_int8_t)
+#define LINE2DUP_SIMD_LUT
+/// @brief 以 index 中每个字节的低 4 位为下标查 16 项表, table 的每 16 字节均为
+/// 同一张表的拷贝, 因而按 128 位分组的字节重排即可完成查表
+static inline mipp::Reg<uint8_t> lookup16(const mipp::Reg<uint8_t> &table,
+                                          const mipp::Reg<uint8_t> &index) {
+#if defined(__AVX512BW__)
+  return _mm512_castsi512_ps(_mm512_shuffle_epi8(
+      _mm512_castps_si512(table.r), _mm512_castps_si512(index.r)));
+#elif defined(__AVX2__)
+  return _mm256_castsi256_ps(_mm256_shuffle_epi8(
+      _mm256_castps_si256(table.r), _mm256_castps_si256(index.r)));
+#else
+  return mipp::shuff(table, index);
+#endif
+}
+#endif
+
+/// @brief 半字节个数 NIBBLES 在编译期确定, 查表与取最大值完全展开
+template <int NIBBLES>
+static void lookupNibbles(const uint8_t *nibbles, const uint8_t *lut,
+                          uint8_t *dst, const int total) {
+  int i = 0;
+#ifdef LINE2DUP_SIMD_LUT
+  // 每个半字节的 16 项子表填满整个寄存器. 寄存器放在栈上, std::vector 不保证
+  // AVX-512 寄存器所需的 64 字节对齐
+  const int N = mipp::N<uint8_t>();
+  mipp::Reg<uint8_t> lut_v[NIBBLES];
+  std::vector<uint8_t> table(N);
+  for (int k = 0; k < NIBBLES; k++) {
+    for (int j = 0; j < N; j++)
+      table[j] = lut[16 * k + j % 16];
+    lut_v[k].loadu(table.data());
+  }
+
+  mipp::Reg<uint8_t> nibble_v, res_v;
+  for (; i < total - N + 1; i += N) {
+    nibble_v.loadu(nibbles + i);
+    res_v = lookup16(lut_v[0], nibble_v);
+    for (int k = 1; k < NIBBLES; k++) {
+      nibble_v.loadu(nibbles + static_cast<size_t>(k) * total + i);
+      res_v = mipp::max(res_v, lookup16(lut_v[k], nibble_v));
+    }
+    res_v.storeu(dst + i);
+  }
+#endif
+
+  for (; i < total; i++) {
+    uint8_t max_score = lut[nibbles[i]];
+    for (int k = 1; k < NIBBLES; k++)
+      max_score = std::max(
+          max_score, lut[16 * k + nibbles[static_cast<size_t>(k) * total + i]]);
+    dst[i] = max_score;
+  }
+}
+
+static void lookupResponses(const uint8_t *nibbles, const int n_nibbles,
+                            const uint8_t *lut, uint8_t *dst, const int total) {
+  switch (n_nibbles) {
+  case 1:
+    return lookupNibbles<1>(nibbles, lut, dst, total);
+  case 2:
+    return lookupNibbles<2>(nibbles, lut, dst, total);
+  case 3:
+    return lookupNibbles<3>(nibbles, lut, dst, total);
+  case 4:
+    return lookupNibbles<4>(nibbles, lut, dst, total);
+  default:
+    assert(false && "at most 4 nibbles");
+  }
+}
+
+/// 8 位累加器中一次最多累加的特征数: 单个响应不超过 8, 15 * 8 = 120 不会
+/// 超出 int8 的表示范围, 之后再符号扩展到 16 位
+static const int SIMILARITY_BATCH = 15;
+
+static void accumulateSimilarity(const uint8_t *const *src, const int n_src,
+                                 int16_t *dst, const int begin, const int end) {
+  int j = begin;
+  // MIPP 在 SSE4.1 以下没有 int8 到 int16 的转换 (mipp::cvt 抛出异常), 退回标量
+#if defined(MIPP_BW) && !(defined(__SSE2__) && !defined(__SSE4_1__))
+  const int N8 = mipp::N<int8_t>();
+  const int N16 = mipp::N<int16_t>();
+  const mipp::Reg<int8_t> zero_v = (int8_t)0;
+  mipp::Reg<int8_t> src_v, sum_v;
+  mipp::Reg<int16_t> lo_v, hi_v;
+  for (; j + N8 <= end; j += N8) {
+    lo_v.loadu(dst + j);
+    hi_v.loadu(dst + j + N16);
+    for (int k = 0; k < n_src; k += SIMILARITY_BATCH) {
+      const int k_end = std::min(n_src, k + SIMILARITY_BATCH);
+      sum_v = zero_v;
+      for (int b = k; b < k_end; b++) {
+        src_v.loadu(reinterpret_cast<const int8_t *>(src[b] + j));
+        sum_v = mipp::add(sum_v, src_v);
+      }
+#if defined(__AVX512BW__)
+      // MIPP 取高低两半所用的内建函数在 g++ 12 中以未初始化的寄存器作为
+      // 掩码的源操作数, 内联后报 -Wmaybe-uninitialized. 这里改用全掩码的
+      // maskz 形式取出两半, 源操作数为零, 结果相同
+      const __m512i sum = _mm512_castps_si512(sum_v.r);
+      const __m256i sum_lo = _mm512_maskz_extracti64x4_epi64((__mmask8)-1, sum, 0);
+      const __m256i sum_hi = _mm512_maskz_extracti64x4_epi64((__mmask8)-1, sum, 1);
+      lo_v = mipp::add(lo_v, mipp::Reg<int16_t>(_mm512_castsi512_ps(_mm512_cvtepi8_epi16(sum_lo))));
+      hi_v = mipp::add(hi_v, mipp::Reg<int16_t>(_mm512_castsi512_ps(_mm512_cvtepi8_epi16(sum_hi))));
+#else
+      lo_v = mipp::add(lo_v, mipp::cvt<int8_t, int16_t>(sum_v.low()));
+      hi_v = mipp::add(hi_v, mipp::cvt<int8_t, int16_t>(sum_v.high()));
+#endif
+    }
+    lo_v.storeu(dst + j);
+    hi_v.storeu(dst + j + N16);
+  }
+#endif
+
+  for (; j < end; j++) {
+    int sum = dst[j];
+    for (int k = 0; k < n_src; k++)
+      sum += src[k][j];
+    dst[j] = saturate16(sum);
+  }
+}
+
+static void accumulateWindowRow(const uint8_t *const *src, const int n_src,
+                                int16_t *dst) {
+#if defined(__AVX2__)
+  __m256i acc = _mm256_setzero_si256();
+  for (int k = 0; k < n_src; k++) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src[k]));
+    acc = _mm256_adds_epi16(acc, _mm256_cvtepu8_epi16(v));
+  }
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst), acc);
+#elif defined(__SSE4_1__)
+  __m128i acc_lo = _mm_setzero_si128(), acc_hi = _mm_setzero_si128();
+  for (int k = 0; k < n_src; k++) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src[k]));
+    acc_lo = _mm_adds_epi16(acc_lo, _mm_cvtepu8_epi16(v));
+    acc_hi = _mm_adds_epi16(acc_hi, _mm_cvtepu8_epi16(_mm_srli_si128(v, 8)));
+  }
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), acc_lo);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 8), acc_hi);
+#else
+  // 响应非负, 逐个饱和累加与求和后饱和的结果相同
+  int sum[16] = {0};
+  for (int k = 0; k < n_src; k++)
+    for (int j = 0; j < 16; j++)
+      sum[j] += src[k][j];
+  for (int j = 0; j < 16; j++)
+    dst[j] = saturate16(sum[j]);
+#endif
+}
+
+static const KernelTable table = {
+    LINE2DUP_KERNELS_NAME, orRows<uint16_t>,        orRows<uint8_t>,
+    lookupResponses,       accumulateSimilarity, accumulateWindowRow};
+
+} // namespace LINE2DUP_KERNELS_NAMESPACE
+} // namespace line2Dup
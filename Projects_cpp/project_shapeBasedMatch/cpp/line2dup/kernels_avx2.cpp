@@ -0,0 +1,16 @@
+// 以 -mavx2 编译, 否则不提供实现
+#if defined(__AVX2__)
+#define LINE2DUP_KERNELS_NAMESPACE avx2
+#define LINE2DUP_KERNELS_NAME "AVX2"
+#include "kernels.simd.hpp"
+#else
+#include "kernels.hpp"
+#endif
+
+const line2Dup::KernelTable *line2Dup::kernelsAVX2() {
+#if defined(__AVX2__)
+  return &avx2::table;
+#else
+  return nullptr;
+#endif
+}
@@ -0,0 +1,16 @@
+// 以 -mavx512f -mavx512bw 编译, 否则不提供实现
+#if defined(__AVX512BW__)
+#define LINE2DUP_KERNELS_NAMESPACE avx512
+#define LINE2DUP_KERNELS_NAME "AVX-512"
+#include "kernels.simd.hpp"
+#else
+#include "kernels.hpp"
+#endif
+
+const line2Dup::KernelTable *line2Dup::kernelsAVX512() {
+#if defined(__AVX512BW__)
+  return &avx512::table;
+#else
+  return nullptr;
+#endif
+}
@@ -0,0 +1,75 @@
+// 以工程的默认选项编译 (x86-64 默认即为 SSE2). 作为运行时的最低一级, 总是提供
+// 实现, 并负责按 CPU 选择内核
+#define LINE2DUP_KERNELS_NAMESPACE sse2
+#define LINE2DUP_KERNELS_NAME "SSE2"
+#include "kernels.simd.hpp"
+
+#include <opencv2/core.hpp>
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+const line2Dup::KernelTable *line2Dup::kernelsSSE2() { return &sse2::table; }
+
+vector<const line2Dup::KernelTable *> line2Dup::availableKernels() {
+  // CPU 支持情况由 OpenCV 通过 cpuid 查询
+  const bool has_sse42 = cv::checkHardwareSupport(CV_CPU_SSE4_2);
+  const bool has_avx2 = cv::checkHardwareSupport(CV_CPU_AVX2);
+  const bool has_avx512 = cv::checkHardwareSupport(CV_CPU_AVX_512F) &&
+                          cv::checkHardwareSupport(CV_CPU_AVX_512BW);
+
+  vector<const KernelTable *> tables(1, kernelsSSE2());
+  if (has_sse42 && kernelsSSE42())
+    tables.push_back(kernelsSSE42());
+  if (has_avx2 && kernelsAVX2())
+    tables.push_back(kernelsAVX2());
+  if (has_avx512 && kernelsAVX512())
+    tables.push_back(kernelsAVX512());
+  return tables;
+}
+
+// 指令集由低到高, 与各内核文件的 LINE2DUP_KERNELS_NAME 一致
+static const char *const kernelLevels[] = {"SSE2", "SSE4.2", "AVX2", "AVX-512"};
+static const int numKernelLevels =
+    static_cast<int>(sizeof(kernelLevels) / sizeof(kernelLevels[0]));
+
+/// @brief 指令集名称在 kernelLevels 中的序号, 未知的名称为 -1
+static int kernelLevel(const char *name) {
+  for (int i = 0; i < numKernelLevels; i++)
+    if (strcmp(kernelLevels[i], name) == 0)
+      return i;
+  return -1;
+}
+
+const line2Dup::KernelTable *
+line2Dup::selectKernels(const vector<const KernelTable *> &tables,
+                        const char *limit) {
+  CV_Assert(!tables.empty());
+  if (!limit)
+    return tables.back();
+
+  int requested = kernelLevel(limit);
+  if (requested < 0) {
+    cerr << "LINE2DUP_CPU=" << limit << " 不是已知的指令集 (";
+    for (int i = 0; i < numKernelLevels; i++)
+      cerr << (i ? ", " : "") << kernelLevels[i];
+    cerr << "), 使用 " << tables.front()->name << endl;
+    return tables.front();
+  }
+
+  // 所请求的指令集不可用时退到其下最高的一组
+  const KernelTable *selected = tables.front();
+  for (const KernelTable *table : tables)
+    if (kernelLevel(table->name) <= requested)
+      selected = table;
+  return selected;
+}
+
+const line2Dup::KernelTable &line2Dup::kernels() {
+  static const KernelTable *const selected =
+      selectKernels(availableKernels(), getenv("LINE2DUP_CPU"));
+  return *selected;
+}
@@ -0,0 +1,16 @@
+// 以 -msse4.2 编译, 否则不提供实现
+#if defined(__SSE4_2__)
+#define LINE2DUP_KERNELS_NAMESPACE sse42
+#define LINE2DUP_KERNELS_NAME "SSE4.2"
+#include "kernels.simd.hpp"
+#else
+#include "kernels.hpp"
+#endif
+
+const line2Dup::KernelTable *line2Dup::kernelsSSE42() {
+#if defined(__SSE4_2__)
+  return &sse42::table;
+#else
+  return nullptr;
+#endif
+}
@@ -1,4 +1,7 @@
 #include "line2dup.hpp"
+#include "kernels.hpp"
+#include "scatteredSelection.hpp"
+#include "templateLibrary.hpp"
 using namespace cv;
 using namespace std;
 using namespace line2Dup;
@@ -26,9 +29,13 @@ void colormap(const Mat &quantized, Mat &dst) {
   colors[14] = Vec3b(255, 165, 0);   // Orange
   colors[15] = Vec3b(128, 0, 0);     // Brown
 
+  // 8 个方向的量化图像为 CV_8U
+  Mat bits;
+  quantized.convertTo(bits, CV_16U);
+
   dst = Mat::zeros(quantized.size(), CV_8UC3);
   for (int r = 0; r < dst.rows; r++) {
-    const ushort *quad_r = quantized.ptr<ushort>(r);
+    const ushort *quad_r = bits.ptr<ushort>(r);
     Vec3b *dst_r = dst.ptr<Vec3b>(r);
     for (int c = 0; c < dst.cols; c++) {
       for (int k = 0; k < 16; k++)
@@ -82,7 +89,7 @@ void ShapeTemplate::write(FileStorage &fs) const {
   fs << "]";
 }
 
-Ptr<ShapeTemplate> ShapeTemplate::relocate(float new_scale, float new_angle) {
+Ptr<ShapeTemplate> ShapeTemplate::relocate(float new_scale, float new_angle) const {
   Ptr<ShapeTemplate> ptp = makePtr<ShapeTemplate>(pyramid_level, scale * new_scale, angle - new_angle);
   
   if (abs(new_scale - 1.0) < line2d_eps && abs(new_angle - 0.0) < line2d_eps) {
@@ -93,12 +100,14 @@ Ptr<ShapeTemplate> ShapeTemplate::relocate(float new_scale, float new_angle) {
     return ptp;
   }
 
-  // 对矩形选框进行旋转缩放
+  // 对矩形选框进行旋转缩放. 选框与特征点都以特征坐标原点为参照, 二者
+  // 绕原点旋转缩放, 匹配位置即原点在源图像中的位置
   RotatedRect &tb = ptp->box;
+  tb = box;
   Point2f vertices[4];
   Point2f dstPoints[3];
   tb.points(vertices);
-  Mat rotate_mat = getRotationMatrix2D(tb.center, new_scale, new_angle);
+  Mat rotate_mat = getRotationMatrix2D(Point2f(0, 0), new_scale, new_angle);
 
   // 只用选取 3 个顶点进行变换
   for (int i = 0; i < 3; i++) {
@@ -117,8 +126,8 @@ Ptr<ShapeTemplate> ShapeTemplate::relocate(float new_scale, float new_angle) {
 
   // 对特征点序列进行旋转缩放
   vector<Gradient> &relocated_featrues = ptp->features;
-  vector<Gradient>::iterator it = features.begin(),
-                             it_end = features.end();
+  vector<Gradient>::const_iterator it = features.begin(),
+                                   it_end = features.end();
 
   for (; it != it_end; it++) {
     double new_x = rotate_mat.at<double>(0, 0) * (*it).x +
@@ -143,10 +152,12 @@ void cropTemplate(ShapeTemplate &templ) {
   int offset_x = templ.box.center.x;
   int offset_y = templ.box.center.y;
 
+  // 特征点与选框一同平移, 选框中心此后以特征坐标原点为参照
   for (int i = 0; i < (int)templ.features.size(); i++) {
     templ.features[i].x -= offset_x;
     templ.features[i].y -= offset_y;
   }
+  templ.box.center -= Point2f(offset_x, offset_y);
 }
 
 /// class ColorGradientPyramid
@@ -154,10 +165,14 @@ void cropTemplate(ShapeTemplate &templ) {
 ColorGradientPyramid::ColorGradientPyramid(const Mat &_src, const Mat &_mask,
                                            float _magnitude_threshold,
                                            int _count_kernel_size,
-                                           size_t _num_features)
-    : pyramid_level(0), src(_src), mask(_mask),
+                                           size_t _num_features,
+                                           int _num_orientations,
+                                           ThreadPool *_pool)
+    : pyramid_level(0), src(_src), mask(_mask), keep_angle(true),
       magnitude_threshold(_magnitude_threshold),
-      count_kernel_size(_count_kernel_size), num_features(_num_features) {
+      count_kernel_size(_count_kernel_size), num_features(_num_features),
+      num_orientations(_num_orientations), pool(_pool) {
+  CV_Assert(num_orientations == 8 || num_orientations == 16);
   update();
 }
 
@@ -169,33 +184,8 @@ inline int bit2label(const ushort &bit) {
   return 0;
 }
 
-void selectScatteredFeatures(const vector<Candidate> &candidates,
-                             vector<Gradient> &features, size_t num_features,
-                             float distance) {
-  features.clear();
-  float distance_sq = distance * distance;
-  int i = 0;
-
-  while (features.size() < num_features) {
-    const Candidate &c = candidates[i];
-    bool keep = true;
-    for (int j = 0; (j < (int)features.size()) && keep; j++) {
-      Feature &fj = features[j];
-      keep = (c.x - fj.x) * (c.x - fj.x) + (c.y - fj.y) * (c.y - fj.y) >=
-             distance_sq;
-    }
-    if (keep)
-      features.push_back(c);
-
-    if (++i == (int)candidates.size()) {
-      i = 0;
-      distance -= 1.0f;
-      distance_sq = distance * distance;
-    }
-  }
-}
-
 bool ColorGradientPyramid::extractTemplate(ShapeTemplate &templ) const {
+  CV_Assert(angle.size() == magnitude.size());
   Mat local_mask;
   if (!mask.empty()) {
     erode(mask, local_mask, Mat(), Point(-1, -1), 1, BORDER_REPLICATE);
@@ -209,7 +199,7 @@ bool ColorGradientPyramid::extractTemplate(ShapeTemplate &templ) const {
       if (no_mask || mask.at<uchar>(r, l)) {
         const float &angle_at_rl = angle.at<float>(r, l);
         const float &magnitude_at_rl = magnitude.at<float>(r, l);
-        if (angle_at_rl > 0 && magnitude_at_rl > magnitude_threshold) {
+        if (angle_at_rl > 0 && magnitude_at_rl > raw_magnitude_threshold) {
           candidates.push_back(Candidate(l, r, angle_at_rl, magnitude_at_rl));
         }
       }
@@ -229,9 +219,10 @@ bool ColorGradientPyramid::extractTemplate(ShapeTemplate &templ) const {
   return true;
 }
 
-void ColorGradientPyramid::pyrDown() {
+void ColorGradientPyramid::pyrDown(bool _keep_angle) {
   num_features = num_features >> 2;
   pyramid_level++;
+  keep_angle = _keep_angle;
 
   Size size(src.cols >> 1, src.rows >> 1);
   Mat next_src;
@@ -247,322 +238,1096 @@ void ColorGradientPyramid::pyrDown() {
   update();
 }
 
-static void quantizeAngle(Mat &magnitude, Mat &angle, Mat &quantized_angle,
-                          float threshold, int kernel_size) {
-  Mat quanized_unfiltered;
-  angle.convertTo(quanized_unfiltered, CV_8U, 32.0 / 360.0);
-
-  for (int r = 0; r < angle.rows; r++) {
-    uchar *quan_r = quanized_unfiltered.ptr(r);
-    for (int c = 0; c < angle.cols; c++) {
-      quan_r[c] &= 15;
-    }
-  }
-
-  quantized_angle = Mat::zeros(angle.size(), CV_16U);
-
-  int dx[kernel_size], dy[kernel_size];
-  int total_kernel = kernel_size * kernel_size;
-  int NEIGHBOR_THRESHOLD = total_kernel / 2 + 1;
-  for (int i = 0; i < kernel_size; i++)
-    dx[i] = dy[i] = -(kernel_size / 2) + i;
+/// @brief quantizeAngle 的实现, 方向数 BINS 在编译期确定. 图像按行分块,
+/// 块内对每列维护纵向 kernel_size 行的直方图, 逐行增量更新, 再沿行滑动
+/// 窗口直方图, 每个像素的代价为 O(kernel_size) 而不是 O(kernel_size^2)
+template <int BINS>
+static void quantizeAngleImpl(const Mat &magnitude, const Mat &labels,
+                              Mat &quantized_angle, float threshold,
+                              int kernel_size, ThreadPool *pool) {
+  CV_Assert(kernel_size > 0 && kernel_size % 2 == 1 && kernel_size < 181);
+  CV_Assert(labels.type() == CV_8U && magnitude.size() == labels.size());
+  typedef Orientations<BINS> Ori;
+  const int rows = labels.rows, cols = labels.cols;
+  const int R = kernel_size / 2;
+  const int16_t NEIGHBOR_THRESHOLD =
+      static_cast<int16_t>(kernel_size * kernel_size / 2 + 1);
+
+  quantized_angle = Mat::zeros(labels.size(), Ori::depth);
+  if (rows == 0 || cols == 0)
+    return;
+
+  // 有线程池时每个线程约两块, 否则整幅图像为一块
+  const int workers = pool ? pool->size() : 1;
+  const int band_rows =
+      workers > 1 ? max(16, (rows + 2 * workers - 1) / (2 * workers)) : rows;
+  const int num_bands = (rows + band_rows - 1) / band_rows;
+
+  auto quantizeBand = [&](int band, int) {
+    const int r0 = band * band_rows, r1 = min(rows, r0 + band_rows);
+    const int N = mipp::N<int16_t>();
+    const int vec_bins = N <= BINS ? BINS / N * N : 0;
+
+    // column_hist[c * BINS + b]: 第 c 列当前窗口内方向为 b 的像素数
+    vector<int16_t> column_hist(cols * BINS, 0);
+    auto addRow = [&](int u, int16_t delta) {
+      const uchar *label_u = labels.ptr(u);
+      for (int c = 0; c < cols; c++)
+        column_hist[c * BINS + Ori::fromLabel(label_u[c])] += delta;
+    };
+    auto slide = [&](int16_t *window, int c, int16_t sign) {
+      const int16_t *hist = &column_hist[c * BINS];
+      int b = 0;
+      for (; b < vec_bins; b += N) {
+        mipp::Reg<int16_t> window_v = mipp::loadu<int16_t>(window + b);
+        mipp::Reg<int16_t> hist_v = mipp::loadu<int16_t>(hist + b);
+        window_v = sign > 0 ? window_v + hist_v : window_v - hist_v;
+        window_v.storeu(window + b);
+      }
+      for (; b < BINS; b++)
+        window[b] += sign * hist[b];
+    };
+    auto maxVotes = [&](const int16_t *window) {
+      int16_t max_votes = 0;
+      int b = 0;
+      if (vec_bins > 0) {
+        mipp::Reg<int16_t> max_v = mipp::loadu<int16_t>(window);
+        for (b = N; b < vec_bins; b += N)
+          max_v = mipp::max(max_v, mipp::Reg<int16_t>(mipp::loadu<int16_t>(window + b)));
+        max_votes = mipp::hmax<int16_t>(max_v);
+      }
+      for (; b < BINS; b++)
+        max_votes = max(max_votes, window[b]);
+      return max_votes;
+    };
+
+    for (int u = max(r0 - R, 0); u <= min(r0 + R, rows - 1); u++)
+      addRow(u, 1);
+
+    int16_t window[BINS];
+    for (int r = r0; r < r1; r++) {
+      if (r > r0) {
+        if (r - R - 1 >= 0)
+          addRow(r - R - 1, -1);
+        if (r + R < rows)
+          addRow(r + R, 1);
+      }
 
-  for (int r = 0; r < angle.rows; r++) {
-    float *mag_r = magnitude.ptr<float>(r);
-    for (int c = 0; c < angle.cols; c++) {
-      if (mag_r[c] <= threshold)
-        continue;
-      int count[16] = {0};
-      int index = -1;
-      int max_votes = 0;
-      for (int i = 0; i < total_kernel; i++) {
-        int u = r + dy[i / 3], v = c + dx[i % 3];
-        if (u < 0 || v < 0 || u >= angle.rows || v >= angle.cols)
+      fill(window, window + BINS, 0);
+      for (int c = 0; c <= min(R, cols - 1); c++)
+        slide(window, c, 1);
+
+      const float *mag_r = magnitude.ptr<float>(r);
+      typename Ori::type *quantized_r =
+          quantized_angle.ptr<typename Ori::type>(r);
+      for (int c = 0; c < cols; c++) {
+        if (c > 0) {
+          if (c + R < cols)
+            slide(window, c + R, 1);
+          if (c - R - 1 >= 0)
+            slide(window, c - R - 1, -1);
+        }
+        if (mag_r[c] <= threshold || maxVotes(window) < NEIGHBOR_THRESHOLD)
           continue;
-        int cur_label = quanized_unfiltered.at<uchar>(u, v);
-        if (++count[cur_label] > max_votes) {
-          max_votes = count[cur_label];
-          index = cur_label;
+        // 票数过半的方向唯一
+        for (int b = 0; b < BINS; b++) {
+          if (window[b] >= NEIGHBOR_THRESHOLD) {
+            quantized_r[c] = static_cast<typename Ori::type>(1 << b);
+            break;
+          }
         }
       }
-      if (max_votes >= NEIGHBOR_THRESHOLD)
-        quantized_angle.at<ushort>(r, c) = (1 << index);
     }
+  };
+
+  if (pool)
+    pool->parallel_for(0, num_bands, quantizeBand);
+  else
+    for (int band = 0; band < num_bands; band++)
+      quantizeBand(band, 0);
+}
+
+void line2Dup::quantizeAngle(const Mat &magnitude, const Mat &labels,
+                             Mat &quantized_angle, float threshold,
+                             int kernel_size, int num_orientations,
+                             ThreadPool *pool) {
+  CV_Assert(num_orientations == 8 || num_orientations == 16);
+  if (num_orientations == 8)
+    quantizeAngleImpl<8>(magnitude, labels, quantized_angle, threshold,
+                         kernel_size, pool);
+  else
+    quantizeAngleImpl<16>(magnitude, labels, quantized_angle, threshold,
+                          kernel_size, pool);
+}
+
+/// @brief 每行 [0, width) 上的 dst[j] = sum_k w[k] * src[k][j]
+static inline void weightedSum(const float *const *src, const float *w, int n,
+                               float *dst, int width) {
+  int j = 0;
+  const int N = mipp::N<float>();
+  for (; j + N <= width; j += N) {
+    mipp::Reg<float> acc = mipp::Reg<float>(w[0]) * mipp::loadu<float>(src[0] + j);
+    for (int k = 1; k < n; k++)
+      acc = mipp::fmadd(mipp::Reg<float>(w[k]), mipp::Reg<float>(mipp::loadu<float>(src[k] + j)), acc);
+    acc.storeu(dst + j);
+  }
+  for (; j < width; j++) {
+    float acc = 0;
+    for (int k = 0; k < n; k++)
+      acc += w[k] * src[k][j];
+    dst[j] = acc;
   }
 }
 
-static void sobelMagnitude(const Mat &src, Mat &magnitude, Mat &sobel_dx,
-                           Mat &sobel_dy) {
-  // Allocate temporary buffers
-  Size size = src.size();
-  Mat sobel_3dx;
-  Mat sobel_3dy;
-  Mat smoothed;
-  // Initialize in/out params
-  sobel_dx.create(size, CV_32F);
-  sobel_dy.create(size, CV_32F);
-  magnitude.create(size, CV_32F);
-
-  // Calculate the magnitude matrix of 3/1 channel img
-  static const int KERNEL_SIZE = 7;
-  GaussianBlur(src, smoothed, Size(KERNEL_SIZE, KERNEL_SIZE), 0, 0,
-               BORDER_REPLICATE);
-  Sobel(smoothed, sobel_3dx, CV_16S, 1, 0, 3, 1.0, 0, BORDER_REPLICATE);
-  Sobel(smoothed, sobel_3dy, CV_16S, 0, 1, 3, 1.0, 0, BORDER_REPLICATE);
-
-  for (int i = 0; i < size.height; i++) {
-    for (int j = 0; j < size.width; j++) {
-      int maxMagnitude = 0;
-      int index = 0;
-      // suitable of 3 or 1 channel img
-      for (int c = 0; c < smoothed.channels(); c++) {
-        short &dx = sobel_3dx.at<Vec3s>(i, j)[c];
-        short &dy = sobel_3dy.at<Vec3s>(i, j)[c];
-        int mag_c = dx * dx + dy * dy;
-        if (mag_c > maxMagnitude) {
-          maxMagnitude = mag_c;
-          index = c;
+/// @brief 逐行单次扫描计算梯度: 7 x 7 高斯平滑 -> 3 x 3 Sobel -> 取幅值最大的
+/// 通道 -> 幅值与方向 -> 量化方向. 平滑结果只保存在环形行缓冲区中, 边界按
+/// BORDER_REPLICATE 处理, 不产生整幅的中间图像
+/// @param src CV_8UC1 或 CV_8UC3 图像
+/// @param magnitude 梯度幅值的平方 (CV_32F)
+/// @param angle 梯度方向 [0, 360) (CV_32F), 为空时方向只保存在行缓冲区中
+/// @param labels 量化方向 [0, 16), 相反方向取相同标签 (CV_8U)
+/// @param mag_min, mag_max 幅值的最小值与最大值
+static void computeGradients(const Mat &src, Mat &magnitude, Mat *angle,
+                             Mat &labels, float &mag_min, float &mag_max) {
+  CV_Assert(src.depth() == CV_8U && (src.channels() == 1 || src.channels() == 3));
+  static const int KSIZE = 7;
+  static const int R = KSIZE / 2;
+  const int rows = src.rows, cols = src.cols, cn = src.channels();
+  const int width = cols * cn;
+  const int padded_width = width + 2 * cn; // 平滑行左右各补一个像素
+
+  magnitude.create(src.size(), CV_32F);
+  labels.create(src.size(), CV_8U);
+  Mat angle_buffer;
+  if (angle)
+    angle->create(src.size(), CV_32F);
+  else
+    angle_buffer.create(1, cols, CV_32F);
+
+  // 与 GaussianBlur(src, dst, Size(7, 7), 0) 相同的核
+  Mat kernel = getGaussianKernel(KSIZE, 0, CV_32F);
+  const float *w = kernel.ptr<float>();
+
+  vector<float> padded((cols + 2 * R) * cn);
+  vector<float> hbuf(KSIZE * width), sbuf(3 * padded_width);
+  int hrow[KSIZE], srow[3];
+  fill(hrow, hrow + KSIZE, -1);
+  fill(srow, srow + 3, -1);
+
+  // 第 y 行的水平平滑结果, 位于第 y % KSIZE 个槽位
+  auto horizontal = [&](int y) -> const float * {
+    float *dst = &hbuf[(y % KSIZE) * width];
+    if (hrow[y % KSIZE] == y)
+      return dst;
+    hrow[y % KSIZE] = y;
+
+    const uchar *src_y = src.ptr(y);
+    for (int x = -R; x < cols + R; x++) {
+      const int xx = min(max(x, 0), cols - 1);
+      for (int c = 0; c < cn; c++)
+        padded[(x + R) * cn + c] = src_y[xx * cn + c];
+    }
+    const float *taps[KSIZE];
+    for (int k = 0; k < KSIZE; k++)
+      taps[k] = &padded[k * cn];
+    weightedSum(taps, w, KSIZE, dst, width);
+    return dst;
+  };
+
+  // 第 y 行的平滑结果, 位于第 y % 3 个槽位, 返回的指针指向第一个有效像素
+  auto smoothed = [&](int y) -> const float * {
+    float *dst = &sbuf[(y % 3) * padded_width];
+    if (srow[y % 3] == y)
+      return dst + cn;
+    srow[y % 3] = y;
+
+    const float *taps[KSIZE];
+    for (int k = 0; k < KSIZE; k++)
+      taps[k] = horizontal(min(max(y - R + k, 0), rows - 1));
+    weightedSum(taps, w, KSIZE, dst + cn, width);
+    for (int c = 0; c < cn; c++) {
+      dst[c] = dst[cn + c];
+      dst[cn + width + c] = dst[width + c];
+    }
+    return dst + cn;
+  };
+
+  vector<float> dx(width), dy(width), best_dx(cols), best_dy(cols);
+  mag_min = rows * cols > 0 ? numeric_limits<float>::max() : 0;
+  mag_max = 0;
+  const int N = mipp::N<float>();
+  const mipp::Reg<float> two_v = 2.0f;
+
+  for (int r = 0; r < rows; r++) {
+    const float *u = smoothed(max(r - 1, 0));
+    const float *m = smoothed(r);
+    const float *d = smoothed(min(r + 1, rows - 1));
+
+    // 各通道的 3 x 3 Sobel
+    int j = 0;
+    for (; j + N <= width; j += N) {
+      mipp::Reg<float> ul = mipp::loadu<float>(u + j - cn), ur = mipp::loadu<float>(u + j + cn);
+      mipp::Reg<float> ml = mipp::loadu<float>(m + j - cn), mr = mipp::loadu<float>(m + j + cn);
+      mipp::Reg<float> dl = mipp::loadu<float>(d + j - cn), dr = mipp::loadu<float>(d + j + cn);
+      mipp::Reg<float> uc = mipp::loadu<float>(u + j), dc = mipp::loadu<float>(d + j);
+      mipp::Reg<float> gx = (ur - ul) + mipp::fmadd(two_v, mr - ml, dr - dl);
+      mipp::Reg<float> gy = (dl + dr - ul - ur) + two_v * (dc - uc);
+      gx.storeu(&dx[j]);
+      gy.storeu(&dy[j]);
+    }
+    for (; j < width; j++) {
+      dx[j] = (u[j + cn] - u[j - cn]) + 2 * (m[j + cn] - m[j - cn]) +
+              (d[j + cn] - d[j - cn]);
+      dy[j] = (d[j - cn] + 2 * d[j] + d[j + cn]) -
+              (u[j - cn] + 2 * u[j] + u[j + cn]);
+    }
+
+    // 取幅值最大的通道
+    float *mag_r = magnitude.ptr<float>(r);
+    for (int x = 0; x < cols; x++) {
+      int best = x * cn;
+      float best_mag = dx[best] * dx[best] + dy[best] * dy[best];
+      for (int c = 1; c < cn; c++) {
+        const int k = x * cn + c;
+        const float mag = dx[k] * dx[k] + dy[k] * dy[k];
+        if (mag > best_mag) {
+          best_mag = mag;
+          best = k;
         }
       }
-      sobel_dx.at<float>(i, j) = sobel_3dx.at<Vec3s>(i, j)[index];
-      sobel_dy.at<float>(i, j) = sobel_3dy.at<Vec3s>(i, j)[index];
-      magnitude.at<float>(i, j) = maxMagnitude;
+      best_dx[x] = dx[best];
+      best_dy[x] = dy[best];
+      mag_r[x] = best_mag;
+      mag_min = min(mag_min, best_mag);
+      mag_max = max(mag_max, best_mag);
     }
+
+    // 方向与量化方向, phase 直接写入 angle 的第 r 行或行缓冲区
+    Mat angle_r = angle ? angle->row(r) : angle_buffer;
+    phase(Mat(1, cols, CV_32F, best_dx.data()),
+          Mat(1, cols, CV_32F, best_dy.data()), angle_r, true);
+    const float *ang_r = angle_r.ptr<float>();
+    uchar *label_r = labels.ptr(r);
+    for (int x = 0; x < cols; x++)
+      label_r[x] = static_cast<uchar>(cvRound(ang_r[x] * (32.0f / 360.0f)) & 15);
   }
-  normalize(magnitude, magnitude, 0, 100.0f, NORM_MINMAX, CV_32F);
 }
 
 void ColorGradientPyramid::update() {
-  Mat sobel_dx, sobel_dy;
-  sobelMagnitude(src, magnitude, sobel_dx, sobel_dy);
+  ProfileScope scope(STAGE_GRADIENT);
+  Mat labels;
+  float mag_min, mag_max;
+  computeGradients(src, magnitude, keep_angle ? &angle : nullptr, labels,
+                   mag_min, mag_max);
+  if (!keep_angle)
+    angle.release();
+
+  // magnitude_threshold 为按最小最大值归一化到 [0, 100] 后的阈值. 最小最大
+  // 值要扫描完最后一行才能确定, 而方向投票需要邻域内各像素是否超过阈值,
+  // 因此投票无法并入 computeGradients 的逐行扫描, 只能保存整幅的幅值与
+  // 标签, 得到阈值后再扫描一遍
+  raw_magnitude_threshold =
+      mag_min + (mag_max - mag_min) * magnitude_threshold / 100.0f;
+
+  quantizeAngle(magnitude, labels, quantized_angle, raw_magnitude_threshold,
+                count_kernel_size, num_orientations, pool);
+}
 
-  phase(sobel_dx, sobel_dy, angle, true);
+/// class LinearMemory
 
-  quantizeAngle(magnitude, angle, quantized_angle, magnitude_threshold,
-                count_kernel_size);
-}
+void LinearMemory::create(int _rows, int _cols, int _type) {
+  const size_t elem_size = CV_ELEM_SIZE1(_type);
+  const size_t size = static_cast<size_t>(_rows) * _cols * elem_size;
+  const int n_memories = block_size * block_size;
 
-void LinearMemory::linearize(cv::Mat &src) {
-  int new_rows = (src.rows / block_size + 1) * block_size;
-  int new_cols = (src.cols / block_size + 1) * block_size;
-  Mat bordered_src;
-  copyMakeBorder(src, bordered_src, 0, new_rows - src.rows, 0,
-                 new_cols - src.cols, BORDER_REPLICATE);
+  rows = _rows;
+  cols = _cols;
+  mem_type = _type;
+  step = alignSize(size, ALIGNMENT);
 
-  // CV_Assert(src.rows % block_size == 0);
-  // CV_Assert(src.cols % block_size == 0);
+  // 多分配 ALIGNMENT 字节用于对齐首地址
+  profileCreate(buffer, Size(static_cast<int>(step * n_memories + ALIGNMENT), 1),
+                CV_8U);
+  data = alignPtr(buffer.ptr(), ALIGNMENT);
+
+  // 行尾填充部分置零, 使越过有效长度的向量读取结果确定
+  for (int i = 0; i < n_memories; i++)
+    memset(ptr(i) + size, 0, step - size);
+}
 
-  rows = src.rows / block_size;
-  cols = src.cols / block_size;
-  create(rows * cols);
+void LinearMemory::setZero() {
+  if (data)
+    memset(data, 0, step * block_size * block_size);
+}
 
-  for (int r = 0; r < new_rows; r++) {
-    for (int c = 0; c < new_cols; c++) {
-      int order_block = (r % block_size) * block_size + (c % block_size);
-      int idx_mat = (r / block_size) * cols + (c / block_size);
-      memories[order_block][idx_mat] = src.at<ushort>(r, c);
+/// @brief 逐行读取源图像, 将每一行按列分发到同一行的 block_size 个线性
+/// 存储器. T 大于 0 时为编译期的分块边长, 循环随之展开; 为 0 时取
+/// memory.block_size
+template <int T>
+static void linearizeImpl(const Mat &src, LinearMemory &memory) {
+  const int block_size = T > 0 ? T : memory.block_size;
+  for (int r = 0; r < src.rows; r++) {
+    const uchar *src_r = src.ptr(r);
+    const int order_row = (r % block_size) * block_size;
+    const size_t offset = static_cast<size_t>(r / block_size) * memory.cols;
+    for (int c_start = 0; c_start < block_size; c_start++) {
+      uchar *dst = memory.ptr(order_row + c_start) + offset;
+      for (int c = c_start, j = 0; c < src.cols; c += block_size, j++)
+        dst[j] = src_r[c];
     }
   }
 }
 
-void LinearMemory::unlinearize(cv::Mat &dst) {
-  dst.create(Size(rows * block_size, cols * block_size), CV_16U);
+void LinearMemory::linearize(const cv::Mat &src) {
+  CV_Assert(src.type() == CV_8U);
+  ProfileScope scope(STAGE_LINEARIZE);
+
+  Mat bordered_src = src;
+  int new_rows = (src.rows + block_size - 1) / block_size * block_size;
+  int new_cols = (src.cols + block_size - 1) / block_size * block_size;
+  if (new_rows != src.rows || new_cols != src.cols)
+    copyMakeBorder(src, bordered_src, 0, new_rows - src.rows, 0,
+                   new_cols - src.cols, BORDER_REPLICATE);
+
+  create(new_rows / block_size, new_cols / block_size, CV_8U);
+
+  switch (block_size) {
+  case 4:
+    linearizeImpl<4>(bordered_src, *this);
+    break;
+  case 8:
+    linearizeImpl<8>(bordered_src, *this);
+    break;
+  default:
+    linearizeImpl<0>(bordered_src, *this);
+  }
+}
 
+template <typename _Tp>
+static void unlinearizeImpl(const LinearMemory &memory, Mat &dst) {
+  const int block_size = memory.block_size;
   for (int r = 0; r < dst.rows; r++) {
-    for (int l = 0; l < dst.cols; l++) {
-      int order_block = (r % block_size) * block_size + (l % block_size);
-      int idx_mat = (r / block_size) * cols + (l / block_size);
-      dst.at<ushort>(r, l) = memories[order_block][idx_mat];
+    _Tp *dst_r = dst.ptr<_Tp>(r);
+    const int order_row = (r % block_size) * block_size;
+    const size_t offset = static_cast<size_t>(r / block_size) * memory.cols;
+    for (int c_start = 0; c_start < block_size; c_start++) {
+      const _Tp *src = memory.ptr<_Tp>(order_row + c_start) + offset;
+      for (int c = c_start, j = 0; c < dst.cols; c += block_size, j++)
+        dst_r[c] = src[j];
     }
   }
 }
 
-static void spread(Mat &src, Mat &dst, int kernel_size) {
-  dst = Mat::zeros(src.size(), QUANTIZE_TYPE);
-  for (int i = 0; i < src.rows; i++) {
-    for (int j = 0; j < src.cols; j++) {
-      for (int dy = -kernel_size / 2; dy < kernel_size / 2 + 1; dy++) {
-        for (int dx = -kernel_size / 2; dx < kernel_size / 2 + 1; dx++) {
-          int u = i + dy;
-          int v = j + dx;
-          if (u < 0 || u >= src.rows || v < 0 || v >= src.cols ||
-              !src.at<quantize_type>(u, v))
-            continue;
-          dst.at<quantize_type>(i, j) |= dst.at<quantize_type>(u, v);
-        }
-      }
-    }
+void LinearMemory::unlinearize(cv::Mat &dst) const {
+  dst.create(rows * block_size, cols * block_size, mem_type);
+
+  switch (CV_MAT_DEPTH(mem_type)) {
+  case CV_8U:
+    unlinearizeImpl<uchar>(*this, dst);
+    break;
+  case CV_16U:
+  case CV_16S:
+    unlinearizeImpl<ushort>(*this, dst);
+    break;
+  default:
+    CV_Error(Error::StsUnsupportedFormat, "unsupported linear memory type");
   }
 }
 
-#include "similariry_lut.i"
-const int bit_mask[] = {15, 240, 3840, 61440};
-
-static void computeResponseMaps(Mat &src, vector<Mat> &response_maps) {
-  response_maps.resize(QUANTIZE_BASE);
-  for (int i = 0; i < 16; i++)
-    response_maps[i] = Mat::zeros(src.size(), CV_16U);
-
-  static int bit_size = QUANTIZE_BASE / 4;
-  static int lut_step = bit_size * QUANTIZE_BASE;
-
-  for (int i = 0; i < src.rows; i++) {
-    for (int j = 0; j < src.cols; j++) {
-      if (!src.at<quantize_type>(i, j))
+void line2Dup::spread(const Mat &src, Mat &dst, int T) {
+  CV_Assert(src.type() == CV_16U || src.type() == CV_8U);
+  ProfileScope scope(STAGE_SPREAD);
+  dst = Mat::zeros(src.size(), src.type());
+  profileAllocation(dst.total() * dst.elemSize());
+
+  // 邻域偏移范围 [lower, lower + T), T 为奇数时关于中心对称
+  const int lower = -(T / 2);
+  for (int dy = lower; dy < lower + T; dy++) {
+    int height = src.rows - abs(dy);
+    for (int dx = lower; dx < lower + T; dx++) {
+      int width = src.cols - abs(dx);
+      if (height <= 0 || width <= 0)
         continue;
+      // dst(r, c) |= src(r + dy, c + dx)
+      if (src.type() == CV_16U)
+        kernels().orRows16u(src.ptr<ushort>(max(dy, 0)) + max(dx, 0),
+                            static_cast<int>(src.step1()),
+                            dst.ptr<ushort>(max(-dy, 0)) + max(-dx, 0),
+                            static_cast<int>(dst.step1()), width, height);
+      else
+        kernels().orRows8u(src.ptr<uchar>(max(dy, 0)) + max(dx, 0),
+                           static_cast<int>(src.step1()),
+                           dst.ptr<uchar>(max(-dy, 0)) + max(-dx, 0),
+                           static_cast<int>(dst.step1()), width, height);
+    }
+  }
+}
 
-      uchar _bit_[bit_size];
-      for (int k = 0; k < bit_size; k++)
-        _bit_[k] = src.at<quantize_type>(i, j) & bit_mask[k];
+/// @brief 方向 ori 与第 k 个半字节取值为 n 的扩散方向集合之间的最大相似度,
+/// 位于 data[ori * step + 16 * k + n]. 相似度随方向差线性递减, 同向为 8,
+/// 垂直为 0. 编译期生成
+template <int NUM_ORI> struct SimilarityLut {
+  static const int step = Orientations<NUM_ORI>::nibbles * 16;
+  uchar data[NUM_ORI * step];
+
+  constexpr SimilarityLut() : data() {
+    for (int ori = 0; ori < NUM_ORI; ori++)
+      for (int k = 0; k < NUM_ORI / 4; k++)
+        for (int n = 0; n < 16; n++)
+          data[ori * step + 16 * k + n] = score(ori, k, n);
+  }
 
-      for (int ori = 0; ori < QUANTIZE_BASE; ori++) {
-        uchar maxScore = 0;
-        for (int k = 0; k < bit_size; k++)
-          maxScore =
-              max(maxScore, similarity_lut[ori * lut_step + 16 * k + _bit_[k]]);
-        response_maps[ori].at<quantize_type>(i, j) = maxScore;
-      }
+  static constexpr uchar score(int ori, int k, int n) {
+    int best = 0;
+    for (int b = 0; b < 4; b++) {
+      if (!(n & (1 << b)))
+        continue;
+      int d = ori - (4 * k + b);
+      d = d < 0 ? -d : d;
+      d = d < NUM_ORI - d ? d : NUM_ORI - d;
+      const int s = 8 * (NUM_ORI / 2 - d) / (NUM_ORI / 2);
+      best = s > best ? s : best;
     }
+    return static_cast<uchar>(best);
   }
-}
+};
 
-void Detector::addSource(cv::Mat &src, cv::Mat mask,
-                         const cv::String &memory_name) {
-  auto named_memory = memories_map.find(memory_name);
-  if (named_memory != memories_map.end()) {
-    printf("该名称被占用! 是否重新写入源图像 [y/n]\n");
-    char ch = getchar();
-    if (ch == 'y' || ch == 'Y')
-      ;
-    else if (ch == 'n' || ch == 'N')
-      return;
+static_assert(SimilarityLut<16>::score(0, 0, 2) == 7 &&
+                  SimilarityLut<16>::score(0, 2, 1) == 0 &&
+                  SimilarityLut<16>::score(5, 3, 8) == 2 &&
+                  SimilarityLut<8>::score(0, 0, 2) == 6 &&
+                  SimilarityLut<8>::score(0, 1, 1) == 0,
+              "similarity falls linearly from 8 (same) to 0 (perpendicular)");
+
+template <int NUM_ORI>
+static void computeResponseMapsImpl(const Mat &src, vector<Mat> &response_maps) {
+  typedef Orientations<NUM_ORI> Ori;
+  static constexpr SimilarityLut<NUM_ORI> lut{};
+
+  response_maps.resize(NUM_ORI);
+  for (int i = 0; i < NUM_ORI; i++)
+    profileCreate(response_maps[i], src.size(), CV_8U);
+
+  // 将每个像素拆分为 Ori::nibbles 个半字节, nibbles[k] 取值范围 [0, 16)
+  const int total = static_cast<int>(src.total());
+  Mat nibbles(Ori::nibbles, total, CV_8U);
+  const typename Ori::type *src_data = src.ptr<typename Ori::type>();
+  for (int k = 0; k < Ori::nibbles; k++) {
+    uchar *nibble_k = nibbles.ptr(k);
+    for (int i = 0; i < total; i++)
+      nibble_k[i] = (src_data[i] >> (4 * k)) & 15;
   }
 
-  modality = modality->process(src, mask);
-  vector<LinearMemory> memories_pyramid;
+  // nibbles 连续存储, 行步长即为 total
+  for (int ori = 0; ori < NUM_ORI; ori++)
+    kernels().lookupResponses(nibbles.ptr(0), Ori::nibbles,
+                              lut.data + ori * lut.step,
+                              response_maps[ori].ptr(), total);
+}
 
-  for (int l = 0; l < pyramid_level; l++) {
-    vector<LinearMemory> linear_memories;
-    for (int i = 0; i < QUANTIZE_BASE; i++)
-      linear_memories.push_back(LinearMemory(block_size));
+void line2Dup::computeResponseMaps(const Mat &src, vector<Mat> &response_maps) {
+  CV_Assert(src.isContinuous());
+  ProfileScope scope(STAGE_RESPONSE_MAPS);
+  if (orientationCount(src.type()) == 8)
+    computeResponseMapsImpl<8>(src, response_maps);
+  else
+    computeResponseMapsImpl<16>(src, response_maps);
+}
 
-    Mat quantized, spread_quantized;
-    modality->quantize(quantized);
-    spread(quantized, spread_quantized, 3);
+/// class TemplateSet
 
-    vector<Mat> response_maps;
-    computeResponseMaps(spread_quantized, response_maps);
+/// @brief 按模板尺寸选取金字塔层数, 使最高层的模板边长不超过 128 像素左右
+static int pyramidLevelFor(Size object_size) {
+  int area = sqrt(object_size.width * object_size.height);
+  int level = 1;
+  while (128 * (1 << level) < area)
+    level++;
+  return level;
+}
+
+TemplateSet::TemplateSet(int _pyramid_level) : pyramid_level(_pyramid_level) {}
+
+void TemplateSet::addTemplate(const Mat &object, const Mat &object_mask,
+                              const Search &search, const String &class_name) {
+  if (pyramid_level <= 0)
+    pyramid_level = pyramidLevelFor(object.size());
 
-    for (int i = 0; i < QUANTIZE_BASE; i++)
-      linear_memories[i].linearize(response_maps[i]);
+  Ptr<ColorGradientPyramid> modality =
+      makePtr<ColorGradientPyramid>(object, object_mask);
 
-    memories_pyramid.insert(memories_pyramid.end(), linear_memories.begin(),
-                            linear_memories.end());
+  const Range &scale_range = search.scale;
+  const Range &angle_range = search.angle;
+
+  // 各层只提取原始模板, 旋转缩放后的模板由 LazyTemplates 按需生成
+  vector<Point2f> poses;
+  for (int si = 0; si < scale_range.count(); si++)
+    for (int ai = 0; ai < angle_range.count(); ai++)
+      poses.push_back(Point2f(scale_range.value(si), angle_range.value(ai)));
+
+  vector<ShapeTemplate> origins;
+  for (int l = 0; l < pyramid_level; l++) {
+    ShapeTemplate origin_tmepl(l, 1.0f, 0.0f);
+    modality->extractTemplate(origin_tmepl);
+    origins.push_back(origin_tmepl);
 
     if (l != pyramid_level - 1)
       modality->pyrDown();
   }
 
-  memories_map.insert(make_pair(memory_name, memories_pyramid));
+  TemplateClass templs;
+  templs.pyramid_level = pyramid_level;
+  templs.num_templates = static_cast<int>(poses.size());
+  templs.search = search;
+  templs.lazy = makePtr<LazyTemplates>(origins, poses);
+  templs.initPoseSearch();
+
+  classes[class_name] = templs;
 }
 
-void Detector::addTemplate(cv::Mat &object, cv::Mat object_mask,
-                          const Search &search, const cv::String &templ_name) {
-  auto named_templ = templates_map.find(templ_name);
-  if (named_templ != templates_map.end()) {
-    printf("该名称被占用! 是否重新写入模板 [y/n]\n");
-    char ch = getchar();
-    if (ch == 'y' || ch == 'Y')
-      ;
-    else if (ch == 'n' || ch == 'N')
-      return;
+void TemplateSet::save(const String &path) const {
+  TemplateLibraryWriter writer;
+  // 模板库保存全部模板, 按需生成的类别在此生成其余各层
+  vector<vector<TemplateView> > all(classes.size());
+  int k = 0;
+  for (const auto &named_class : classes) {
+    named_class.second.views(all[k]);
+    writer.addClass(named_class.first, named_class.second.pyramid_level,
+                    named_class.second.search, all[k++]);
   }
+  writer.write(path);
+}
 
-  modality = modality->process(object, object_mask);
+void TemplateSet::load(const String &path) {
+  Ptr<TemplateLibrary> library = TemplateLibrary::open(path);
+
+  for (int i = 0; i < library->numClasses(); i++) {
+    TemplateClass templs;
+    templs.pyramid_level = library->pyramidLevel(i);
+    templs.search = library->search(i);
+    templs.library = library;
+    library->templates(i, templs.templates);
+    templs.num_templates =
+        static_cast<int>(templs.templates.size()) / templs.pyramid_level;
+    templs.initPoseSearch();
+
+    // 源图像按集合的金字塔层数构建, 所有类别须一致
+    if (pyramid_level <= 0)
+      pyramid_level = templs.pyramid_level;
+    CV_Assert(templs.pyramid_level == pyramid_level);
+
+    classes[library->className(i)] = templs;
+  }
+}
 
-  vector<Ptr<ShapeTemplate> > templs;
+const TemplateClass &TemplateSet::at(const String &class_name) const {
+  auto named_class = classes.find(class_name);
+  if (named_class == classes.end())
+    CV_Error(Error::StsObjectNotFound, "unknown template class: " + class_name);
+  return named_class->second;
+}
 
-  const Range &scale_range = search.scale;
-  const Range &angle_range = search.angle;
+vector<String> TemplateSet::classNames() const {
+  vector<String> names;
+  for (const auto &named_class : classes)
+    names.push_back(named_class.first);
+  return names;
+}
 
-  for (int l = 0; l < pyramid_level; l++) {
-    ShapeTemplate origin_tmepl(l, 1.0f, 0.0f);
-    modality->extractTemplate(origin_tmepl);
+/// class LazyTemplates
+
+LazyTemplates::LazyTemplates(const vector<ShapeTemplate> &_origins,
+                             const vector<Point2f> &_poses)
+    : origins(_origins), poses(_poses),
+      slots(new std::atomic<ShapeTemplate *>[_origins.size() * _poses.size()]) {
+  for (size_t i = 0; i < origins.size() * poses.size(); i++)
+    slots[i] = nullptr;
+}
+
+LazyTemplates::~LazyTemplates() {
+  for (size_t i = 0; i < origins.size() * poses.size(); i++)
+    delete slots[i].load();
+}
+
+const ShapeTemplate &LazyTemplates::get(int level, int template_id) const {
+  CV_DbgAssert(level >= 0 && level < levels() && template_id >= 0 &&
+               template_id < size());
+  std::atomic<ShapeTemplate *> &slot = slots[level * size() + template_id];
+  ShapeTemplate *templ = slot.load(std::memory_order_acquire);
+  if (templ)
+    return *templ;
+
+  ProfileScope scope(STAGE_TEMPLATE_TRANSFORM);
+  const Point2f &pose = poses[template_id];
+  ShapeTemplate *generated =
+      new ShapeTemplate(std::move(*origins[level].relocate(pose.x, pose.y)));
+  // 其他线程已先生成时丢弃本线程的结果
+  if (!slot.compare_exchange_strong(templ, generated,
+                                    std::memory_order_acq_rel,
+                                    std::memory_order_acquire)) {
+    delete generated;
+    return *templ;
+  }
+  return *generated;
+}
+
+int LazyTemplates::materialized() const {
+  int count = 0;
+  for (size_t i = 0; i < origins.size() * poses.size(); i++)
+    count += slots[i].load(std::memory_order_relaxed) != nullptr;
+  return count;
+}
+
+/// struct TemplateClass
+
+TemplateView TemplateClass::at(int level, int template_id) const {
+  if (lazy)
+    return TemplateView(lazy->get(level, template_id));
+  return templates[level * num_templates + template_id];
+}
+
+void TemplateClass::views(vector<TemplateView> &all) const {
+  if (!lazy) {
+    all = templates;
+    return;
+  }
+  all.clear();
+  for (int l = 0; l < pyramid_level; l++)
+    for (int id = 0; id < num_templates; id++)
+      all.push_back(at(l, id));
+}
 
-    for (float scale = scale_range.lower_bound;
-         scale < scale_range.upper_bound + line2d_eps; scale += scale_range.step) {
-      for (float angle = angle_range.lower_bound;
-           angle < angle_range.upper_bound + line2d_eps; angle += angle_range.step) {
-        templs.push_back(origin_tmepl.relocate(scale, angle));
+/// @brief 模板特征到原点的最大距离
+static float templateRadius(const TemplateView &templ) {
+  float radius = 0;
+  for (int k = 0; k < templ.num_features; k++) {
+    const Gradient &point = templ.features[k];
+    radius = max(radius, sqrt((float)(point.x * point.x + point.y * point.y)));
+  }
+  return radius;
+}
+
+/// @brief 不超过 n 的最大的 2 的幂, n 不大于 1 时为 1
+static int floorPow2(int n) {
+  int p = 1;
+  while (p * 2 <= n)
+    p *= 2;
+  return p;
+}
+
+void TemplateClass::initPoseSearch() {
+  const Range &angle_range = search.angle;
+  const Range &scale_range = search.scale;
+  num_angles = angle_range.count();
+  num_scales = scale_range.count();
+  angle_wraps = angle_range.step > 0 &&
+                num_angles * angle_range.step >= 360.0f - 1e-3f;
+  angle_stride.assign(pyramid_level, 1);
+  scale_stride.assign(pyramid_level, 1);
+
+  if (num_angles * num_scales != num_templates) {
+    num_angles = num_templates;
+    num_scales = 1;
+    angle_wraps = false;
+  } else {
+    // 最底层保持最细步长, 往上逐层取该层允许的最大步长且不小于下一层
+    for (int l = 1; l < pyramid_level; l++) {
+      const TemplateView templ = at(l, 0);
+      const float unit_radius = templateRadius(templ) / max(templ.scale, line2d_eps);
+      int ka = 1, ks = 1;
+      if (unit_radius > 0 && angle_range.step > 0) {
+        const float max_radius = unit_radius * max(scale_range.lower_bound,
+                                                   scale_range.value(num_scales - 1));
+        ka = static_cast<int>(1.0f / max_radius * 180.0f / CV_PI / angle_range.step);
       }
+      if (unit_radius > 0 && scale_range.step > 0)
+        ks = static_cast<int>(1.0f / unit_radius / scale_range.step);
+      // 步长取 2 的幂, 各层网格相互嵌套
+      angle_stride[l] = max(floorPow2(min(ka, num_angles)), angle_stride[l - 1]);
+      scale_stride[l] = max(floorPow2(min(ks, num_scales)), scale_stride[l - 1]);
     }
+  }
 
-    if (l != pyramid_level - 1)
-      modality->pyrDown();
+  // 模板半径与旋转无关, 随缩放线性变化
+  extent = 0;
+  if (num_templates > 0) {
+    const TemplateView templ = at(0, 0);
+    extent = templateRadius(templ) / max(templ.scale, line2d_eps) *
+             max(scale_range.lower_bound, scale_range.value(scale_range.count() - 1));
   }
 
-  templates_map.insert(make_pair(templ_name, templs));
-  addSearch(scale_range, angle_range, templ_name);
+  top_templates.clear();
+  const int top = pyramid_level - 1;
+  for (int si = 0; si < num_scales; si += scale_stride[top])
+    for (int ai = 0; ai < num_angles; ai += angle_stride[top])
+      top_templates.push_back(si * num_angles + ai);
+
+  // 最高层的模板都参与全图搜索, 直接生成
+  for (int id : top_templates)
+    at(top, id);
 }
 
-void Detector::addSearch(Range scale, Range angle,
-                         const cv::String &search_name) {
-  auto named_search = searches_map.find(search_name);
-  if (named_search != searches_map.end()) {
-    printf("该名称被占用! 是否重新写入搜索范围 [y/n]\n");
-    char ch = getchar();
-    if (ch == 'y' || ch == 'Y')
-      ;
-    else if (ch == 'n' || ch == 'N')
-      return;
+void TemplateClass::neighborPoses(int level, int template_id,
+                                  vector<int> &ids) const {
+  CV_DbgAssert(level + 1 < pyramid_level);
+  ids.clear();
+  const int ai = template_id % num_angles, si = template_id / num_angles;
+  const int ka = angle_stride[level], ks = scale_stride[level];
+  const int ra = (angle_stride[level + 1] + 1) / 2 / ka;
+  const int rs = (scale_stride[level + 1] + 1) / 2 / ks;
+
+  for (int ds = -rs; ds <= rs; ds++) {
+    const int s = si + ds * ks;
+    if (s < 0 || s >= num_scales)
+      continue;
+    for (int da = -ra; da <= ra; da++) {
+      int a = ai + da * ka;
+      if (angle_wraps)
+        a = (a % num_angles + num_angles) % num_angles;
+      else if (a < 0 || a >= num_angles)
+        continue;
+      ids.push_back(s * num_angles + a);
+    }
   }
+  // 角度循环时步长较大的邻域可能重复
+  sort(ids.begin(), ids.end());
+  ids.erase(unique(ids.begin(), ids.end()), ids.end());
+}
+
+/// class MatchContext
+
+const vector<Match> &MatchContext::matches(const String &class_name) const {
+  static const vector<Match> empty;
+  auto named_matches = matches_map.find(class_name);
+  return named_matches != matches_map.end() ? named_matches->second : empty;
+}
+
+/// class ResponseCache
 
-  searches_map.insert(make_pair(search_name, Search(scale, angle)));
+ResponseCache::ResponseCache(size_t _capacity) : max_entries(_capacity) {
+  CV_Assert(max_entries > 0);
 }
 
-static void computeSimilarity(LinearMemory *response_map,
-                              const ShapeTemplate &templ,
-                              LinearMemory &similarity) {
-  similarity.create(response_map[0].linear_size(), 0);
-  similarity.cols = response_map[0].cols;
-  similarity.rows = response_map[0].rows;
+Ptr<const ResponsePyramid> ResponseCache::get(const String &frame_key) {
+  lock_guard<std::mutex> lock(mutex);
+  auto it = index.find(frame_key);
+  if (it == index.end())
+    return Ptr<const ResponsePyramid>();
+  // 命中的项移到表头
+  entries.splice(entries.begin(), entries, it->second);
+  return it->second->second;
+}
 
-  int size = similarity.block_size * similarity.block_size;
+void ResponseCache::put(const String &frame_key,
+                        const Ptr<const ResponsePyramid> &pyramid) {
+  lock_guard<std::mutex> lock(mutex);
+  auto it = index.find(frame_key);
+  if (it != index.end()) {
+    it->second->second = pyramid;
+    entries.splice(entries.begin(), entries, it->second);
+    return;
+  }
 
-  for (int i = 0; i < size; i++) {
-    for (const auto &point : templ.features) {
-      Point cur = Point(point.x + i % 4, point.y + i / 4);
+  entries.push_front(make_pair(frame_key, pyramid));
+  index[frame_key] = entries.begin();
+  // 淘汰最久未使用的项, 仍被上下文引用的金字塔在引用释放后才析构
+  while (entries.size() > max_entries) {
+    index.erase(entries.back().first);
+    entries.pop_back();
+  }
+}
 
-      int mod_y = cur.y % 4 < 0 ? (cur.y % 4) + 4 : cur.y % 4;
-      int mod_x = cur.x % 4 < 0 ? (cur.x % 4) + 4 : cur.x % 4;
+void ResponseCache::erase(const String &frame_key) {
+  lock_guard<std::mutex> lock(mutex);
+  auto it = index.find(frame_key);
+  if (it == index.end())
+    return;
+  entries.erase(it->second);
+  index.erase(it);
+}
 
-      int offset = ((cur.y - mod_y) / 4) * similarity.cols + (cur.x - mod_x) / 4;
+void ResponseCache::clear() {
+  lock_guard<std::mutex> lock(mutex);
+  entries.clear();
+  index.clear();
+}
 
-      for (int j = 0; j < similarity.linear_size(); j++) {
-        similarity.at(i, j) +=
-            response_map[point.label].at(mod_y * 4 + mod_x, j + offset);
-      }
+size_t ResponseCache::size() const {
+  lock_guard<std::mutex> lock(mutex);
+  return entries.size();
+}
+
+/// class Detector
+
+Ptr<const ResponsePyramid> Detector::computeSource(const Mat &src,
+                                                  const Mat &mask,
+                                                  Point offset,
+                                                  ThreadPool *preprocess_pool) const {
+  const int pyramid_level = templates->pyramidLevel();
+  CV_Assert(pyramid_level > 0);
+
+  Ptr<ColorGradientPyramid> modality = makePtr<ColorGradientPyramid>(
+      src, mask, 80.0f, 5, 100, num_orientations, preprocess_pool);
+  Ptr<ResponsePyramid> pyramid = makePtr<ResponsePyramid>();
+  ResponsePyramid &memories = *pyramid;
+  memories.offset = offset;
+
+  modality->gradients(memories.magnitude, memories.angle,
+                      memories.magnitude_threshold);
+
+  for (int l = 0; l < pyramid_level; l++) {
+    Mat quantized, spread_quantized;
+    modality->quantize(quantized);
+    spread(quantized, spread_quantized, 3);
+
+    vector<Mat> response_maps;
+    computeResponseMaps(spread_quantized, response_maps);
+    memories.sizes.push_back(quantized.size());
+
+    if (l == pyramid_level - 1) {
+      // 只有最高层需要全图搜索, 线性化以便按块累加
+      memories.linear_memories.resize(num_orientations, LinearMemory(block_size));
+      for (int i = 0; i < num_orientations; i++)
+        memories.linear_memories[i].linearize(response_maps[i]);
+      memories.response_maps.push_back(vector<Mat>());
+    } else {
+      memories.response_maps.push_back(response_maps);
+      // 更高层只需量化方向, 不保存梯度方向
+      modality->pyrDown(false);
     }
   }
+
+  return pyramid;
+}
+
+void Detector::addSource(MatchContext &context, const Mat &src,
+                         const Mat &mask) const {
+  ProfileBinding binding(context.profile_.get());
+  ProfileScope scope(STAGE_PREPROCESS);
+  context.sources.assign(1, computeSource(src, mask, Point(), pool.get()));
+  context.search_rois.clear();
+  context.matches_map.clear();
+}
+
+void Detector::addSource(MatchContext &context, const Mat &src,
+                         const Mat &mask, const String &frame_key,
+                         ResponseCache &cache) const {
+  ProfileBinding binding(context.profile_.get());
+  ProfileScope scope(STAGE_PREPROCESS);
+  Ptr<const ResponsePyramid> pyramid = cache.get(frame_key);
+  // 缓存的金字塔层数、方向数或分块与本 Detector 不一致时重新计算
+  if (!pyramid || pyramid->levels() != templates->pyramidLevel() ||
+      pyramid->orientations() != num_orientations ||
+      pyramid->linear_memories[0].block_size != block_size) {
+    pyramid = computeSource(src, mask, Point(), pool.get());
+    cache.put(frame_key, pyramid);
+  }
+  context.sources.assign(1, pyramid);
+  context.search_rois.clear();
+  context.matches_map.clear();
 }
 
-static void addLocalSimilarity(LinearMemory *response_map,
-                              const ShapeTemplate &templ,
-                              LinearMemory &similarity, int x, int y) {
-  int n_rows = similarity.rows * 4;
-  int n_cols = similarity.cols * 4;
-  for (int i = y - 8; i < y + 8; y++) {
-    for (int j = x - 8; j < x + 8; j++) {
-      for (const auto &point : templ.features) {
-        Point cur = Point(point.x + j, point.y + i);
+void Detector::addSource(MatchContext &context, const Mat &src,
+                         const vector<Rect> &search_rois,
+                         const Mat &mask) const {
+  CV_Assert(mask.empty() || mask.size() == src.size());
+  ProfileBinding binding(context.profile_.get());
+  ProfileScope scope(STAGE_PREPROCESS);
+  const Rect image(Point(0, 0), src.size());
+
+  // 模板中心位于区域边缘时, 特征与梯度、扩散的邻域仍须落在预处理的范围内
+  float extent = 0;
+  for (const String &class_name : templates->classNames())
+    extent = max(extent, templates->at(class_name).extent);
+  const int padding = cvCeil(extent) + 8;
+  // 区域左上角按最高层对齐, 使各层采样与整幅图像处理时一致
+  const int align = 1 << (templates->pyramidLevel() - 1);
+
+  vector<Rect> regions;
+  for (const Rect &roi : search_rois) {
+    Rect region(roi.x - padding, roi.y - padding, roi.width + 2 * padding,
+                roi.height + 2 * padding);
+    region &= image;
+    if (region.empty())
+      continue;
+    const int x0 = region.x / align * align, y0 = region.y / align * align;
+    region = Rect(x0, y0, region.br().x - x0, region.br().y - y0);
+    regions.push_back(region);
+  }
 
-        if (cur.y < 0 || cur.x < 0 || cur.y >= n_rows || cur.x >= n_cols)
+  // 合并相交的区域, 直到两两不相交
+  for (bool merged = true; merged;) {
+    merged = false;
+    for (size_t i = 0; i < regions.size() && !merged; i++) {
+      for (size_t j = i + 1; j < regions.size() && !merged; j++) {
+        if ((regions[i] & regions[j]).empty())
           continue;
+        regions[i] |= regions[j];
+        regions.erase(regions.begin() + j);
+        merged = true;
+      }
+    }
+  }
+
+  context.sources.clear();
+  for (const Rect &region : regions)
+    context.sources.push_back(computeSource(
+        src(region), mask.empty() ? Mat() : mask(region), region.tl(),
+        pool.get()));
+  context.search_rois = search_rois;
+  context.matches_map.clear();
+}
+
+/// @brief 方向数 NUM_ORI 与分块边长 T 在编译期确定的相似度计算, 分块内
+/// 的取模与除法化为移位, 各线性存储器的循环展开
+template <int NUM_ORI, int T>
+static void computeSimilarityImpl(const LinearMemory *response_map,
+                                  const TemplateView &templ,
+                                  LinearMemory &similarity) {
+  const int cols = response_map[0].cols;
+  const int length = static_cast<int>(response_map[0].linear_size());
+  const int n_features = templ.num_features;
+  similarity.create(response_map[0].rows, cols, CV_16S);
+
+  vector<const uchar *> src(n_features);
+  vector<int> offsets(n_features);
+  for (int i = 0; i < T * T; i++) {
+    short *dst = similarity.ptr<short>(i);
+    memset(dst, 0, length * sizeof(short));
+
+    // 所有特征都落在线性存储器范围内的公共区间 [begin, end)
+    int begin = 0, end = length;
+    for (int k = 0; k < n_features; k++) {
+      const Gradient &point = templ.features[k];
+      Point cur = Point(point.x + i % T, point.y + i / T);
+
+      // T 为 2 的幂, 按位与即为非负余数
+      int mod_y = cur.y & (T - 1);
+      int mod_x = cur.x & (T - 1);
+
+      offsets[k] = ((cur.y - mod_y) / T) * cols + (cur.x - mod_x) / T;
+      src[k] = response_map[Orientations<NUM_ORI>::fromLabel(point.label)].ptr(
+                   mod_y * T + mod_x) +
+               offsets[k];
+      begin = max(begin, -offsets[k]);
+      end = min(end, length - offsets[k]);
+    }
+    end = max(begin, end);
+
+    if (n_features > 0)
+      kernels().accumulateSimilarity(src.data(), n_features,
+                                     reinterpret_cast<int16_t *>(dst), begin,
+                                     end);
+
+    // 公共区间之外的少量位置逐特征累加, 只计入落在范围内的响应
+    for (int k = 0; k < n_features; k++) {
+      const int j_begin = max(0, -offsets[k]);
+      const int j_end = min(length, length - offsets[k]);
+      for (int j = j_begin; j < min(begin, j_end); j++)
+        dst[j] = saturate_cast<short>(dst[j] + src[k][j]);
+      for (int j = max(end, j_begin); j < j_end; j++)
+        dst[j] = saturate_cast<short>(dst[j] + src[k][j]);
+    }
+  }
+}
 
-        similarity.linear_at(i, j) += response_map->linear_at(cur.y, cur.x);
+void line2Dup::computeSimilarity(const LinearMemory *response_map,
+                                 const TemplateView &templ,
+                                 LinearMemory &similarity,
+                                 int num_orientations) {
+  const int T = similarity.block_size;
+  CV_Assert(response_map[0].block_size == T);
+  if (num_orientations == 16 && T == 4)
+    computeSimilarityImpl<16, 4>(response_map, templ, similarity);
+  else if (num_orientations == 16 && T == 8)
+    computeSimilarityImpl<16, 8>(response_map, templ, similarity);
+  else if (num_orientations == 8 && T == 4)
+    computeSimilarityImpl<8, 4>(response_map, templ, similarity);
+  else if (num_orientations == 8 && T == 8)
+    computeSimilarityImpl<8, 8>(response_map, templ, similarity);
+  else
+    CV_Error(Error::StsBadArg, "unsupported orientation count or block size");
+}
+
+/// 局部精化窗口的边长, 每行对应 16 个 16 位累加通道
+static const int REFINE_WINDOW = 16;
+
+/// @brief 计算模板在以 tl 为左上角的 REFINE_WINDOW x REFINE_WINDOW 窗口内
+/// 每个位置的相似度, 超出图像范围的特征不计分
+/// @param response_maps 当前层 NUM_ORI 个按行存储的 8 位响应图
+/// @param templ 当前层的模板
+/// @param tl 窗口左上角
+/// @param window 按行存储的窗口相似度, 以有符号饱和加法累加
+template <int NUM_ORI>
+static void computeWindowSimilarityImpl(const vector<Mat> &response_maps,
+                                        const TemplateView &templ, Point tl,
+                                        short *window) {
+  const int rows = response_maps[0].rows;
+  const int cols = response_maps[0].cols;
+
+  // 完全落在行内的特征交给内核整行累加, 部分越界的特征以标量逐像素累加
+  vector<const uchar *> inside;
+  inside.reserve(templ.num_features);
+  for (int i = 0; i < REFINE_WINDOW; i++) {
+    int partial[REFINE_WINDOW] = {0};
+    inside.clear();
+
+    for (int k = 0; k < templ.num_features; k++) {
+      const Gradient &point = templ.features[k];
+      const int y = tl.y + i + point.y;
+      const int x0 = tl.x + point.x;
+      if (y < 0 || y >= rows)
+        continue;
+
+      const uchar *src =
+          response_maps[Orientations<NUM_ORI>::fromLabel(point.label)].ptr(y) +
+          x0;
+      if (x0 >= 0 && x0 + REFINE_WINDOW <= cols) {
+        inside.push_back(src);
+      } else {
+        for (int j = max(0, -x0); j < min(REFINE_WINDOW, cols - x0); j++)
+          partial[j] += src[j];
       }
     }
+
+    short *dst = window + i * REFINE_WINDOW;
+    kernels().accumulateWindowRow(inside.data(),
+                                  static_cast<int>(inside.size()),
+                                  reinterpret_cast<int16_t *>(dst));
+    for (int j = 0; j < REFINE_WINDOW; j++)
+      dst[j] = saturate_cast<short>(dst[j] + partial[j]);
+  }
+}
+
+static void computeWindowSimilarity(const vector<Mat> &response_maps,
+                                    const TemplateView &templ, Point tl,
+                                    short *window) {
+  if (response_maps.size() == 8)
+    computeWindowSimilarityImpl<8>(response_maps, templ, tl, window);
+  else
+    computeWindowSimilarityImpl<16>(response_maps, templ, tl, window);
+}
+
+/// @brief 得分 score (百分制) 对应的最小原始得分, 原始得分满分为 8 * num_features
+static inline int rawThreshold(float score_threshold, int num_features) {
+  return static_cast<int>(ceil(score_threshold * 8 * num_features / 100.0f));
+}
+
+/// @brief (r, c) 是否为 3 x 3 邻域内的极大值, 相等时保留扫描顺序在前的点
+static bool isLocalMaximum(const LinearMemory &similarity, Size size, int r,
+                           int c) {
+  const int score = similarity.linear_at<short>(r, c);
+  for (int dy = -1; dy <= 1; dy++) {
+    for (int dx = -1; dx <= 1; dx++) {
+      const int y = r + dy, x = c + dx;
+      if ((dy == 0 && dx == 0) || y < 0 || x < 0 || y >= size.height ||
+          x >= size.width)
+        continue;
+      const int neighbor = similarity.linear_at<short>(y, x);
+      if (neighbor > score || (neighbor == score && (dy < 0 || (dy == 0 && dx < 0))))
+        return false;
+    }
   }
+  return true;
 }
 
 // Used to filter out weak matches
@@ -572,115 +1337,887 @@ struct MatchPredicate {
   bool operator()(const Match &m) { return m.similarity < threshold; }
 };
 
-void Detector::match(cv::Mat &src, cv::Mat &object, 
-                     float score_threshold,
-                     const Search &search,
-                     cv::Mat src_mask, cv::Mat object_mask) {
-  int area = sqrt(object.rows * object.cols);
-  int try_level = 1;
-  while (128 * (1 << try_level) < area)
-    try_level++;
-  pyramid_level = try_level;
-
-  addSource(src, src_mask);
-  addTemplate(object, object_mask, search);
-
-  matchClass("default", "default", score_threshold);
-}
-
-void Detector::matchClass(const cv::String &match_name,
-                          const cv::String &search_name, float score_threshold) {
-  vector<Ptr<ShapeTemplate> > &vtp = templates_map[match_name];
-  vector<LinearMemory> &vlm = memories_map[match_name];
-  vector<Match> matches;
-  int num_templates = vtp.size() / pyramid_level;
-
-  for (int template_id = 0; template_id < num_templates; template_id++) {
-    int match_level = pyramid_level - 1;
-    Ptr<ShapeTemplate> templ = vtp[match_level * num_templates + template_id];
-    LinearMemory *response_map_begin = &vlm[match_level * QUANTIZE_BASE];
-
-    LinearMemory similarity(block_size);
-    computeSimilarity(response_map_begin, *templ, similarity);
-
-    int num_features = (*templ).features.size();
-    int raw_threshold = static_cast<int>(4 * num_features + 
-                        (score_threshold / 100.0f) * (4 * num_features) + 0.5f);
-
-    vector<Match> candidates;
-    for (int r = 0; r < similarity.rows; r++) {
-      for (int c = 0; c < similarity.cols; c++) {
-        int raw_score = similarity.linear_at(r, c);
-        if (raw_score > raw_threshold) {
-          float score = (raw_score * 100.0f) / (8 * num_features) + 0.5f;
-          candidates.push_back(Match(c, r, score, match_name, template_id));
-        }
+Detector::Detector(const Ptr<const TemplateSet> &_templates, int num_threads,
+                   int _num_orientations, int _block_size)
+    : num_orientations(_num_orientations), block_size(_block_size),
+      templates(_templates), pool(makePtr<ThreadPool>(num_threads)) {
+  CV_Assert(templates);
+  CV_Assert(num_orientations == 8 || num_orientations == 16);
+  CV_Assert(block_size == 4 || block_size == 8);
+}
+
+void Detector::match(MatchContext &context, const Mat &src,
+                     float score_threshold, const String &class_name,
+                     const Mat &src_mask) const {
+  addSource(context, src, src_mask);
+  matchClass(context, class_name, score_threshold);
+}
+
+void Detector::match(MatchContext &context, const Mat &src,
+                     float score_threshold, const vector<Rect> &search_rois,
+                     const String &class_name, const Mat &src_mask) const {
+  addSource(context, src, search_rois, src_mask);
+  matchClass(context, class_name, score_threshold);
+}
+
+/// @brief 匹配一类中的一个模板: 最高层全图搜索后逐层精化位置与位姿
+/// @param similarity 相似度缓冲区
+/// @param candidates 输出的匹配
+static void matchTemplate(const TemplateClass &templs, int template_id,
+                          const ResponsePyramid &memories,
+                          float score_threshold, const String &class_name,
+                          LinearMemory &similarity,
+                          vector<Match> &candidates) {
+  const int top = templs.pyramid_level - 1;
+  const TemplateView templ = templs.at(top, template_id);
+  const int num_features = templ.num_features;
+  if (num_features == 0)
+    return;
+
+  // 最高层: 全图计算相似度, 取超过阈值的局部极大值作为候选点
+  {
+    ProfileScope scope(STAGE_SIMILARITY);
+    computeSimilarity(memories.linear_memories.data(), templ, similarity,
+                      memories.orientations());
+  }
+
+  const int raw_threshold = rawThreshold(score_threshold, num_features);
+  profileCount(COUNTER_TEMPLATES_EVALUATED, 1, top);
+  profileCount(COUNTER_FEATURES_EVALUATED, num_features, top);
+
+  const Size &top_size = memories.sizes[top];
+  for (int r = 0; r < top_size.height; r++) {
+    for (int c = 0; c < top_size.width; c++) {
+      int raw_score = similarity.linear_at<short>(r, c);
+      if (raw_score >= raw_threshold &&
+          isLocalMaximum(similarity, top_size, r, c)) {
+        float score = (raw_score * 100.0f) / (8 * num_features);
+        candidates.push_back(Match(c, r, score, class_name, template_id));
       }
     }
-
-    for (int l = match_level - 1; l >= 0; l--) {
-      Ptr<ShapeTemplate> templ = vtp[match_level * num_templates + template_id];
-      LinearMemory *response_map_begin = &vlm[match_level * QUANTIZE_BASE];
-
-      LinearMemory local_similarity(block_size);
-      local_similarity.create(response_map_begin->linear_size(), 0);
-      local_similarity.rows = response_map_begin->rows;
-      local_similarity.cols = response_map_begin->cols;
-      for (int k = 0; k < (int)candidates.size(); k++) {
-        Match &point = candidates[k];
-        int x = point.x * 2;
-        int y = point.y * 2;
-
-        addLocalSimilarity(response_map_begin, *templ, local_similarity, x, y);
-
-        int best_score = 0;
-        Point best_match(-1, -1);
-        for (int r = 0; r < local_similarity.rows; r++) {
-          for (int l = 0; l < local_similarity.cols; l++) {
-            int score = local_similarity.linear_at(r, l);
-            if (score > best_score) {
-              best_score = score;
-              best_match = Point(l, r);
+  }
+  profileCount(COUNTER_CANDIDATES, (int64_t)candidates.size(), top);
+  if (candidates.empty())
+    profileCount(COUNTER_TEMPLATES_PRUNED, 1, top);
+
+  // 逐层精化: 在下一层以 2 倍坐标为中心的窗口内, 对上一层位姿附近的各个
+  // 位姿重新计分, 取位置与位姿的最优组合
+  ProfileScope scope(STAGE_PYRAMID_REFINE);
+  short window[REFINE_WINDOW * REFINE_WINDOW];
+  vector<int> poses;
+  for (int l = top - 1; l >= 0 && !candidates.empty(); l--) {
+    const vector<Mat> &response_maps = memories.response_maps[l];
+    const Size &size = memories.sizes[l];
+
+    for (auto &point : candidates) {
+      Point tl(point.x * 2 - REFINE_WINDOW / 2, point.y * 2 - REFINE_WINDOW / 2);
+      float best_similarity = 0;
+      int best_id = point.template_id;
+      Point best_match(point.x * 2, point.y * 2);
+
+      templs.neighborPoses(l, point.template_id, poses);
+      for (int id : poses) {
+        // 只有存活候选点附近的位姿才会生成较低层的模板
+        const TemplateView templ = templs.at(l, id);
+        if (templ.num_features == 0)
+          continue;
+        computeWindowSimilarity(response_maps, templ, tl, window);
+        profileCount(COUNTER_TEMPLATES_EVALUATED, 1, l);
+        profileCount(COUNTER_FEATURES_EVALUATED, templ.num_features, l);
+
+        int best_score = -1;
+        Point match(point.x * 2, point.y * 2);
+        for (int r = 0; r < REFINE_WINDOW; r++) {
+          for (int c = 0; c < REFINE_WINDOW; c++) {
+            const int y = tl.y + r, x = tl.x + c;
+            if (y < 0 || x < 0 || y >= size.height || x >= size.width)
+              continue;
+            if (window[r * REFINE_WINDOW + c] > best_score) {
+              best_score = window[r * REFINE_WINDOW + c];
+              match = Point(x, y);
             }
           }
         }
 
-        point.x = best_match.x;
-        point.y = best_match.y;
-        point.similarity = (best_score * 100.0f) / (8 * num_features);
+        const float similarity =
+            (max(best_score, 0) * 100.0f) / (8 * templ.num_features);
+        if (similarity > best_similarity) {
+          best_similarity = similarity;
+          best_id = id;
+          best_match = match;
+        }
       }
 
-      // Filter out any matches that drop below the similarity threshold
-      vector<Match>::iterator new_end = remove_if(
-          candidates.begin(), candidates.end(), MatchPredicate(score_threshold));
-      candidates.erase(new_end, candidates.end());
+      point.x = best_match.x;
+      point.y = best_match.y;
+      point.similarity = best_similarity;
+      point.template_id = best_id;
+    }
+
+    // Filter out any matches that drop below the similarity threshold
+    vector<Match>::iterator new_end = remove_if(
+        candidates.begin(), candidates.end(), MatchPredicate(score_threshold));
+    candidates.erase(new_end, candidates.end());
+
+    // 不同候选点可能收敛到同一位置, 只保留得分最高的一个
+    sort(candidates.begin(), candidates.end(),
+         [](const Match &a, const Match &b) {
+           if (a.y != b.y)
+             return a.y < b.y;
+           if (a.x != b.x)
+             return a.x < b.x;
+           return a.similarity > b.similarity;
+         });
+    new_end = unique(candidates.begin(), candidates.end(),
+                     [](const Match &a, const Match &b) {
+                       return a.x == b.x && a.y == b.y;
+                     });
+    candidates.erase(new_end, candidates.end());
+    profileCount(COUNTER_CANDIDATES, (int64_t)candidates.size(), l);
+    if (candidates.empty())
+      profileCount(COUNTER_TEMPLATES_PRUNED, 1, l);
+  }
+}
+
+void Detector::matchClass(MatchContext &context, const String &class_name,
+                          float score_threshold) const {
+  matchClasses(context, vector<String>(1, class_name), score_threshold);
+}
+
+void Detector::matchClasses(MatchContext &context,
+                            const vector<String> &class_names,
+                            float score_threshold) const {
+  ProfileBinding binding(context.profile_.get());
+  ProfileScope scope(STAGE_MATCH);
+  const vector<Ptr<const ResponsePyramid> > &sources = context.sources;
+
+  // 所有类别最高层的模板展开为同一组任务, 第 k 类占据 [first[k], first[k + 1]),
+  // 有多个搜索区域时每个区域各占一组
+  vector<const TemplateClass *> classes;
+  vector<int> first(1, 0);
+  for (const auto &class_name : class_names) {
+    const TemplateClass &templs = templates->at(class_name);
+    for (const auto &source : sources)
+      CV_Assert(source->levels() == templs.pyramid_level);
+    classes.push_back(&templs);
+    first.push_back(first.back() + (int)templs.top_templates.size());
+  }
+  const int num_tasks = first.back();
+
+  // 每个工作线程独占一个相似度缓冲区, 尺寸不变时 create 不会重新分配内存.
+  // 缓冲区属于上下文, 线程池忙碌时在调用线程内以 0 号缓冲区串行执行
+  const int num_workers = pool->size();
+  vector<LinearMemory> &similarities = context.similarities;
+  if ((int)similarities.size() < num_workers)
+    similarities.resize(num_workers, LinearMemory(block_size));
+
+  // 按任务保存各模板的匹配结果, 合并顺序与线程数无关
+  vector<vector<Match> > template_matches(num_tasks * sources.size());
+
+  pool->parallel_for(0, (int)template_matches.size(), [&](int task, int worker_id) {
+    const ResponsePyramid &memories = *sources[task / num_tasks];
+    const int t = task % num_tasks;
+    const int k = static_cast<int>(std::upper_bound(first.begin(), first.end(), t) -
+                                   first.begin()) - 1;
+    vector<Match> &matches = template_matches[task];
+    matchTemplate(*classes[k], classes[k]->top_templates[t - first[k]],
+                  memories, score_threshold, class_names[k],
+                  similarities[worker_id], matches);
+    for (Match &match : matches) {
+      match.x += memories.offset.x;
+      match.y += memories.offset.y;
+    }
+  });
+
+  const vector<Rect> &search_rois = context.search_rois;
+  auto inSearchRegion = [&](const Match &match) {
+    if (search_rois.empty())
+      return true;
+    for (const Rect &roi : search_rois)
+      if (roi.contains(Point(match.x, match.y)))
+        return true;
+    return false;
+  };
+
+  for (int k = 0; k < (int)classes.size(); k++) {
+    vector<Match> matches;
+    for (int s = 0; s < (int)sources.size(); s++)
+      for (int t = first[k]; t < first[k + 1]; t++)
+        for (const Match &match : template_matches[s * num_tasks + t])
+          if (inSearchRegion(match))
+            matches.push_back(match);
+    context.matches_map[class_names[k]] = std::move(matches);
+  }
+}
+
+float line2Dup::rotatedIoU(const RotatedRect &a, const RotatedRect &b) {
+  const float area_a = a.size.area(), area_b = b.size.area();
+  if (area_a <= 0 || area_b <= 0)
+    return 0.0f;
+
+  vector<Point2f> intersection;
+  if (rotatedRectangleIntersection(a, b, intersection) == INTERSECT_NONE)
+    return 0.0f;
+
+  const float inter = static_cast<float>(contourArea(intersection));
+  return inter / (area_a + area_b - inter);
+}
+
+void line2Dup::nmsRotatedBoxes(const vector<RotatedRect> &boxes,
+                               const vector<float> &scores, float iou_threshold,
+                               int top_k, vector<int> &indices) {
+  CV_Assert(boxes.size() == scores.size());
+  indices.clear();
+  if (boxes.empty())
+    return;
+
+  vector<int> order(boxes.size());
+  for (int i = 0; i < (int)order.size(); i++)
+    order[i] = i;
+  stable_sort(order.begin(), order.end(),
+              [&](int i, int j) { return scores[i] > scores[j]; });
+
+  // 网格边长取最大外接矩形的边长, 相交的矩形必然落在相邻的网格中
+  vector<Rect> bounds(boxes.size());
+  Rect region = boxes[0].boundingRect();
+  int cell = 1;
+  for (int i = 0; i < (int)boxes.size(); i++) {
+    bounds[i] = boxes[i].boundingRect();
+    region |= bounds[i];
+    cell = max(cell, max(bounds[i].width, bounds[i].height));
+  }
+  const int grid_cols = region.width / cell + 1;
+  const int grid_rows = region.height / cell + 1;
+  vector<vector<int> > grid(grid_cols * grid_rows);
+
+  // 同一已保留矩形可能登记在多个网格中, 以 visited 标记避免重复比较
+  vector<int> visited(boxes.size(), -1);
+  for (int i : order) {
+    if (top_k > 0 && (int)indices.size() >= top_k)
+      break;
+
+    const Rect &bound = bounds[i];
+    const int c0 = (bound.x - region.x) / cell;
+    const int r0 = (bound.y - region.y) / cell;
+    const int c1 = (bound.x + bound.width - region.x) / cell;
+    const int r1 = (bound.y + bound.height - region.y) / cell;
+
+    bool suppressed = false;
+    for (int r = r0; r <= min(r1, grid_rows - 1) && !suppressed; r++) {
+      for (int c = c0; c <= min(c1, grid_cols - 1) && !suppressed; c++) {
+        for (int k : grid[r * grid_cols + c]) {
+          if (visited[k] == i)
+            continue;
+          visited[k] = i;
+          if ((bound & bounds[k]).area() > 0 &&
+              rotatedIoU(boxes[i], boxes[k]) > iou_threshold) {
+            suppressed = true;
+            break;
+          }
+        }
+      }
     }
+    if (suppressed)
+      continue;
 
-    matches.insert(matches.end(), candidates.begin(), candidates.end());
+    indices.push_back(i);
+    for (int r = r0; r <= min(r1, grid_rows - 1); r++)
+      for (int c = c0; c <= min(c1, grid_cols - 1); c++)
+        grid[r * grid_cols + c].push_back(i);
   }
+}
+
+void line2Dup::maskRegions(const Mat &search_mask, vector<Rect> &rois) {
+  CV_Assert(search_mask.type() == CV_8U);
+  vector<vector<Point> > contours;
+  findContours(search_mask.clone(), contours, RETR_EXTERNAL, CHAIN_APPROX_SIMPLE);
+  rois.clear();
+  for (const auto &contour : contours)
+    rois.push_back(boundingRect(contour));
+}
 
-  matches_map.insert(make_pair(match_name, matches));
+/// @brief 模板选框在源图像中的位置. 选框中心以特征坐标原点为参照,
+/// position 为原点 (即匹配位置) 在源图像中的坐标
+static RotatedRect placeBox(const TemplateView &templ, Point2f position) {
+  RotatedRect box = templ.box;
+  box.center += position;
+  return box;
 }
 
-void Detector::detectBestMatch(vector<Vec6f> &points, 
+void Detector::detectBestMatch(const MatchContext &context,
+                               vector<Vec6f> &points,
                                vector<RotatedRect> &boxes,
-                               const String &match_name) {
-  vector<Ptr<ShapeTemplate> > &vtp = templates_map[match_name];
-  vector<Match> &matches = matches_map[match_name];
+                               const String &class_name,
+                               float iou_threshold, int max_instances) const {
+  ProfileBinding binding(context.profile_.get());
+  ProfileScope scope(STAGE_NMS);
+  const TemplateClass &templs = templates->at(class_name);
+  const vector<Match> &matches = context.matches(class_name);
+
+  // 模板选框平移到匹配位置
+  vector<RotatedRect> match_boxes(matches.size());
+  vector<float> scores(matches.size());
+  for (int i = 0; i < (int)matches.size(); i++) {
+    match_boxes[i] = placeBox(templs.at(0, matches[i].template_id),
+                              Point2f(matches[i].x, matches[i].y));
+    scores[i] = matches[i].similarity;
+  }
 
-  vector<bool> count(vtp.size() / pyramid_level, false);
-  points.resize(matches.size());
+  vector<int> keep;
+  nmsRotatedBoxes(match_boxes, scores, iou_threshold, max_instances, keep);
+
+  points.resize(keep.size());
+  boxes.resize(keep.size());
+  for (int i = 0; i < (int)keep.size(); i++) {
+    const Match &match = matches[keep[i]];
+    const TemplateView templ = templs.at(0, match.template_id);
+    points[i][0] = match.x;
+    points[i][1] = match.y;
+    points[i][2] = templ.scale;
+    points[i][3] = templ.angle;
+    points[i][4] = match.similarity;
+    points[i][5] = match.template_id;
+    boxes[i] = match_boxes[keep[i]];
+  }
+}
+
+/// 位姿精化时沿法向寻找边缘的范围 (像素)
+static const int REFINE_SEARCH_RANGE = 3;
+/// 对应点的梯度方向与模板方向夹角的余弦下限 (约 35 度, 不区分正反)
+static const float REFINE_COS_TOLERANCE = 0.82f;
+/// 精化后的平移相对原位置的最大偏移 (像素)
+static const float REFINE_MAX_SHIFT = 4.0f;
+
+/// @brief 以 Gauss-Newton 法精化一个匹配的位姿. 模板点 p 映射为
+/// T(p) = t + sigma * R(theta) * (p - c), c 为特征点重心
+/// @param offset 匹配位置, 即 theta = 0, sigma = 1 时模板坐标原点的位置
+/// @param pose 输出 (t.x, t.y, theta 弧度, sigma) 与重心 c
+/// @return 是否收敛到允许范围内
+static bool refinePose(const TemplateView &templ, const Mat &magnitude,
+                       const Mat &angle, float threshold, Point2f offset,
+                       int max_iterations, float max_angle, float max_scale,
+                       Vec4f &pose, Point2f &centroid) {
+  const int n = templ.num_features;
+  if (n < 8)
+    return false;
 
+  Point2f c(0, 0);
+  for (int i = 0; i < n; i++)
+    c += Point2f(templ.features[i].x, templ.features[i].y);
+  c *= 1.0f / n;
+
+  const Point2f t0 = offset + c;
+  Point2f t = t0;
+  float theta = 0, sigma = 1;
+  const float deg2rad = static_cast<float>(CV_PI / 180.0);
+  const int rows = magnitude.rows, cols = magnitude.cols;
+  auto magnitudeAt = [&](Point2f p) {
+    const int x = cvRound(p.x), y = cvRound(p.y);
+    if (x < 0 || y < 0 || x >= cols || y >= rows)
+      return -1.0f;
+    return magnitude.at<float>(y, x);
+  };
+
+  for (int iter = 0; iter < max_iterations; iter++) {
+    profileCount(COUNTER_REFINE_ITERATIONS, 1);
+    const float cos_t = cos(theta), sin_t = sin(theta);
+    Matx44d JtJ = Matx44d::zeros();
+    Vec4d Jtr(0, 0, 0, 0);
+    int count = 0;
+
+    for (int i = 0; i < n; i++) {
+      const Gradient &f = templ.features[i];
+      const Point2f d0(f.x - c.x, f.y - c.y);
+      const Point2f d(sigma * (cos_t * d0.x - sin_t * d0.y),
+                      sigma * (sin_t * d0.x + cos_t * d0.y));
+      const Point2f q = t + d;
+      const float phi = f.angle * deg2rad + theta;
+      const Point2f normal(cos(phi), sin(phi));
+
+      // 沿模板法向寻找幅值最大且方向一致的源图像边缘
+      int best_k = 0;
+      float best_mag = threshold;
+      float best_angle = 0;
+      for (int k = -REFINE_SEARCH_RANGE; k <= REFINE_SEARCH_RANGE; k++) {
+        const Point2f p = q + k * normal;
+        const float mag = magnitudeAt(p);
+        if (mag <= best_mag)
+          continue;
+        const float a = angle.at<float>(cvRound(p.y), cvRound(p.x)) * deg2rad;
+        if (abs(cos(a - phi)) < REFINE_COS_TOLERANCE)
+          continue;
+        best_k = k;
+        best_mag = mag;
+        best_angle = a;
+      }
+      if (best_mag <= threshold)
+        continue;
+
+      // 以相邻幅值拟合抛物线得到亚像素边缘位置
+      float delta = 0;
+      const float m_prev = sqrt(max(magnitudeAt(q + (best_k - 1) * normal), 0.0f));
+      const float m_next = sqrt(max(magnitudeAt(q + (best_k + 1) * normal), 0.0f));
+      const float m_best = sqrt(best_mag);
+      const float denom = m_prev - 2 * m_best + m_next;
+      if (denom < 0)
+        delta = max(-0.5f, min(0.5f, 0.5f * (m_prev - m_next) / denom));
+      const Point2f edge = q + (best_k + delta) * normal;
+
+      // 点到边缘切线的距离及其对 (t.x, t.y, theta, sigma) 的导数
+      const Point2f ns(cos(best_angle), sin(best_angle));
+      const double r = ns.dot(q - edge);
+      const Vec4d J(ns.x, ns.y, ns.dot(Point2f(-d.y, d.x)), ns.dot(d) / sigma);
+      const double w = abs(r) <= 1.0 ? 1.0 : 1.0 / abs(r); // Huber 权重
+      JtJ += w * (Matx41d(J) * Matx14d(J[0], J[1], J[2], J[3]));
+      Jtr += w * r * J;
+      count++;
+    }
+
+    if (count < 8)
+      return false;
+
+    Mat delta;
+    if (!solve(Mat(JtJ), Mat(-Jtr), delta, DECOMP_CHOLESKY))
+      return false;
+    t.x += static_cast<float>(delta.at<double>(0));
+    t.y += static_cast<float>(delta.at<double>(1));
+    theta += static_cast<float>(delta.at<double>(2));
+    sigma += static_cast<float>(delta.at<double>(3));
+
+    if (norm(t - t0) > REFINE_MAX_SHIFT || abs(theta) > max_angle ||
+        abs(sigma - 1) > max_scale)
+      return false;
+    if (abs(delta.at<double>(0)) + abs(delta.at<double>(1)) < 1e-3 &&
+        abs(delta.at<double>(2)) < 1e-5 && abs(delta.at<double>(3)) < 1e-5)
+      break;
+  }
+
+  pose = Vec4f(t.x, t.y, theta, sigma);
+  centroid = c;
+  return true;
+}
+
+void Detector::refineMatches(const MatchContext &context,
+                             vector<Vec6f> &points, vector<RotatedRect> &boxes,
+                             const String &class_name,
+                             int max_iterations) const {
+  CV_Assert(context.hasSource() && points.size() == boxes.size());
+  ProfileBinding binding(context.profile_.get());
+  ProfileScope scope(STAGE_POSE_REFINE);
+  const TemplateClass &templs = templates->at(class_name);
+
+  // 允许的偏离不超过一个搜索步长, 未设置步长时取 1 度与 2%
+  const float max_angle = static_cast<float>(CV_PI / 180.0) *
+                          (templs.search.angle.step > 0 ? templs.search.angle.step : 1.0f);
+  const float max_scale =
+      templs.search.scale.step > 0 ? templs.search.scale.step : 0.02f;
+
+  pool->parallel_for(0, (int)points.size(), [&](int i, int) {
+    Vec6f &point = points[i];
+    const TemplateView templ = templs.at(0, cvRound(point[5]));
+
+    // 匹配位置所在的源图像区域
+    const Point position(cvRound(point[0]), cvRound(point[1]));
+    const ResponsePyramid *source = nullptr;
+    for (const auto &pyramid : context.sources)
+      if (pyramid->region().contains(position))
+        source = pyramid.get();
+    if (!source)
+      return;
+
+    Vec4f pose;
+    Point2f c;
+    const Point2f offset(source->offset.x, source->offset.y);
+    if (!refinePose(templ, source->magnitude, source->angle,
+                    source->magnitude_threshold,
+                    Point2f(point[0], point[1]) - offset, max_iterations,
+                    max_angle, max_scale, pose, c))
+      return;
+
+    // 模板点 p (以特征坐标原点为参照) 映射为 t + sigma * R(theta) * (p - c)
+    const Point2f t = Point2f(pose[0], pose[1]) + offset;
+    const float theta = pose[2], sigma = pose[3];
+    auto transform = [&](Point2f p) {
+      const Point2f d = p - c;
+      return t + sigma * Point2f(cos(theta) * d.x - sin(theta) * d.y,
+                                 sin(theta) * d.x + cos(theta) * d.y);
+    };
+
+    const Point2f origin = transform(Point2f(0, 0));
+    const float theta_deg = theta * static_cast<float>(180.0 / CV_PI);
+    point[0] = origin.x;
+    point[1] = origin.y;
+    point[2] = templ.scale * sigma;
+    point[3] = templ.angle + theta_deg;
+
+    // 选框中心与特征点同在特征坐标系中, 以同一变换映射到源图像
+    RotatedRect &box = boxes[i];
+    box.center = transform(templ.box.center);
+    box.size = Size2f(templ.box.size.width * sigma, templ.box.size.height * sigma);
+    box.angle = templ.box.angle + theta_deg;
+  });
+}
+
+void Detector::matchLocal(MatchContext &context, const Mat &src,
+                          const vector<Vec6f> &seeds, float score_threshold,
+                          vector<Vec6f> &points, vector<RotatedRect> &boxes,
+                          const String &class_name, int angle_radius,
+                          int scale_radius) const {
+  ProfileBinding binding(context.profile_.get());
+  ProfileScope scope(STAGE_LOCAL_SEARCH);
+  const TemplateClass &templs = templates->at(class_name);
+  const Rect image(Point(0, 0), src.size());
+  // 窗口内任一位置的模板及其梯度、扩散邻域都须落在局部区域内
+  const int padding = cvCeil(templs.extent) + REFINE_WINDOW / 2 + 8;
+
+  points.assign(seeds.size(), Vec6f());
+  boxes.assign(seeds.size(), RotatedRect());
+  vector<Ptr<const ResponsePyramid> > sources(seeds.size());
+
+  pool->parallel_for(0, (int)seeds.size(), [&](int i, int) {
+    const Vec6f &seed = seeds[i];
+    const Point center(cvRound(seed[0]), cvRound(seed[1]));
+    const Rect region = Rect(center.x - padding, center.y - padding,
+                             2 * padding + 1, 2 * padding + 1) & image;
+    if (region.empty())
+      return;
+
+    // 各种子已在线程池中并行处理, 区域内的预处理串行执行
+    Ptr<ResponsePyramid> pyramid = makePtr<ResponsePyramid>();
+    ColorGradientPyramid modality(src(region), Mat(), 80.0f, 5, 100,
+                                  num_orientations, nullptr);
+    modality.gradients(pyramid->magnitude, pyramid->angle,
+                       pyramid->magnitude_threshold);
+    Mat quantized, spread_quantized;
+    modality.quantize(quantized);
+    spread(quantized, spread_quantized, 3);
+    pyramid->response_maps.resize(1);
+    computeResponseMaps(spread_quantized, pyramid->response_maps[0]);
+    pyramid->sizes.push_back(region.size());
+    pyramid->offset = region.tl();
+    sources[i] = pyramid;
+
+    // 种子位姿附近的角度与缩放
+    const int seed_id = cvRound(seed[5]);
+    const int ai = seed_id % templs.num_angles, si = seed_id / templs.num_angles;
+    const Point tl = center - region.tl() -
+                     Point(REFINE_WINDOW / 2, REFINE_WINDOW / 2);
+    short window[REFINE_WINDOW * REFINE_WINDOW];
+    float best_similarity = 0;
+    Point best_match;
+    int best_id = seed_id;
+
+    for (int ds = -scale_radius; ds <= scale_radius; ds++) {
+      const int s = si + ds;
+      if (s < 0 || s >= templs.num_scales)
+        continue;
+      for (int da = -angle_radius; da <= angle_radius; da++) {
+        int a = ai + da;
+        if (templs.angle_wraps)
+          a = (a % templs.num_angles + templs.num_angles) % templs.num_angles;
+        else if (a < 0 || a >= templs.num_angles)
+          continue;
+
+        const int id = s * templs.num_angles + a;
+        const TemplateView templ = templs.at(0, id);
+        if (templ.num_features == 0)
+          continue;
+        computeWindowSimilarity(pyramid->response_maps[0], templ, tl, window);
+        profileCount(COUNTER_TEMPLATES_EVALUATED, 1);
+        profileCount(COUNTER_FEATURES_EVALUATED, templ.num_features);
+
+        for (int r = 0; r < REFINE_WINDOW; r++) {
+          for (int c = 0; c < REFINE_WINDOW; c++) {
+            const int y = tl.y + r, x = tl.x + c;
+            if (y < 0 || x < 0 || y >= region.height || x >= region.width)
+              continue;
+            const float similarity = (max<int>(window[r * REFINE_WINDOW + c], 0) *
+                                      100.0f) / (8 * templ.num_features);
+            if (similarity > best_similarity) {
+              best_similarity = similarity;
+              best_match = Point(x, y) + region.tl();
+              best_id = id;
+            }
+          }
+        }
+      }
+    }
+
+    if (best_similarity < score_threshold)
+      return;
+    profileCount(COUNTER_CANDIDATES, 1);
+    const TemplateView templ = templs.at(0, best_id);
+    points[i] = Vec6f(best_match.x, best_match.y, templ.scale, templ.angle,
+                      best_similarity, best_id);
+    boxes[i] = placeBox(templ, Point2f(best_match.x, best_match.y));
+  });
+
+  context.sources.clear();
+  for (const auto &source : sources)
+    if (source)
+      context.sources.push_back(source);
+  context.search_rois.clear();
+  context.matches_map.clear();
+}
+
+namespace {
+
+/// @brief 流水线阶段之间的有界队列, 关闭后 push 失败, pop 取完剩余元素后失败
+template <typename T> class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t _capacity) : capacity(_capacity), closed(false) {}
+
+  bool push(T item) {
+    unique_lock<mutex> lock(m);
+    not_full.wait(lock, [&] { return closed || items.size() < capacity; });
+    if (closed)
+      return false;
+    items.push_back(std::move(item));
+    not_empty.notify_one();
+    return true;
+  }
+
+  bool pop(T &item) {
+    unique_lock<mutex> lock(m);
+    not_empty.wait(lock, [&] { return closed || !items.empty(); });
+    if (items.empty())
+      return false;
+    item = std::move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+
+  void close() {
+    lock_guard<mutex> lock(m);
+    closed = true;
+    not_full.notify_all();
+    not_empty.notify_all();
+  }
+
+private:
+  size_t capacity;
+  bool closed;
+  deque<T> items;
+  mutex m;
+  condition_variable not_full, not_empty;
+};
+
+/// @brief 流水线中的一帧
+struct BatchItem {
+  int index;
+  MatchContext context;
+};
+
+} // namespace
+
+void Detector::matchBatch(
+    const function<bool(Mat &)> &next_frame,
+    const function<void(int, const vector<Vec6f> &, const vector<RotatedRect> &)>
+        &on_result,
+    float score_threshold, const String &class_name, int max_in_flight,
+    bool refine) const {
+  CV_Assert(max_in_flight > 0);
+  // 每帧占用一个 BatchItem. 全部 max_in_flight 个预先放入 idle, 预处理线程
+  // 取到空闲项后才读取下一帧, 交付后归还, 因此包括各阶段正在处理的帧在内,
+  // 流水线中的帧数不超过 max_in_flight. 各队列不会超出容量, 不另作限制.
+  // 归还的项复用其上下文中的缓冲区, 不必重新分配
+  BoundedQueue<unique_ptr<BatchItem> > idle(max_in_flight),
+      preprocessed(max_in_flight), matched(max_in_flight);
+  for (int i = 0; i < max_in_flight; i++)
+    idle.push(unique_ptr<BatchItem>(new BatchItem()));
+
+  // 相似度与精化都使用 Detector 的线程池. 线程池被占用时后来的调用会在自身
+  // 线程内串行执行, 因此二者轮流持有 pool_turn, 各自使用全部线程. 精化的
+  // 耗时远小于相似度, 轮流执行的代价很小
+  mutex pool_turn;
+
+  mutex error_mutex;
+  exception_ptr error;
+  auto fail = [&]() {
+    lock_guard<mutex> lock(error_mutex);
+    if (!error)
+      error = current_exception();
+    idle.close();
+    preprocessed.close();
+    matched.close();
+  };
+
+  // 调用线程绑定的统计传给流水线的各个线程
+  Profile *profile = Profile::current();
+
+  // 预处理: 读取帧并计算响应图金字塔. 在本线程内串行执行, 与占用线程池的
+  // 相似度阶段重叠
+  thread preprocess_thread([&] {
+    ProfileBinding binding(profile);
+    try {
+      unique_ptr<BatchItem> item;
+      for (int index = 0; idle.pop(item); index++) {
+        Mat frame;
+        if (!next_frame(frame))
+          break;
+        item->index = index;
+        {
+          ProfileScope scope(STAGE_PREPROCESS);
+          item->context.clear();
+          item->context.sources.push_back(
+              computeSource(frame, Mat(), Point(), nullptr));
+        }
+        if (!preprocessed.push(std::move(item)))
+          break;
+      }
+    } catch (...) {
+      fail();
+    }
+    preprocessed.close();
+  });
+
+  // 相似度: 在线程池中计算所有模板
+  thread match_thread([&] {
+    ProfileBinding binding(profile);
+    try {
+      unique_ptr<BatchItem> item;
+      while (preprocessed.pop(item)) {
+        {
+          lock_guard<mutex> turn(pool_turn);
+          matchClass(item->context, class_name, score_threshold);
+        }
+        if (!matched.push(std::move(item)))
+          break;
+      }
+    } catch (...) {
+      fail();
+    }
+    matched.close();
+  });
+
+  // 抑制与精化在调用线程中进行, 结果按帧的顺序交付
+  try {
+    unique_ptr<BatchItem> item;
+    vector<Vec6f> points;
+    vector<RotatedRect> boxes;
+    while (matched.pop(item)) {
+      detectBestMatch(item->context, points, boxes, class_name);
+      if (refine) {
+        lock_guard<mutex> turn(pool_turn);
+        refineMatches(item->context, points, boxes, class_name);
+      }
+      on_result(item->index, points, boxes);
+      item->context.clear();
+      idle.push(std::move(item));
+    }
+  } catch (...) {
+    fail();
+  }
+
+  preprocess_thread.join();
+  match_thread.join();
+  if (error)
+    rethrow_exception(error);
+}
+
+void Detector::matchBatch(const vector<Mat> &frames, float score_threshold,
+                          vector<vector<Vec6f> > &points,
+                          vector<vector<RotatedRect> > &boxes,
+                          const String &class_name, bool refine) const {
+  points.assign(frames.size(), vector<Vec6f>());
+  boxes.assign(frames.size(), vector<RotatedRect>());
+  size_t next = 0;
+  matchBatch(
+      [&](Mat &frame) {
+        if (next == frames.size())
+          return false;
+        frame = frames[next++];
+        return true;
+      },
+      [&](int index, const vector<Vec6f> &frame_points,
+          const vector<RotatedRect> &frame_boxes) {
+        points[index] = frame_points;
+        boxes[index] = frame_boxes;
+      },
+      score_threshold, class_name, 4, refine);
+}
+
+/// class Tracker
+
+Tracker::Tracker(const Detector &_detector, const String &_class_name,
+                 float _score_threshold, int _max_instances)
+    : angle_radius(2), scale_radius(1), refine(false), detector(_detector),
+      class_name(_class_name), score_threshold(_score_threshold),
+      max_instances(_max_instances), global_search(false) {}
+
+void Tracker::searchGlobally(const Mat &frame, vector<Vec6f> &points,
+                             vector<RotatedRect> &boxes) {
+  global_search = true;
+  detector.match(context, frame, score_threshold, class_name);
+  detector.detectBestMatch(context, points, boxes, class_name, 0.5f,
+                           max_instances);
+  if (refine)
+    detector.refineMatches(context, points, boxes, class_name);
+
+  tracks.resize(points.size());
   for (int i = 0; i < (int)points.size(); i++) {
-    int temp_id = matches[i].template_id;
-    if (!count[temp_id]) {
-      boxes.push_back(vtp[temp_id]->box);
-      count[temp_id] = true;
+    tracks[i].pose = points[i];
+    tracks[i].velocity = Point2f(0, 0);
+    tracks[i].angle_velocity = 0;
+  }
+}
+
+void Tracker::update(const Mat &frame, vector<Vec6f> &points,
+                     vector<RotatedRect> &boxes) {
+  if (tracks.empty()) {
+    searchGlobally(frame, points, boxes);
+    return;
+  }
+
+  const TemplateClass &templs = detector.templateSet().at(class_name);
+  const int num_angles = templs.num_angles;
+
+  // 匀速运动预测种子位姿
+  vector<Vec6f> seeds(tracks.size());
+  for (int i = 0; i < (int)tracks.size(); i++) {
+    const Track &track = tracks[i];
+    Vec6f &seed = seeds[i];
+    seed = track.pose;
+    seed[0] += track.velocity.x;
+    seed[1] += track.velocity.y;
+    const int id = cvRound(track.pose[5]);
+    int a = id % num_angles + cvRound(track.angle_velocity);
+    if (templs.angle_wraps)
+      a = (a % num_angles + num_angles) % num_angles;
+    else
+      a = min(max(a, 0), num_angles - 1);
+    seed[5] = static_cast<float>(id / num_angles * num_angles + a);
+  }
+
+  global_search = false;
+  detector.matchLocal(context, frame, seeds, score_threshold, points, boxes,
+                      class_name, angle_radius, scale_radius);
+  for (const Vec6f &point : points) {
+    if (point[4] < score_threshold) {
+      // 有目标跟丢, 重新全图搜索
+      searchGlobally(frame, points, boxes);
+      return;
+    }
+  }
+  if (refine)
+    detector.refineMatches(context, points, boxes, class_name);
+
+  // 以指数平滑更新速度
+  const float alpha = 0.5f;
+  for (int i = 0; i < (int)tracks.size(); i++) {
+    Track &track = tracks[i];
+    const Point2f motion(points[i][0] - track.pose[0],
+                         points[i][1] - track.pose[1]);
+    int da = cvRound(points[i][5]) % num_angles - cvRound(track.pose[5]) % num_angles;
+    if (templs.angle_wraps) {
+      if (da > num_angles / 2)
+        da -= num_angles;
+      else if (da < -num_angles / 2)
+        da += num_angles;
     }
-    points[i][0] = matches[i].x;
-    points[i][1] = matches[i].y;
-    points[i][2] = vtp[temp_id]->scale;
-    points[i][3] = vtp[temp_id]->angle;
-    points[i][4] = matches[i].similarity;
+    track.velocity = alpha * motion + (1 - alpha) * track.velocity;
+    track.angle_velocity = alpha * da + (1 - alpha) * track.angle_velocity;
+    track.pose = points[i];
   }
 }
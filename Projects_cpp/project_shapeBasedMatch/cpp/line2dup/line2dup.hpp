@@ -2,20 +2,37 @@
 #define LINE2D_UP_HPP
 
 #include "precomp.hpp"
+#include "profiler.hpp"
+#include "threadPool.hpp"
 
 namespace line2Dup {
 
 #define line2d_eps 1e-7f
 #define _degree_(x) ((x)*CV_PI) / 180.0
 
+/// 模板特征标签的方向数. 方向覆盖 180 度, 相反方向取相同标签. 匹配时可以
+/// 改用 8 个方向, 此时特征标签按 Orientations<8>::fromLabel 合并
 #define QUANTIZE_BASE 16
-
-#if QUANTIZE_BASE == 16
 #define QUANTIZE_TYPE CV_16U
 typedef ushort quantize_type;
-#elif QUNATIZE_BASE == 8
-#define QUANTIZE_TYPE CV_8U
-#endif
+
+/// @brief 量化方向数 NUM_ORI (8 或 16) 的编译期参数. 量化方向图像每个像素
+/// 以位表示方向, 16 个方向为 CV_16U, 8 个方向为 CV_8U
+template <int NUM_ORI> struct Orientations {
+  static_assert(NUM_ORI == 8 || NUM_ORI == 16, "8 or 16 orientations");
+  typedef typename std::conditional<NUM_ORI == 16, ushort, uchar>::type type;
+  static const int depth = NUM_ORI == 16 ? CV_16U : CV_8U;
+  static const int nibbles = NUM_ORI / 4; // 每个像素拆分的半字节数
+
+  /// @brief 标签 (QUANTIZE_BASE 个方向) 对应的方向
+  static int fromLabel(int label) { return label / (QUANTIZE_BASE / NUM_ORI); }
+};
+
+/// @brief 量化方向图像的类型对应的方向数
+inline int orientationCount(int quantized_type) {
+  CV_Assert(quantized_type == CV_16U || quantized_type == CV_8U);
+  return quantized_type == CV_16U ? 16 : 8;
+}
 
 // Feature -> Gradient -> Candidate
 
@@ -37,15 +54,6 @@ struct Gradient : Feature {
   Gradient() : Feature(), angle(0) {}
   Gradient(int _x, int _y, float _angle)
       : Feature(_x, _y, angle2label(_angle)), angle(_angle) {}
-  Gradient& operator =(const Gradient &rhs) {
-    if (this != &rhs) {
-      x = rhs.x;
-      y = rhs.y;
-      label = rhs.label;
-      angle = rhs.angle;
-    }
-    return *this;
-  }
 };
 
 /// @brief 待筛选的特征结构体
@@ -60,7 +68,7 @@ struct Candidate : Gradient {
 // ShapeTemplate
 class ShapeTemplate {
 public:
-  cv::RotatedRect box;
+  cv::RotatedRect box; // 模板选框, 中心以特征坐标原点为参照
   std::vector<Gradient> features;
   int pyramid_level;
   float scale;
@@ -70,13 +78,35 @@ public:
     : pyramid_level(_pyramid_level), scale(_scale), angle(fmod(_angle + 360.0f, 360.0f)) {}
 
   // 加载旋转缩放
-  cv::Ptr<ShapeTemplate> relocate(float new_scale, float new_angle);
+  cv::Ptr<ShapeTemplate> relocate(float new_scale, float new_angle) const;
 
   // 数据存储与读取
   void read(const cv::FileNode &fn);
   void write(cv::FileStorage &fs) const;
 };
 
+/// @brief 模板的只读视图. 特征数组可以属于 ShapeTemplate, 也可以直接位于映射
+/// 到内存的模板库文件中, 视图不拥有所指向的内存
+struct TemplateView {
+  cv::RotatedRect box;
+  const Gradient *features;
+  int num_features;
+  int pyramid_level;
+  float scale;
+  float angle;
+
+  TemplateView(const ShapeTemplate &templ)
+    : box(templ.box), features(templ.features.data()),
+      num_features(static_cast<int>(templ.features.size())),
+      pyramid_level(templ.pyramid_level), scale(templ.scale),
+      angle(templ.angle) {}
+  TemplateView(const cv::RotatedRect &_box, const Gradient *_features,
+               int _num_features, int _pyramid_level, float _scale,
+               float _angle)
+    : box(_box), features(_features), num_features(_num_features),
+      pyramid_level(_pyramid_level), scale(_scale), angle(_angle) {}
+};
+
 /// Search
 
 struct Range {
@@ -87,6 +117,17 @@ struct Range {
   Range(float range_params[3])
       : lower_bound(range_params[0]), upper_bound(range_params[1]),
         step(range_params[2]) {}
+
+  /// @brief 区间内的取值个数, 步长不大于 0 时只取下界
+  int count() const {
+    if (step <= 0)
+      return 1;
+    return std::max(1, static_cast<int>(std::floor(
+                           (upper_bound - lower_bound) / step + 1e-3f)) + 1);
+  }
+
+  /// @brief 第 i 个取值
+  float value(int i) const { return lower_bound + i * step; }
 };
 
 struct Search {
@@ -101,24 +142,40 @@ struct Search {
 /// @brief 1. 计算梯度方向的量化矩阵 2. 将提取模型
 class ColorGradientPyramid {
 public:
+  /// @param _num_orientations 量化方向数, 8 或 16
+  /// @param _pool 方向投票使用的线程池, 为空时串行执行. 线程池不归本对象所有
   ColorGradientPyramid(const cv::Mat &_src, 
                        const cv::Mat &_mask,
                        float _magnitude_threshold = 80.0f, 
                        int count_kernel_size = 5,
-                       size_t _num_features = 100);
+                       size_t _num_features = 100,
+                       int _num_orientations = QUANTIZE_BASE,
+                       ThreadPool *_pool = nullptr);
 
   cv::Ptr<ColorGradientPyramid> process(const cv::Mat src,
                                         const cv::Mat &mask = cv::Mat()) const {
-    return cv::makePtr<ColorGradientPyramid>(src, mask);
+    return cv::makePtr<ColorGradientPyramid>(src, mask, magnitude_threshold,
+                                             count_kernel_size, num_features,
+                                             num_orientations, pool);
   }
 
   void quantize(cv::Mat &dst) const {
-    angle.copyTo(dst, mask);
+    quantized_angle.copyTo(dst, mask);
   }
 
   bool extractTemplate(ShapeTemplate &templ) const;
 
-  void pyrDown();
+  /// @brief 当前层的梯度幅值 (平方) 与方向, 以及与幅值比较的阈值. 未保存
+  /// 梯度方向时 _angle 为空
+  void gradients(cv::Mat &_magnitude, cv::Mat &_angle, float &_threshold) const {
+    _magnitude = magnitude;
+    _angle = angle;
+    _threshold = raw_magnitude_threshold;
+  }
+
+  /// @param _keep_angle 是否保存下一层的梯度方向. 只需 quantize 时传入
+  /// false, 省去整幅的方向图像, 此时 extractTemplate 不可用
+  void pyrDown(bool _keep_angle = true);
 
 private:
   inline void update();
@@ -128,16 +185,49 @@ private:
   cv::Mat src;
   cv::Mat mask;
 
-  cv::Mat magnitude;
-  cv::Mat angle;
+  cv::Mat magnitude; // 梯度幅值的平方
+  bool keep_angle;   // 是否保存梯度方向, 见 pyrDown
+  cv::Mat angle;     // 梯度方向 [0, 360), keep_angle 为 false 时为空
   cv::Mat quantized_angle;
 
-  float magnitude_threshold;
+  float magnitude_threshold;     // 幅值归一化到 [0, 100] 后的阈值
+  float raw_magnitude_threshold; // 对应的未归一化阈值, 与 magnitude 比较
   int count_kernel_size;
   size_t num_features;
+  int num_orientations;
+  ThreadPool *pool;
 };
 
 
+/// @brief 在 kernel_size x kernel_size 邻域 (超出图像的部分不计) 内对量化
+/// 方向投票: 幅值超过阈值且邻域内超过 kernel_size^2 / 2 个像素方向一致的
+/// 像素保留该方向, 其余为 0
+/// @param magnitude 梯度幅值 (CV_32F)
+/// @param labels 逐像素的标签 [0, QUANTIZE_BASE) (CV_8U)
+/// @param quantized_angle 输出的量化方向图像, 以位表示方向, 16 个方向为
+/// CV_16U, 8 个方向为 CV_8U
+/// @param kernel_size 邻域边长, 奇数
+/// @param num_orientations 量化方向数, 8 或 16
+/// @param pool 线程池, 为空时串行执行
+void quantizeAngle(const cv::Mat &magnitude, const cv::Mat &labels,
+                   cv::Mat &quantized_angle, float threshold, int kernel_size,
+                   int num_orientations = QUANTIZE_BASE,
+                   ThreadPool *pool = nullptr);
+
+/// Response maps
+
+/// @brief 在 T x T 邻域内扩散量化方向: dst(r, c) 为 src 中以 (r, c) 为中心的
+/// 邻域内所有量化方向的按位或
+/// @param src 量化方向图像, 16 个方向为 CV_16U, 8 个方向为 CV_8U
+/// @param dst 扩散后的量化方向图像
+/// @param T 扩散邻域的边长
+void spread(const cv::Mat &src, cv::Mat &dst, int T);
+
+/// @brief 由扩散后的量化方向图像计算每个方向的 8 位响应图
+/// @param src 扩散后的量化方向图像, 方向数由类型决定
+/// @param response_maps 每个方向一个 CV_8U 响应图
+void computeResponseMaps(const cv::Mat &src, std::vector<cv::Mat> &response_maps);
+
 /// Match and Detector
 
 struct Match {
@@ -164,83 +254,487 @@ struct Match {
   }
 };
 
+/// @brief 线性存储器: block_size x block_size 个线性化的响应图 S_{ori}(c) 连续
+/// 存放在同一块 64 字节对齐的内存中, 每个线性存储器占一行, 行步长按 64 字节填充
 class LinearMemory {
 public:
+  static const int ALIGNMENT = 64;
+
   int block_size;
-  int rows;
-  int cols;
+  int rows; // 分块后的行数
+  int cols; // 分块后的列数
 
-  LinearMemory(int _block_size)
-    : block_size(_block_size) { 
-    memories = std::vector<std::vector<ushort>>(block_size * block_size, std::vector<ushort>());
-  }
+  LinearMemory(int _block_size = 4)
+    : block_size(_block_size), rows(0), cols(0), mem_type(CV_8U), step(0),
+      data(nullptr) {}
 
-  size_t linear_size() { return memories[0].size(); }
+  /// @brief 分配 block_size^2 个长度为 _rows * _cols 的线性存储器,
+  /// 与 cv::Mat::create 相同, 不对有效数据作初始化
+  /// @param _type 元素类型, 响应图为 CV_8U, 相似度为 CV_16S
+  void create(int _rows, int _cols, int _type = CV_8U);
 
-  void create(size_t size, ushort value = 0) {
-    for (int i = 0; i < (int)memories.size(); i++) 
-      memories[i] = std::vector<ushort>(size, value);
-  }
+  /// @brief 将全部线性存储器置零
+  void setZero();
 
-  /// @brief memories[i][j] -> linearized Mat S_{orientaion}(c)
+  int type() const { return mem_type; }
+
+  bool empty() const { return data == nullptr; }
+
+  size_t linear_size() const { return static_cast<size_t>(rows) * cols; }
+
+  /// @brief 相邻线性存储器之间的距离 (字节)
+  size_t step1() const { return step; }
+
+  /// @brief 第 i 个线性存储器的起始地址
   /// @param i -> order in TxT kernel
-  /// @param j -> index in linear vector
-  /// @return &memories[i][j]
-  ushort &at(size_t i, size_t j) {
-    static ushort default_value = 0; // 静态的默认值
-    if (i < 0 || i >= memories.size())
-      return default_value;
-    if (j < 0 || j >= memories[0].size())
-      return default_value;
-    return memories[i][j];
+  template <typename _Tp> _Tp *ptr(int i) {
+    return reinterpret_cast<_Tp *>(data + i * step);
+  }
+  template <typename _Tp> const _Tp *ptr(int i) const {
+    return reinterpret_cast<const _Tp *>(data + i * step);
   }
+  uchar *ptr(int i) { return data + i * step; }
+  const uchar *ptr(int i) const { return data + i * step; }
 
-  ushort &linear_at(int r, int c) {
-    size_t i = (r % block_size) * block_size + (c % block_size);
-    size_t j = (r / block_size) * cols + (c / block_size);
-    return at(i, j);
+  /// @brief 按原图像坐标 (r, c) 访问线性化后的元素, 不作越界检查
+  template <typename _Tp> _Tp &linear_at(int r, int c) {
+    return ptr<_Tp>((r % block_size) * block_size + (c % block_size))
+        [(r / block_size) * cols + (c / block_size)];
+  }
+  template <typename _Tp> const _Tp &linear_at(int r, int c) const {
+    return ptr<_Tp>((r % block_size) * block_size + (c % block_size))
+        [(r / block_size) * cols + (c / block_size)];
   }
-  
-  void linearize(cv::Mat &src);
 
-  void unlinearize(cv::Mat &dst);
+  /// @brief 将 CV_8U 响应图线性化, 尺寸不是 block_size 的整数倍时以边界像素补齐
+  void linearize(const cv::Mat &src);
+
+  /// @brief 还原为 (rows * block_size) x (cols * block_size) 的图像
+  void unlinearize(cv::Mat &dst) const;
 
   void read(cv::FileNode &fn);
   void write(cv::FileStorage &fs) const;
 
 private:
-  std::vector<std::vector<ushort>> memories;
+  int mem_type;
+  size_t step;     // 行步长 (字节), ALIGNMENT 的整数倍
+  uchar *data;     // 按 ALIGNMENT 对齐的首地址
+  cv::Mat buffer;  // 底层内存, 拷贝时共享引用计数
 };
 
-class Detector {
+/// @brief 源图像的响应图金字塔. 最高层线性化后用于全图搜索, 其余各层保留按行
+/// 存储的 8 位响应图, 供候选点在窗口内局部精化
+struct ResponsePyramid {
+  std::vector<LinearMemory> linear_memories;        // 最高层, 每个方向一个
+  std::vector<std::vector<cv::Mat> > response_maps; // [level][ori], 最高层为空
+  std::vector<cv::Size> sizes;                      // 各层图像尺寸
+  cv::Mat magnitude, angle;  // 第 0 层的梯度幅值 (平方) 与方向, 用于位姿精化
+  float magnitude_threshold; // 第 0 层的幅值阈值
+  cv::Point offset;          // 只处理部分区域时, 该区域在源图像中的左上角
+
+  ResponsePyramid() : magnitude_threshold(0) {}
+
+  /// @brief 量化方向数
+  int orientations() const {
+    if (!linear_memories.empty())
+      return static_cast<int>(linear_memories.size());
+    return response_maps.empty() ? 0 : static_cast<int>(response_maps[0].size());
+  }
+
+  /// @brief 第 0 层在源图像中覆盖的区域
+  cv::Rect region() const {
+    return sizes.empty() ? cv::Rect() : cv::Rect(offset, sizes[0]);
+  }
+
+  int levels() const { return static_cast<int>(sizes.size()); }
+};
+
+/// @brief 源图像响应图金字塔的 LRU 缓存, 以帧键索引. 同一帧只需预处理一次,
+/// 之后任意多个类别、上下文或线程都可以共享缓存的金字塔. 线程安全
+class ResponseCache {
+public:
+  /// @param capacity 最多缓存的帧数
+  explicit ResponseCache(size_t capacity = 4);
+
+  /// @brief 取出帧键对应的金字塔并标记为最近使用, 未命中时返回空指针
+  cv::Ptr<const ResponsePyramid> get(const cv::String &frame_key);
+
+  /// @brief 加入或替换帧键对应的金字塔, 超出容量时淘汰最久未使用的帧
+  void put(const cv::String &frame_key,
+           const cv::Ptr<const ResponsePyramid> &pyramid);
+
+  void erase(const cv::String &frame_key);
+
+  void clear();
+
+  size_t size() const;
+
+  size_t capacity() const { return max_entries; }
+
+private:
+  typedef std::list<std::pair<cv::String, cv::Ptr<const ResponsePyramid> > >
+      EntryList;
+
+  mutable std::mutex mutex;
+  size_t max_entries;
+  EntryList entries; // 按最近使用排序, 表头最新
+  std::map<cv::String, EntryList::iterator> index;
+};
+
+/// @brief 计算模板在线性存储器每个位置的相似度, 8 位响应累加到 16 位有符号
+/// 饱和累加器中, 支持任意特征数. 方向数与分块边长的每种组合各有一份编译期
+/// 展开的实现, 按参数选用
+/// @param response_map num_orientations 个线性化的 8 位响应图
+/// @param templ 模板
+/// @param similarity 以 CV_16S 线性存储的相似度, 与 response_map 同尺寸,
+/// 分块边长须与 response_map 相同, 为 4 或 8
+/// @param num_orientations 量化方向数, 8 或 16
+void computeSimilarity(const LinearMemory *response_map,
+                       const TemplateView &templ, LinearMemory &similarity,
+                       int num_orientations = QUANTIZE_BASE);
+
+/// Non-maximum suppression
+
+/// @brief 旋转矩形的交并比
+float rotatedIoU(const cv::RotatedRect &a, const cv::RotatedRect &b);
+
+/// @brief 基于旋转矩形 IoU 的非极大值抑制. 按得分从高到低保留与已保留矩形
+/// IoU 均不超过阈值的矩形, 已保留的矩形登记在均匀网格中, 只与相邻网格内的
+/// 矩形比较
+/// @param boxes 旋转矩形
+/// @param scores 得分, 相等时下标小者优先
+/// @param iou_threshold IoU 阈值
+/// @param top_k 最多保留的个数, 不大于 0 时不限
+/// @param indices 保留的下标, 按得分从高到低排列
+void nmsRotatedBoxes(const std::vector<cv::RotatedRect> &boxes,
+                     const std::vector<float> &scores, float iou_threshold,
+                     int top_k, std::vector<int> &indices);
+
+/// @brief 搜索掩码中各连通域的外接矩形, 可作为 Detector 的搜索区域
+void maskRegions(const cv::Mat &search_mask, std::vector<cv::Rect> &rois);
+
+class TemplateLibrary;
+
+/// @brief 按需生成的旋转缩放模板. 只保存各层未旋转的原始模板与每个
+/// template_id 的位姿, 各层模板在首次访问时生成并缓存, 此后不再改变.
+/// 可被多个线程同时访问, 同一模板被同时生成时只保留一个
+class LazyTemplates {
 public:
-  void addSource(cv::Mat &src, cv::Mat mask = cv::Mat(), const cv::String &memory_name = "default");
+  /// @param origins 各层未旋转的原始模板
+  /// @param poses 每个 template_id 的 (scale, angle)
+  LazyTemplates(const std::vector<ShapeTemplate> &origins,
+                const std::vector<cv::Point2f> &poses);
 
-  void addTemplate(cv::Mat &object, cv::Mat object_mask = cv::Mat(), const Search &search = Search(), const cv::String &templ_name = "default");
+  ~LazyTemplates();
 
-  void addSearch(Range scale, Range angle, const cv::String &search_name = "default");
+  LazyTemplates(const LazyTemplates &) = delete;
+  LazyTemplates &operator=(const LazyTemplates &) = delete;
 
-  void match(cv::Mat &src, cv::Mat &object, 
-             float score_threshold,
-             const Search &search = Search(),
-             cv::Mat src_mask = cv::Mat(), 
-             cv::Mat object_mask = cv::Mat());
+  int levels() const { return static_cast<int>(origins.size()); }
 
-  void matchClass(const cv::String &match_name, 
-                  const cv::String &search_name, float score_threshold);
+  int size() const { return static_cast<int>(poses.size()); }
 
-  void detectBestMatch(std::vector<cv::Vec6f> &points, std::vector<cv::RotatedRect> &boxs , const cv::String &match_name = "default");
+  const ShapeTemplate &get(int level, int template_id) const;
+
+  /// @brief 已生成的模板个数
+  int materialized() const;
 
 private:
+  std::vector<ShapeTemplate> origins;
+  std::vector<cv::Point2f> poses;
+  std::unique_ptr<std::atomic<ShapeTemplate *>[]> slots; // [level * size() + id]
+};
+
+/// @brief 同一名称下的一组模板, 每层 size() 个. 模板来自模板库时全部生成,
+/// 在线训练时由 lazy 按需生成. 视图指向的特征由 library 或 lazy 持有, 拷贝时共享.
+///
+/// 位姿按最细步长排成 num_scales x num_angles 的网格,
+/// template_id = scale_index * num_angles + angle_index. 第 l 层只在步长为
+/// angle_stride[l] x scale_stride[l] 的子网格上搜索, 步长由该层模板半径决定
+/// (旋转一个步长, 最远的特征移动约 1 像素), 逐层减小, 最底层为 1
+struct TemplateClass {
   int pyramid_level;
+  int num_templates;
+  Search search;
+  std::vector<TemplateView> templates; // [level * size() + template_id]
+  cv::Ptr<TemplateLibrary> library;    // 映射的模板库文件
+  cv::Ptr<LazyTemplates> lazy;         // 或者按需生成的模板, 此时 templates 为空
+
+  int num_angles;
+  int num_scales;
+  bool angle_wraps;              // 角度范围覆盖整个圆周, 索引循环
+  std::vector<int> angle_stride; // 每层的角度步长, 以最细步长为单位
+  std::vector<int> scale_stride; // 每层的缩放步长, 以最细步长为单位
+  std::vector<int> top_templates; // 最高层全图搜索的 template_id
+  float extent; // 第 0 层任意位姿的模板特征到原点的最大距离
+
+  TemplateClass()
+    : pyramid_level(0), num_templates(0), num_angles(0), num_scales(0),
+      angle_wraps(false), extent(0) {}
+
+  /// @brief 每层的模板个数
+  int size() const { return num_templates; }
+
+  /// @brief 第 level 层的第 template_id 个模板, 按需生成时可能在此生成
+  TemplateView at(int level, int template_id) const;
+
+  /// @brief 生成并列出全部模板, 按 [level * size() + template_id] 排列
+  void views(std::vector<TemplateView> &all) const;
+
+  /// @brief 由搜索范围与各层模板半径确定位姿网格及每层步长, 并生成最高层
+  /// 需要的模板. 模板个数与搜索范围不符时退化为每层逐个搜索
+  void initPoseSearch();
+
+  /// @brief 第 level 层在上一层候选位姿 template_id 附近需要比较的位姿,
+  /// 覆盖上一层步长的一半, 包含 template_id 本身. level 须低于最高层
+  void neighborPoses(int level, int template_id, std::vector<int> &ids) const;
+};
+
+/// @brief 训练得到的模板集合. 构建完成后以 cv::Ptr<const TemplateSet> 交给
+/// Detector, 此后只读, 多个线程可以共享同一集合而无需加锁或复制模板
+class TemplateSet {
+public:
+  /// @param pyramid_level 金字塔层数, 不大于 0 时由第一个模板的尺寸决定
+  explicit TemplateSet(int pyramid_level = 0);
+
+  int pyramidLevel() const { return pyramid_level; }
+
+  /// @brief 提取模板并按搜索范围生成旋转缩放后的各层模板, 同名的类别被替换
+  void addTemplate(const cv::Mat &object, const cv::Mat &object_mask = cv::Mat(),
+                   const Search &search = Search(),
+                   const cv::String &class_name = "default");
+
+  /// @brief 将全部模板及其搜索范围写入二进制模板库文件
+  void save(const cv::String &path) const;
+
+  /// @brief 映射二进制模板库文件, 其中的模板按原名称加入, 同名的类别被替换.
+  /// 特征直接在映射的内存中使用, 不作解析与拷贝
+  void load(const cv::String &path);
+
+  bool contains(const cv::String &class_name) const {
+    return classes.count(class_name) != 0;
+  }
+
+  /// @brief 按名称查找类别, 不存在时抛出 cv::Exception
+  const TemplateClass &at(const cv::String &class_name) const;
+
+  std::vector<cv::String> classNames() const;
+
+private:
+  int pyramid_level;
+  std::map<cv::String, TemplateClass> classes;
+};
+
+/// @brief 一次匹配请求的状态: 源图像的响应图金字塔, 各类别的匹配结果以及
+/// 相似度缓冲区. 每个线程使用各自的上下文, 可在多帧之间复用以避免重新分配内存
+class MatchContext {
+public:
+  /// @brief 清除源图像与匹配结果, 保留缓冲区
+  void clear() {
+    sources.clear();
+    search_rois.clear();
+    matches_map.clear();
+  }
+
+  bool hasSource() const { return !sources.empty(); }
+
+  /// @brief 类别 class_name 的全部匹配, 未匹配过时为空
+  const std::vector<Match> &matches(const cv::String &class_name) const;
+
+  /// @brief 设置统计, 之后 Detector 在该上下文上的调用 (含线程池中的任务)
+  /// 都计入其中. 为空时不统计, 每个统计点的开销只有一次判断
+  void setProfile(const cv::Ptr<Profile> &_profile) { profile_ = _profile; }
+
+  const cv::Ptr<Profile> &profile() const { return profile_; }
+
+private:
+  friend class Detector;
+
+  // 整幅图像的一个金字塔 (可能与 ResponseCache 共享), 或各搜索区域的金字塔
+  std::vector<cv::Ptr<const ResponsePyramid> > sources;
+  std::vector<cv::Rect> search_rois; // 匹配位置须位于其中之一, 为空时不限
+  std::map<cv::String, std::vector<Match> > matches_map;
+  std::vector<LinearMemory> similarities; // 按 worker_id 分配
+  cv::Ptr<Profile> profile_;
+};
+
+/// @brief 匹配器. 只持有只读的模板集合与线程池, 全部匹配方法为 const, 状态
+/// 保存在调用者提供的 MatchContext 中, 因而多个线程可以同时使用同一 Detector.
+/// 线程池被占用时, 后到的调用在自身线程内串行完成而不等待
+class Detector {
+public:
+  /// @param templates 模板集合
+  /// @param num_threads 预处理与模板匹配使用的线程数, 不大于 0 时取硬件
+  /// 并发数
+  /// @param num_orientations 源图像的量化方向数. 16 个方向用于精确定位,
+  /// 8 个方向的预处理量减半, 适合粗定位
+  /// @param block_size 最高层线性存储器的分块边长, 4 或 8
+  explicit Detector(const cv::Ptr<const TemplateSet> &templates,
+                    int num_threads = 0, int num_orientations = QUANTIZE_BASE,
+                    int block_size = 4);
+
+  int orientations() const { return num_orientations; }
+
+  int blockSize() const { return block_size; }
+
+  const TemplateSet &templateSet() const { return *templates; }
+
+  /// @brief 计算源图像的响应图金字塔, 替换上下文中原有的源图像与匹配结果
+  void addSource(MatchContext &context, const cv::Mat &src,
+                 const cv::Mat &mask = cv::Mat()) const;
+
+  /// @brief 同上, 但先以帧键 frame_key 查找缓存, 未命中时计算并加入缓存.
+  /// 同一帧在多个上下文或线程中只预处理一次
+  void addSource(MatchContext &context, const cv::Mat &src,
+                 const cv::Mat &mask, const cv::String &frame_key,
+                 ResponseCache &cache) const;
+
+  /// @brief 只在搜索区域附近计算响应图. 各区域按模板尺寸向外扩展并合并
+  /// 相交的区域后分别预处理, 计算量与区域面积成正比. 之后的匹配只保留
+  /// 位置 (模板中心) 落在某个搜索区域内的结果
+  /// @param search_rois 模板中心可能出现的区域, 可由 maskRegions 从掩码得到
+  void addSource(MatchContext &context, const cv::Mat &src,
+                 const std::vector<cv::Rect> &search_rois,
+                 const cv::Mat &mask = cv::Mat()) const;
+
+  /// @brief 在上下文的源图像中匹配一类模板, 结果存入上下文
+  void matchClass(MatchContext &context, const cv::String &class_name,
+                  float score_threshold) const;
+
+  /// @brief 在同一源图像中匹配多类模板, 所有类别的模板在同一次并行调度中计算,
+  /// 各类的结果分别存入上下文
+  void matchClasses(MatchContext &context,
+                    const std::vector<cv::String> &class_names,
+                    float score_threshold) const;
+
+  /// @brief addSource 与 matchClass 的组合
+  void match(MatchContext &context, const cv::Mat &src, float score_threshold,
+             const cv::String &class_name = "default",
+             const cv::Mat &src_mask = cv::Mat()) const;
+
+  /// @brief 只在搜索区域内匹配的 addSource 与 matchClass 的组合
+  void match(MatchContext &context, const cv::Mat &src, float score_threshold,
+             const std::vector<cv::Rect> &search_rois,
+             const cv::String &class_name = "default",
+             const cv::Mat &src_mask = cv::Mat()) const;
+
+  /// @brief 输出抑制重复后的匹配结果, 每个物体一个位姿
+  /// @param points (x, y, scale, angle, similarity, template_id)
+  /// @param boxs 匹配位置处的模板选框, 与 points 一一对应
+  /// @param iou_threshold 选框 IoU 超过该值的匹配视为同一物体
+  /// @param max_instances 最多输出的物体个数, 不大于 0 时不限
+  void detectBestMatch(const MatchContext &context,
+                       std::vector<cv::Vec6f> &points,
+                       std::vector<cv::RotatedRect> &boxs,
+                       const cv::String &class_name = "default",
+                       float iou_threshold = 0.5f, int max_instances = 0) const;
+
+  /// @brief 在第 0 层以 Gauss-Newton 法连续优化 detectBestMatch 输出的位姿:
+  /// 模板特征点沿梯度方向在源图像中寻找亚像素边缘, 最小化点到边缘切线的
+  /// 距离, 同时求解平移、旋转与缩放. 精化后偏离原位姿超过一个搜索步长或
+  /// 对应点不足时保留原位姿
+  /// @param points detectBestMatch 的输出, 原位更新 x, y, scale, angle,
+  /// 其中 x, y 为模板坐标原点在源图像中的亚像素位置
+  /// @param boxs 与 points 一一对应, 原位更新
+  /// @param max_iterations 最大迭代次数
+  void refineMatches(const MatchContext &context,
+                     std::vector<cv::Vec6f> &points,
+                     std::vector<cv::RotatedRect> &boxs,
+                     const cv::String &class_name = "default",
+                     int max_iterations = 10) const;
+
+  /// @brief 以流水线方式匹配一组帧. 预处理 (梯度与响应图)、相似度计算、
+  /// 抑制与精化三个阶段分别在不同线程上运行, 不同的帧同时处于不同阶段,
+  /// 吞吐量接近最慢阶段的单帧耗时. 相似度与精化轮流使用线程池, 各自以全部
+  /// 线程并行; 预处理在自身线程内串行执行, 与相似度阶段重叠
+  /// @param next_frame 在预处理线程中调用, 取得下一帧, 返回 false 表示结束
+  /// @param on_result 在调用线程中按帧的顺序调用, 参数为帧序号与
+  /// detectBestMatch 的输出
+  /// @param max_in_flight 同时处于流水线中的最大帧数, 包括各阶段正在处理
+  /// 的帧. 为 1 时各帧依次处理, 不同阶段不再重叠
+  /// @param refine 是否对结果调用 refineMatches
+  void matchBatch(const std::function<bool(cv::Mat &)> &next_frame,
+                  const std::function<void(int, const std::vector<cv::Vec6f> &,
+                                           const std::vector<cv::RotatedRect> &)> &on_result,
+                  float score_threshold, const cv::String &class_name = "default",
+                  int max_in_flight = 4, bool refine = false) const;
+
+  /// @brief 同上, 对 frames 依次匹配, 结果按帧存入 points 与 boxs
+  void matchBatch(const std::vector<cv::Mat> &frames, float score_threshold,
+                  std::vector<std::vector<cv::Vec6f> > &points,
+                  std::vector<std::vector<cv::RotatedRect> > &boxs,
+                  const cv::String &class_name = "default",
+                  bool refine = false) const;
+
+  /// @brief 跟踪用的局部匹配: 只在第 0 层计算各种子附近的响应图, 对种子位姿
+  /// 相邻 angle_radius 个角度步长、scale_radius 个缩放步长内的位姿, 在以种子
+  /// 位置为中心的窗口内逐一计分. 上下文中保存各局部区域, 可接着调用
+  /// refineMatches
+  /// @param seeds 预测的位姿, 格式与 detectBestMatch 的输出相同
+  /// @param points 与 seeds 一一对应, 相似度低于 score_threshold 时为 0
+  void matchLocal(MatchContext &context, const cv::Mat &src,
+                  const std::vector<cv::Vec6f> &seeds, float score_threshold,
+                  std::vector<cv::Vec6f> &points,
+                  std::vector<cv::RotatedRect> &boxs,
+                  const cv::String &class_name = "default",
+                  int angle_radius = 2, int scale_radius = 1) const;
+
+private:
+  /// @param preprocess_pool 方向投票使用的线程池, 为空时串行执行
+  cv::Ptr<const ResponsePyramid> computeSource(const cv::Mat &src,
+                                               const cv::Mat &mask,
+                                               cv::Point offset,
+                                               ThreadPool *preprocess_pool) const;
+
+  int num_orientations;
   int block_size;
-  cv::Ptr<ColorGradientPyramid> modality;
+  cv::Ptr<const TemplateSet> templates;
+  cv::Ptr<ThreadPool> pool;
+};
+/// @brief 视频流中的跟踪. 以上一帧的位姿与速度预测当前帧的位姿, 只做局部
+/// 搜索; 有目标跟丢或尚无目标时回退到全图搜索. 每个 Tracker 持有自己的
+/// MatchContext, 多路视频可共享同一 Detector
+class Tracker {
+public:
+  /// @param max_instances 跟踪的目标个数, 全图搜索时的 detectBestMatch 参数
+  Tracker(const Detector &detector, const cv::String &class_name = "default",
+          float score_threshold = 80.0f, int max_instances = 1);
+
+  /// @brief 处理一帧, 输出格式与 detectBestMatch 相同
+  void update(const cv::Mat &frame, std::vector<cv::Vec6f> &points,
+              std::vector<cv::RotatedRect> &boxs);
+
+  /// @brief 丢弃全部目标, 下一帧做全图搜索
+  void reset() { tracks.clear(); }
 
-  std::map<cv::String, std::vector<cv::Ptr<ShapeTemplate> > > templates_map;
-  std::map<cv::String, std::vector<LinearMemory> > memories_map;
-  std::map<cv::String, Search> searches_map;
-  std::map<cv::String, std::vector<Match> >  matches_map;
+  bool tracking() const { return !tracks.empty(); }
+
+  /// @brief 上一帧是否做了全图搜索
+  bool searchedGlobally() const { return global_search; }
+
+  int angle_radius; // 局部搜索的角度范围, 以最细角度步长为单位
+  int scale_radius; // 局部搜索的缩放范围, 以最细缩放步长为单位
+  bool refine;      // 是否对结果调用 refineMatches
+
+private:
+  struct Track {
+    cv::Vec6f pose;         // 上一帧的位姿
+    cv::Point2f velocity;   // 每帧的平移
+    float angle_velocity;   // 每帧的角度变化, 以最细角度步长为单位
+  };
+
+  void searchGlobally(const cv::Mat &frame, std::vector<cv::Vec6f> &points,
+                      std::vector<cv::RotatedRect> &boxs);
+
+  const Detector &detector;
+  cv::String class_name;
+  float score_threshold;
+  int max_instances;
+  bool global_search;
+  MatchContext context;
+  std::vector<Track> tracks;
 };
+
 } // namespace line2Dup
 
 #endif // LINE2D_UP_HPP
\ No newline at end of file
@@ -1,6 +1,14 @@
+#include "kernels.hpp"
 #include "line2dup.hpp"
+#include "scatteredSelection.hpp"
+#include "templateLibrary.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <fstream>
 using namespace std;
 using namespace cv;
+using namespace line2Dup;
 
 void MIPP_test() {
   cout << "MIPP tests" << endl;
@@ -26,6 +34,264 @@ void MIPP_test() {
   cout << "----------" << endl << endl;
 }
 
+/// @brief spread 的标量参考实现
+static void spreadNaive(const Mat &src, Mat &dst, int T) {
+  dst = Mat::zeros(src.size(), CV_16U);
+  for (int r = 0; r < src.rows; r++) {
+    for (int c = 0; c < src.cols; c++) {
+      ushort &value = dst.at<ushort>(r, c);
+      for (int dy = -(T / 2); dy < T - T / 2; dy++) {
+        for (int dx = -(T / 2); dx < T - T / 2; dx++) {
+          int u = r + dy, v = c + dx;
+          if (u < 0 || v < 0 || u >= src.rows || v >= src.cols)
+            continue;
+          value |= src.at<ushort>(u, v);
+        }
+      }
+    }
+  }
+}
+
+void SPREAD_test() {
+  cout << "spread tests" << endl;
+  cout << "------------" << endl << endl;
+
+  RNG rng(0x2023);
+  int failures = 0;
+  for (int t = 0; t < 200; t++) {
+    int rows = rng.uniform(1, 96);
+    int cols = rng.uniform(1, 96);
+    int T = rng.uniform(1, 9);
+
+    // 模拟量化方向: 每个像素至多一个方向位
+    Mat quantized(rows, cols, CV_16U);
+    for (int r = 0; r < rows; r++)
+      for (int c = 0; c < cols; c++)
+        quantized.at<ushort>(r, c) =
+            rng.uniform(0, 3) ? 0 : (1 << rng.uniform(0, 16));
+
+    // 取子矩阵以覆盖非对齐及非连续内存的情形
+    Mat roi = quantized;
+    if (cols > 1 && rows > 1)
+      roi = quantized(Rect(1, 1, cols - 1, rows - 1));
+
+    Mat expected, actual;
+    spreadNaive(roi, expected, T);
+    line2Dup::spread(roi, actual, T);
+
+    if (countNonZero(expected != actual) > 0) {
+      cerr << "spread mismatch: " << roi.cols << "x" << roi.rows
+           << ", T = " << T << endl;
+      failures++;
+    }
+  }
+  cout << (failures ? "FAILED" : "passed") << " (" << failures
+       << " failures)" << endl;
+  cout << "------------" << endl << endl;
+}
+
+/// @brief quantizeAngle 的参考实现: 逐像素统计 K x K 邻域内的票数
+static void quantizeAngleNaive(const Mat &magnitude, const Mat &labels,
+                               Mat &dst, float threshold, int K, int bins) {
+  dst = Mat::zeros(labels.size(), CV_16U);
+  for (int r = 0; r < labels.rows; r++) {
+    for (int c = 0; c < labels.cols; c++) {
+      if (magnitude.at<float>(r, c) <= threshold)
+        continue;
+      int votes[16] = {0};
+      for (int dy = -(K / 2); dy <= K / 2; dy++) {
+        for (int dx = -(K / 2); dx <= K / 2; dx++) {
+          int u = r + dy, v = c + dx;
+          if (u < 0 || v < 0 || u >= labels.rows || v >= labels.cols)
+            continue;
+          votes[labels.at<uchar>(u, v) / (QUANTIZE_BASE / bins)]++;
+        }
+      }
+      for (int b = 0; b < bins; b++)
+        if (votes[b] >= K * K / 2 + 1)
+          dst.at<ushort>(r, c) = static_cast<ushort>(1 << b);
+    }
+  }
+}
+
+void QUANTIZE_test() {
+  cout << "quantize tests" << endl;
+  cout << "--------------" << endl << endl;
+
+  RNG rng(0x2023);
+  ThreadPool pool(4);
+  int failures = 0;
+  for (int t = 0; t < 120; t++) {
+    // 包含比邻域还小的图像, 以及在线程池中分为多块的图像
+    const int rows = rng.uniform(1, 90), cols = rng.uniform(1, 90);
+    const int K = 3 + 2 * (t % 3), bins = t % 2 ? 8 : 16;
+
+    // 标签按 8 x 8 的块取值, 四分之一的像素为随机噪声
+    Mat labels(rows, cols, CV_8U), magnitude(rows, cols, CV_32F);
+    for (int r = 0; r < rows; r++)
+      for (int c = 0; c < cols; c++)
+        labels.at<uchar>(r, c) = static_cast<uchar>(
+            rng.uniform(0, 4) ? (r / 8 * 5 + c / 8) % 16 : rng.uniform(0, 16));
+    rng.fill(magnitude, RNG::UNIFORM, 0.0f, 100.0f);
+
+    Mat expected, serial, parallel;
+    quantizeAngleNaive(magnitude, labels, expected, 30.0f, K, bins);
+    quantizeAngle(magnitude, labels, serial, 30.0f, K, bins);
+    quantizeAngle(magnitude, labels, parallel, 30.0f, K, bins, &pool);
+    failures += serial.type() != (bins == 16 ? CV_16U : CV_8U);
+    serial.convertTo(serial, CV_16U);
+    parallel.convertTo(parallel, CV_16U);
+    if (countNonZero(expected != serial) > 0 ||
+        countNonZero(expected != parallel) > 0) {
+      cerr << "quantize mismatch: " << cols << "x" << rows << ", K = " << K
+           << ", " << bins << " bins" << endl;
+      failures++;
+    }
+  }
+  cout << (failures ? "FAILED" : "passed") << " (" << failures
+       << " failures)" << endl;
+  cout << "--------------" << endl << endl;
+}
+
+// 逐对比较的参照实现: 在距离 distance 下从头贪心选择
+static vector<Point> selectScatteredNaive(const vector<Point> &candidates,
+                                          size_t num_features, float distance) {
+  vector<Point> features;
+  const float distance_sq = distance * distance;
+  for (size_t i = 0; i < candidates.size() && features.size() < num_features; i++) {
+    bool keep = true;
+    for (size_t j = 0; j < features.size() && keep; j++) {
+      const float dx = static_cast<float>(candidates[i].x - features[j].x);
+      const float dy = static_cast<float>(candidates[i].y - features[j].y);
+      keep = dx * dx + dy * dy >= distance_sq;
+    }
+    if (keep)
+      features.push_back(candidates[i]);
+  }
+  return features;
+}
+
+void SCATTERED_test() {
+  cout << "scattered selection tests" << endl;
+  cout << "-------------------------" << endl << endl;
+
+  RNG rng(0x1505);
+  int failures = 0;
+  for (int t = 0; t < 300; t++) {
+    // 一半为区域内的随机点, 一半为沿轮廓分布的点, 坐标互不相同
+    const int width = rng.uniform(4, 200), height = rng.uniform(4, 200);
+    Mat used = Mat::zeros(height, width, CV_8U);
+    vector<Point> candidates;
+    const int count = rng.uniform(1, min(width * height, 600) + 1);
+    if (t % 2) {
+      while (static_cast<int>(candidates.size()) < count) {
+        const Point p(rng.uniform(0, width), rng.uniform(0, height));
+        if (!used.at<uchar>(p)) {
+          used.at<uchar>(p) = 1;
+          candidates.push_back(p);
+        }
+      }
+    } else {
+      ellipse(used, Point(width / 2, height / 2), Size(width / 3, height / 3),
+              rng.uniform(0.0, 180.0), 0, 360, Scalar(1));
+      for (int r = 0; r < height; r++)
+        for (int c = 0; c < width; c++)
+          if (used.at<uchar>(r, c))
+            candidates.push_back(Point(c, r));
+      for (size_t i = candidates.size(); i > 1; i--)
+        swap(candidates[i - 1], candidates[rng.uniform(0, static_cast<int>(i))]);
+      if (candidates.empty())
+        continue;
+    }
+
+    const size_t num_features = rng.uniform(1, static_cast<int>(candidates.size()) + 1);
+    const float start = t % 3 ? static_cast<float>(candidates.size() / num_features + 1)
+                              : rng.uniform(0.5f, 40.0f);
+    vector<Point> features;
+    const float distance = selectScatteredFeatures(candidates, features,
+                                                   num_features, start);
+
+    // 与参照实现在同一距离下的结果一致, 且各特征两两之间不小于该距离
+    const vector<Point> expected = selectScatteredNaive(candidates, num_features, distance);
+    bool ok = features == expected && features.size() == num_features &&
+              distance <= max(start, 1.0f);
+    for (size_t i = 0; i < features.size() && ok; i++)
+      for (size_t j = i + 1; j < features.size() && ok; j++) {
+        const Point d = features[i] - features[j];
+        ok = static_cast<float>(d.dot(d)) >= distance * distance;
+      }
+    if (!ok) {
+      cerr << "scattered selection mismatch: " << candidates.size()
+           << " candidates, " << num_features << " features, distance "
+           << distance << endl;
+      failures++;
+    }
+  }
+  cout << (failures ? "FAILED" : "passed") << " (" << failures
+       << " failures)" << endl;
+  cout << "-------------------------" << endl << endl;
+}
+
+void THREADPOOL_test() {
+  cout << "thread pool tests" << endl;
+  cout << "-----------------" << endl << endl;
+
+  int failures = 0;
+  vector<int> reference;
+  for (int num_threads = 1; num_threads <= 8; num_threads++) {
+    ThreadPool pool(num_threads);
+    for (int round = 0; round < 20; round++) {
+      // 任务耗时不均, 迫使线程之间相互窃取
+      const int n = 1 + round * 37;
+      vector<int> hits(n, 0);
+      vector<vector<int> > outputs(n);
+      pool.parallel_for(0, n, [&](int i, int worker_id) {
+        CV_Assert(worker_id >= 0 && worker_id < pool.size());
+        hits[i]++;
+        for (int k = 0; k < (i * 7919) % 13; k++)
+          outputs[i].push_back(i * 31 + k);
+      });
+
+      vector<int> merged;
+      for (const auto &output : outputs)
+        merged.insert(merged.end(), output.begin(), output.end());
+      if (round == 19 && num_threads == 1)
+        reference = merged;
+
+      failures += count(hits.begin(), hits.end(), 1) != n;
+      failures += round == 19 && merged != reference;
+    }
+
+    bool caught = false;
+    try {
+      pool.parallel_for(0, 100, [](int i, int) {
+        if (i == 42)
+          throw runtime_error("task 42");
+      });
+    } catch (const runtime_error &) {
+      caught = true;
+    }
+    failures += !caught;
+
+    // 多个线程同时调用: 抢不到线程池的调用在自身线程内完成
+    const int n = 500;
+    vector<vector<int> > concurrent_hits(4, vector<int>(n, 0));
+    vector<thread> callers;
+    for (int t = 0; t < 4; t++)
+      callers.emplace_back([&, t] {
+        pool.parallel_for(0, n, [&](int i, int) { concurrent_hits[t][i]++; });
+      });
+    for (auto &caller : callers)
+      caller.join();
+    for (const auto &hits : concurrent_hits)
+      failures += count(hits.begin(), hits.end(), 1) != n;
+  }
+
+  cout << (failures ? "FAILED" : "passed") << " (" << failures
+       << " failures)" << endl;
+  cout << "-----------------" << endl << endl;
+}
+
 class Timer {
 public:
   Timer() : start_(0), time_(0) {}
@@ -49,16 +315,1048 @@ private:
   int64 start_, time_;
 };
 
+/// @brief computeSimilarity 的标量参考实现, 以 int 累加后饱和到 16 位
+static void computeSimilarityNaive(const LinearMemory *response_map,
+                                   const ShapeTemplate &templ, Mat &dst,
+                                   int num_orientations = QUANTIZE_BASE) {
+  const int T = response_map[0].block_size;
+  const int cols = response_map[0].cols;
+  const int length = static_cast<int>(response_map[0].linear_size());
+  dst.create(T * T, length, CV_16S);
+  for (int i = 0; i < T * T; i++) {
+    for (int j = 0; j < length; j++) {
+      int sum = 0;
+      for (const auto &point : templ.features) {
+        Point cur = Point(point.x + i % T, point.y + i / T);
+        int mod_y = cur.y % T < 0 ? (cur.y % T) + T : cur.y % T;
+        int mod_x = cur.x % T < 0 ? (cur.x % T) + T : cur.x % T;
+        int offset = ((cur.y - mod_y) / T) * cols + (cur.x - mod_x) / T;
+        if (j + offset >= 0 && j + offset < length)
+          sum += response_map[point.label / (QUANTIZE_BASE / num_orientations)]
+                     .ptr(mod_y * T + mod_x)[j + offset];
+      }
+      dst.at<short>(i, j) = saturate_cast<short>(sum);
+    }
+  }
+}
+
+/// @brief 相似度累加的正确性检查与性能测试, 各指令集分别编译运行:
+///   g++ -O3 -msse4.2    ...   (SSE4.2,  16 x int8)
+///   g++ -O3 -mavx2      ...   (AVX2,    32 x int8)
+///   g++ -O3 -mavx512bw  ...   (AVX-512, 64 x int8)
+void SIMILARITY_bench() {
+  cout << "similarity bench (" << mipp::InstructionFullType << ")" << endl;
+  cout << "----------------" << endl << endl;
+
+  const int T = 4;
+  const int rows = 480, cols = 640;
+  RNG rng(0x2023);
+
+  vector<LinearMemory> response_map(QUANTIZE_BASE, LinearMemory(T));
+  for (auto &memory : response_map) {
+    Mat response(rows, cols, CV_8U);
+    for (int r = 0; r < rows; r++)
+      for (int c = 0; c < cols; c++)
+        response.at<uchar>(r, c) = static_cast<uchar>(rng.uniform(0, 9));
+    memory.linearize(response);
+  }
+
+  const int feature_counts[] = {63, 100, 300, 1000, 5000};
+  for (int num_features : feature_counts) {
+    ShapeTemplate templ(0, 1.0f, 0.0f);
+    for (int k = 0; k < num_features; k++) {
+      Gradient point;
+      point.x = rng.uniform(-64, 64);
+      point.y = rng.uniform(-64, 64);
+      point.label = rng.uniform(0, QUANTIZE_BASE);
+      templ.features.push_back(point);
+    }
+
+    LinearMemory similarity(T);
+    Timer timer;
+    const int loops = 10;
+    timer.start();
+    for (int t = 0; t < loops; t++)
+      computeSimilarity(response_map.data(), templ, similarity);
+    timer.stop();
+    double simd_ms = timer.time() * 1000 / loops;
+
+    Mat expected;
+    timer.start();
+    computeSimilarityNaive(response_map.data(), templ, expected);
+    timer.stop();
+    double naive_ms = timer.time() * 1000;
+
+    int failures = 0;
+    for (int i = 0; i < T * T; i++)
+      for (int j = 0; j < (int)similarity.linear_size(); j++)
+        failures += similarity.ptr<short>(i)[j] != expected.at<short>(i, j);
+
+    cout << "features " << num_features << ": " << simd_ms << " ms (naive "
+         << naive_ms << " ms), " << (failures ? "FAILED" : "passed") << endl;
+  }
+  cout << "----------------" << endl << endl;
+}
+
+/// @brief nmsRotatedBoxes 的参考实现: 逐个与全部已保留矩形比较
+static void nmsNaive(const vector<RotatedRect> &boxes, const vector<float> &scores,
+                     float iou_threshold, int top_k, vector<int> &indices) {
+  vector<int> order(boxes.size());
+  for (int i = 0; i < (int)order.size(); i++)
+    order[i] = i;
+  stable_sort(order.begin(), order.end(),
+              [&](int i, int j) { return scores[i] > scores[j]; });
+  indices.clear();
+  for (int i : order) {
+    if (top_k > 0 && (int)indices.size() >= top_k)
+      break;
+    bool suppressed = false;
+    for (int k : indices)
+      suppressed |= rotatedIoU(boxes[i], boxes[k]) > iou_threshold;
+    if (!suppressed)
+      indices.push_back(i);
+  }
+}
+
+void NMS_test() {
+  cout << "rotated nms tests" << endl;
+  cout << "-----------------" << endl << endl;
+
+  int failures = 0;
+  // 两个 10 x 10 的正方形错开半个边长, IoU 为 1/3
+  failures += abs(rotatedIoU(RotatedRect(Point2f(10, 10), Size2f(10, 10), 0),
+                             RotatedRect(Point2f(15, 10), Size2f(10, 10), 0)) -
+                  1.0f / 3) > 1e-3f;
+  const RotatedRect bar(Point2f(100, 100), Size2f(80, 20), 30);
+  failures += abs(rotatedIoU(bar, bar) - 1.0f) > 1e-3f;
+  failures += rotatedIoU(bar, RotatedRect(Point2f(300, 300), Size2f(80, 20), 30)) != 0;
+
+  // 同一中心: 转过 5 度的重复框被抑制, 十字交叉的框 (IoU 1/7) 与远处的框保留
+  const vector<RotatedRect> boxes = {
+      bar, RotatedRect(Point2f(101, 99), Size2f(80, 20), 35),
+      RotatedRect(Point2f(100, 100), Size2f(80, 20), 120),
+      RotatedRect(Point2f(300, 300), Size2f(80, 20), 30)};
+  const vector<float> scores = {90, 95, 70, 60};
+  vector<int> keep;
+  nmsRotatedBoxes(boxes, scores, 0.5f, 0, keep);
+  failures += keep != vector<int>({1, 2, 3});
+  nmsRotatedBoxes(boxes, scores, 0.5f, 2, keep);
+  failures += keep != vector<int>({1, 2});
+
+  // 随机旋转矩形与参考实现一致, 得分相同时下标小者优先
+  RNG rng(0x2023);
+  for (int t = 0; t < 50; t++) {
+    vector<RotatedRect> random_boxes;
+    vector<float> random_scores;
+    for (int i = 0; i < 300; i++) {
+      random_boxes.push_back(RotatedRect(
+          Point2f(rng.uniform(0.f, 400.f), rng.uniform(0.f, 300.f)),
+          Size2f(rng.uniform(5.f, 80.f), rng.uniform(5.f, 80.f)),
+          rng.uniform(0.f, 180.f)));
+      random_scores.push_back((float)rng.uniform(0, 20));
+    }
+    const float iou_threshold = t % 2 ? 0.3f : 0.5f;
+    const int top_k = t % 3 ? 0 : 20;
+    vector<int> expected;
+    nmsNaive(random_boxes, random_scores, iou_threshold, top_k, expected);
+    nmsRotatedBoxes(random_boxes, random_scores, iou_threshold, top_k, keep);
+    failures += keep != expected;
+  }
+
+  cout << (failures ? "FAILED" : "passed") << " (" << failures
+       << " failures)" << endl;
+  cout << "-----------------" << endl << endl;
+}
+
+void ROTATEDMATCH_test() {
+  cout << "rotated match tests" << endl;
+  cout << "-------------------" << endl << endl;
+
+  const vector<Point2f> polygon = {{60, 50},  {150, 60}, {140, 100},
+                                   {110, 95}, {120, 150}, {55, 140}};
+  auto draw = [](Mat &image, const vector<Point2f> &vertices) {
+    const int shift = 4;
+    vector<Point> fixed;
+    for (const Point2f &v : vertices)
+      fixed.push_back(Point(cvRound(v.x * (1 << shift)), cvRound(v.y * (1 << shift))));
+    fillPoly(image, vector<vector<Point> >(1, fixed), Scalar::all(255), LINE_AA, shift);
+  };
+
+  Mat templateImage = Mat::zeros(200, 200, CV_8UC3);
+  draw(templateImage, polygon);
+  const RotatedRect polygon_box = minAreaRect(polygon);
+
+  // 源图像中放置两个旋转后的物体
+  const float rotations[2] = {30.0f, 135.0f};
+  const Point2f translations[2] = {Point2f(120, 100), Point2f(380, 200)};
+  Mat sourceImage = Mat::zeros(480, 640, CV_8UC3);
+  vector<Point2f> expected_centers;
+  for (int k = 0; k < 2; k++) {
+    Mat rotation = getRotationMatrix2D(Point2f(100, 100), rotations[k], 1.0);
+    rotation.at<double>(0, 2) += translations[k].x;
+    rotation.at<double>(1, 2) += translations[k].y;
+    vector<Point2f> vertices, center;
+    cv::transform(polygon, vertices, rotation);
+    cv::transform(vector<Point2f>(1, polygon_box.center), center, rotation);
+    draw(sourceImage, vertices);
+    expected_centers.push_back(center[0]);
+  }
+
+  Ptr<TemplateSet> templates = makePtr<TemplateSet>();
+  templates->addTemplate(templateImage, Mat(),
+                         Search(line2Dup::Range(1.0f, 1.0f, 0.0f),
+                                line2Dup::Range(0.0f, 359.0f, 1.0f)));
+  line2Dup::Detector detector(templates);
+
+  MatchContext context;
+  vector<Vec6f> points;
+  vector<RotatedRect> boxes;
+  detector.match(context, sourceImage, 80);
+  detector.detectBestMatch(context, points, boxes);
+
+  // 选框须落在旋转后的物体上, 模板角度与生成时的旋转角度相反
+  int failures = points.size() != 2;
+  for (int k = 0; k < 2 && points.size() == 2; k++) {
+    int nearest = 0;
+    for (int i = 1; i < (int)boxes.size(); i++)
+      if (norm(boxes[i].center - expected_centers[k]) <
+          norm(boxes[nearest].center - expected_centers[k]))
+        nearest = i;
+    const float center_error = norm(boxes[nearest].center - expected_centers[k]);
+    float angle_error = abs(points[nearest][3] - (360.0f - rotations[k]));
+    angle_error = min(angle_error, 360.0f - angle_error);
+    failures += center_error > 4.0f || angle_error > 2.0f ||
+                abs(boxes[nearest].size.area() / polygon_box.size.area() - 1) > 0.15f;
+    cout << cv::format("rotation %6.1f: box center error %.2f, angle error %.2f",
+                       rotations[k], center_error, angle_error)
+         << endl;
+  }
+
+  cout << (failures ? "FAILED" : "passed") << " (" << failures
+       << " failures)" << endl;
+  cout << "-------------------" << endl << endl;
+}
+
+void TEMPLATELIB_test() {
+  cout << "template library tests" << endl;
+  cout << "----------------------" << endl << endl;
+
+  RNG rng(0x2023);
+  const int levels = 3, num_templates = 50;
+  const String path = "line2dup_templates.bin";
+
+  // 两类随机模板, 每类 levels x num_templates 个
+  vector<vector<Ptr<ShapeTemplate> > > owned(2);
+  TemplateLibraryWriter writer;
+  for (int k = 0; k < 2; k++) {
+    vector<TemplateView> views;
+    for (int i = 0; i < levels * num_templates; i++) {
+      Ptr<ShapeTemplate> templ = makePtr<ShapeTemplate>(
+          i / num_templates, rng.uniform(0.5f, 2.0f), rng.uniform(0.f, 360.f));
+      templ->box = RotatedRect(Point2f(rng.uniform(0.f, 64.f), rng.uniform(0.f, 64.f)),
+                               Size2f(rng.uniform(1.f, 64.f), rng.uniform(1.f, 64.f)),
+                               rng.uniform(0.f, 90.f));
+      const int num_features = rng.uniform(0, 400);
+      for (int j = 0; j < num_features; j++)
+        templ->features.push_back(Gradient(rng.uniform(-64, 64), rng.uniform(-64, 64),
+                                           rng.uniform(0.f, 360.f)));
+      owned[k].push_back(templ);
+      views.push_back(TemplateView(*templ));
+    }
+    writer.addClass(cv::format("class_%d", k), levels,
+                    Search(line2Dup::Range(0.5f, 2.0f, 0.1f), line2Dup::Range(0.f, 360.f, 1.f)), views);
+  }
+  writer.write(path);
+
+  int failures = 0;
+  Timer timer;
+  timer.start();
+  Ptr<TemplateLibrary> library = TemplateLibrary::open(path);
+  timer.stop();
+  failures += library->numClasses() != 2;
+  for (int k = 0; k < library->numClasses(); k++) {
+    vector<TemplateView> views;
+    library->templates(k, views);
+    failures += library->className(k) != cv::format("class_%d", k);
+    failures += library->pyramidLevel(k) != levels;
+    failures += library->search(k).angle.step != 1.f;
+    failures += views.size() != owned[k].size();
+    for (int i = 0; i < (int)views.size() && i < (int)owned[k].size(); i++) {
+      const ShapeTemplate &expected = *owned[k][i];
+      const TemplateView &actual = views[i];
+      failures += actual.box.center != expected.box.center ||
+                  actual.box.size != expected.box.size ||
+                  actual.box.angle != expected.box.angle ||
+                  actual.scale != expected.scale ||
+                  actual.angle != expected.angle ||
+                  actual.pyramid_level != expected.pyramid_level ||
+                  actual.num_features != (int)expected.features.size();
+      for (int j = 0; j < actual.num_features &&
+                      j < (int)expected.features.size(); j++) {
+        const Gradient &a = actual.features[j], &b = expected.features[j];
+        failures += a.x != b.x || a.y != b.y || a.label != b.label ||
+                    a.angle != b.angle;
+      }
+    }
+  }
+  library.release();
+
+  // 损坏的文件头须被拒绝
+  {
+    fstream file(path, ios::in | ios::out | ios::binary);
+    file.seekp(0);
+    file.put('X');
+  }
+  bool caught = false;
+  try {
+    TemplateLibrary::open(path);
+  } catch (const cv::Exception &) {
+    caught = true;
+  }
+  failures += !caught;
+  std::remove(path.c_str());
+
+  cout << "open: " << timer.time() * 1000 << " ms, "
+       << (failures ? "FAILED" : "passed") << " (" << failures
+       << " failures)" << endl;
+  cout << "----------------------" << endl << endl;
+}
+
+void RESPONSECACHE_test() {
+  cout << "response cache tests" << endl;
+  cout << "--------------------" << endl << endl;
+
+  int failures = 0;
+  ResponseCache cache(3);
+  vector<Ptr<ResponsePyramid> > pyramids;
+  for (int i = 0; i < 4; i++) {
+    pyramids.push_back(makePtr<ResponsePyramid>());
+    pyramids[i]->sizes.resize(i + 1);
+  }
+
+  cache.put("frame_0", pyramids[0]);
+  cache.put("frame_1", pyramids[1]);
+  cache.put("frame_2", pyramids[2]);
+  failures += cache.get("frame_0") != pyramids[0]; // frame_0 成为最近使用
+  cache.put("frame_3", pyramids[3]);               // 淘汰 frame_1
+  failures += cache.size() != 3;
+  failures += !cache.get("frame_1").empty();
+  failures += cache.get("frame_0") != pyramids[0];
+  failures += cache.get("frame_2") != pyramids[2];
+  failures += cache.get("frame_3") != pyramids[3];
+
+  cache.put("frame_2", pyramids[1]); // 替换已有的项
+  failures += cache.get("frame_2") != pyramids[1] || cache.size() != 3;
+  cache.erase("frame_2");
+  failures += !cache.get("frame_2").empty() || cache.size() != 2;
+  cache.clear();
+  failures += cache.size() != 0;
+
+  cout << (failures ? "FAILED" : "passed") << " (" << failures
+       << " failures)" << endl;
+  cout << "--------------------" << endl << endl;
+}
+
+void LAZYTEMPLATES_test() {
+  cout << "lazy templates tests" << endl;
+  cout << "--------------------" << endl << endl;
+
+  RNG rng(0x2023);
+  const int levels = 3;
+  vector<ShapeTemplate> origins;
+  for (int l = 0; l < levels; l++) {
+    ShapeTemplate origin(l, 1.0f, 0.0f);
+    origin.box = RotatedRect(Point2f(0, 0), Size2f(64 >> l, 32 >> l), 0);
+    for (int j = 0; j < (100 >> l); j++)
+      origin.features.push_back(Gradient(rng.uniform(-32, 32) >> l, rng.uniform(-16, 16) >> l,
+                                         rng.uniform(0.f, 360.f)));
+    origins.push_back(origin);
+  }
+  vector<Point2f> poses;
+  for (float scale = 0.8f; scale < 1.2f + line2d_eps; scale += 0.1f)
+    for (float angle = 0; angle < 360; angle += 1)
+      poses.push_back(Point2f(scale, angle));
+
+  int failures = 0;
+  LazyTemplates lazy(origins, poses);
+  const int n = lazy.size();
+  // 构造时不生成任何模板
+  failures += lazy.materialized() != 0;
+
+  // 多线程同时访问同一批模板, 结果须与直接生成一致
+  ThreadPool pool(8);
+  vector<int> ids;
+  for (int k = 0; k < 200; k++)
+    ids.push_back(rng.uniform(0, n));
+  vector<int> mismatches(ids.size(), 0);
+  pool.parallel_for(0, (int)ids.size() * 4, [&](int task, int) {
+    const int k = task % ids.size();
+    const ShapeTemplate &actual = lazy.get(0, ids[k]);
+    Ptr<ShapeTemplate> expected = origins[0].relocate(poses[ids[k]].x, poses[ids[k]].y);
+    bool same = actual.features.size() == expected->features.size() &&
+                actual.scale == expected->scale && actual.angle == expected->angle;
+    for (size_t j = 0; same && j < actual.features.size(); j++)
+      same = actual.features[j].x == expected->features[j].x &&
+             actual.features[j].y == expected->features[j].y &&
+             actual.features[j].label == expected->features[j].label;
+    mismatches[k] |= !same;
+  });
+  failures += count(mismatches.begin(), mismatches.end(), 1);
+
+  set<int> unique_ids(ids.begin(), ids.end());
+  failures += lazy.materialized() != (int)unique_ids.size();
+  // 重复访问返回同一对象
+  failures += &lazy.get(0, ids[0]) != &lazy.get(0, ids[0]);
+
+  cout << "generated " << lazy.materialized() << " of " << levels * n
+       << " templates, " << (failures ? "FAILED" : "passed") << " ("
+       << failures << " failures)" << endl;
+  cout << "--------------------" << endl << endl;
+}
+
+void POSESEARCH_test() {
+  cout << "pose search tests" << endl;
+  cout << "-----------------" << endl << endl;
+
+  RNG rng(0x2023);
+  const int levels = 4;
+  vector<ShapeTemplate> origins;
+  for (int l = 0; l < levels; l++) {
+    ShapeTemplate origin(l, 1.0f, 0.0f);
+    const int radius = 120 >> l;
+    for (int j = 0; j < 64; j++) {
+      const float theta = rng.uniform(0.f, (float)CV_2PI);
+      origin.features.push_back(Gradient(cvRound(radius * cos(theta)),
+                                         cvRound(radius * sin(theta)),
+                                         rng.uniform(0.f, 360.f)));
+    }
+    origins.push_back(origin);
+  }
+
+  TemplateClass templs;
+  templs.pyramid_level = levels;
+  templs.search = Search(line2Dup::Range(0.9f, 1.1f, 0.01f),
+                         line2Dup::Range(0.f, 359.f, 1.f));
+  vector<Point2f> poses;
+  for (int si = 0; si < templs.search.scale.count(); si++)
+    for (int ai = 0; ai < templs.search.angle.count(); ai++)
+      poses.push_back(Point2f(templs.search.scale.value(si),
+                              templs.search.angle.value(ai)));
+  templs.num_templates = (int)poses.size();
+  templs.lazy = makePtr<LazyTemplates>(origins, poses);
+  templs.initPoseSearch();
+
+  int failures = 0;
+  failures += !templs.angle_wraps;
+  failures += templs.angle_stride[0] != 1 || templs.scale_stride[0] != 1;
+  for (int l = 1; l < levels; l++)
+    failures += templs.angle_stride[l] < templs.angle_stride[l - 1] ||
+                templs.scale_stride[l] < templs.scale_stride[l - 1];
+
+  // 任一位姿都能从最高层最近的位姿出发, 逐层取邻域中最近的位姿到达
+  const int top = levels - 1;
+  vector<int> ids;
+  for (int t = 0; t < 500; t++) {
+    const int target = rng.uniform(0, templs.num_templates);
+    auto distance = [&](int id) {
+      int da = abs(id % templs.num_angles - target % templs.num_angles);
+      da = min(da, templs.num_angles - da);
+      return da + abs(id / templs.num_angles - target / templs.num_angles);
+    };
+    auto closest = [&](const vector<int> &candidates) {
+      return *min_element(candidates.begin(), candidates.end(),
+                          [&](int a, int b) { return distance(a) < distance(b); });
+    };
+
+    int current = closest(templs.top_templates);
+    for (int l = top - 1; l >= 0; l--) {
+      templs.neighborPoses(l, current, ids);
+      failures += count(ids.begin(), ids.end(), current) != 1;
+      current = closest(ids);
+    }
+    failures += current != target;
+  }
+
+  cout << "top level " << templs.top_templates.size() << " of "
+       << templs.num_templates << " poses, strides";
+  for (int l = 0; l < levels; l++)
+    cout << " " << templs.angle_stride[l] << "x" << templs.scale_stride[l];
+  cout << ", " << (failures ? "FAILED" : "passed") << " (" << failures
+       << " failures)" << endl;
+  cout << "-----------------" << endl << endl;
+}
+
+void REFINEPOSE_test() {
+  cout << "pose refinement tests" << endl;
+  cout << "---------------------" << endl << endl;
+
+  // 非对称多边形, 源图像中的物体相对模板旋转 true_angle 并平移亚像素距离
+  const vector<Point2f> polygon = {{60, 50},  {150, 60}, {140, 100},
+                                   {110, 95}, {120, 150}, {55, 140}};
+  auto draw = [](Mat &image, const vector<Point2f> &vertices) {
+    const int shift = 4;
+    vector<Point> fixed;
+    for (const Point2f &v : vertices)
+      fixed.push_back(Point(cvRound(v.x * (1 << shift)), cvRound(v.y * (1 << shift))));
+    fillPoly(image, vector<vector<Point> >(1, fixed), Scalar::all(255), LINE_AA, shift);
+  };
+
+  Mat templateImage = Mat::zeros(200, 200, CV_8UC3);
+  draw(templateImage, polygon);
+  const RotatedRect polygon_box = minAreaRect(polygon);
+
+  Ptr<TemplateSet> templates = makePtr<TemplateSet>();
+  templates->addTemplate(templateImage, Mat(),
+                         Search(line2Dup::Range(1.0f, 1.0f, 0.0f),
+                                line2Dup::Range(-9.0f, 9.0f, 3.0f)));
+  line2Dup::Detector detector(templates);
+
+  int failures = 0;
+  const float true_angles[] = {-4.2f, -1.4f, 0.7f, 2.3f};
+  for (float true_angle : true_angles) {
+    Mat rotation = getRotationMatrix2D(Point2f(100, 100), true_angle, 1.0);
+    rotation.at<double>(0, 2) += 150.3;
+    rotation.at<double>(1, 2) += 120.6;
+    vector<Point2f> vertices, center;
+    cv::transform(polygon, vertices, rotation);
+    cv::transform(vector<Point2f>(1, polygon_box.center), center, rotation);
+    Mat sourceImage = Mat::zeros(480, 480, CV_8UC3);
+    draw(sourceImage, vertices);
+
+    MatchContext context;
+    detector.match(context, sourceImage, 80);
+    vector<Vec6f> points;
+    vector<RotatedRect> boxes;
+    detector.detectBestMatch(context, points, boxes, "default", 0.5f, 1);
+    if (points.empty()) {
+      failures++;
+      continue;
+    }
+    const float coarse_angle = points[0][3];
+    detector.refineMatches(context, points, boxes);
+
+    // 模板角度与生成时的旋转角度相反, 精化后的选框仍落在物体上
+    const float error = abs(points[0][3] + true_angle);
+    const float center_error = norm(boxes[0].center - center[0]);
+    failures += error > 0.3f || abs(points[0][2] - 1.0f) > 0.01f ||
+                center_error > 3.0f;
+    cout << cv::format("rotation %5.2f: coarse %6.2f refined %6.2f (error %.2f), "
+                       "box center error %.2f",
+                       true_angle, coarse_angle, points[0][3], error, center_error)
+         << endl;
+  }
+
+  cout << (failures ? "FAILED" : "passed") << " (" << failures
+       << " failures)" << endl;
+  cout << "---------------------" << endl << endl;
+}
+
+void ROISEARCH_test() {
+  cout << "roi search tests" << endl;
+  cout << "----------------" << endl << endl;
+
+  const vector<Point> polygon = {{60, 50},  {150, 60}, {140, 100},
+                                 {110, 95}, {120, 150}, {55, 140}};
+  Mat templateImage = Mat::zeros(200, 200, CV_8UC3);
+  fillPoly(templateImage, vector<vector<Point> >(1, polygon), Scalar::all(255));
+
+  // 源图像中放置两个物体, 搜索区域只覆盖其中一个
+  Mat sourceImage = Mat::zeros(600, 900, CV_8UC3);
+  const Point offsets[2] = {Point(80, 120), Point(560, 300)};
+  for (const Point &offset : offsets) {
+    vector<Point> moved;
+    for (const Point &p : polygon)
+      moved.push_back(p + offset);
+    fillPoly(sourceImage, vector<vector<Point> >(1, moved), Scalar::all(255));
+  }
+
+  Ptr<TemplateSet> templates = makePtr<TemplateSet>();
+  templates->addTemplate(templateImage);
+  line2Dup::Detector detector(templates);
+
+  MatchContext full, roi;
+  vector<Vec6f> full_points, roi_points;
+  vector<RotatedRect> boxes;
+  detector.match(full, sourceImage, 80);
+  detector.detectBestMatch(full, full_points, boxes);
+
+  const Rect search(offsets[1] + Point(60, 50), Size(100, 100));
+  detector.match(roi, sourceImage, 80, vector<Rect>(1, search));
+  detector.detectBestMatch(roi, roi_points, boxes);
+
+  int failures = 0;
+  failures += full_points.size() != 2 || roi_points.size() != 1;
+  if (roi_points.size() == 1) {
+    const Point position(cvRound(roi_points[0][0]), cvRound(roi_points[0][1]));
+    failures += !search.contains(position);
+    // 与整幅图像匹配得到的同一物体位置相同
+    bool same = false;
+    for (const Vec6f &point : full_points)
+      same |= point[0] == roi_points[0][0] && point[1] == roi_points[0][1];
+    failures += !same;
+  }
+
+  cout << "full image " << full_points.size() << " matches, roi "
+       << roi_points.size() << " matches, "
+       << (failures ? "FAILED" : "passed") << " (" << failures
+       << " failures)" << endl;
+  cout << "----------------" << endl << endl;
+}
+
+void TRACKER_test() {
+  cout << "tracker tests" << endl;
+  cout << "-------------" << endl << endl;
+
+  const vector<Point> polygon = {{60, 50},  {150, 60}, {140, 100},
+                                 {110, 95}, {120, 150}, {55, 140}};
+  Mat templateImage = Mat::zeros(200, 200, CV_8UC3);
+  fillPoly(templateImage, vector<vector<Point> >(1, polygon), Scalar::all(255));
+
+  Ptr<TemplateSet> templates = makePtr<TemplateSet>();
+  templates->addTemplate(templateImage, Mat(),
+                         Search(line2Dup::Range(1.0f, 1.0f, 0.0f),
+                                line2Dup::Range(0.0f, 359.0f, 1.0f)));
+  line2Dup::Detector detector(templates);
+  Tracker tracker(detector, "default", 80);
+
+  // 物体每帧平移 (4, 2) 像素, 第一帧全图搜索, 之后只做局部搜索
+  int failures = 0, global_searches = 0;
+  Vec6f first;
+  int64 local_ticks = 0;
+  for (int f = 0; f < 10; f++) {
+    Mat frame = Mat::zeros(480, 640, CV_8UC3);
+    vector<Point> moved;
+    for (const Point &p : polygon)
+      moved.push_back(p + Point(100 + 4 * f, 150 + 2 * f));
+    fillPoly(frame, vector<vector<Point> >(1, moved), Scalar::all(255));
+
+    vector<Vec6f> points;
+    vector<RotatedRect> boxes;
+    const int64 start = getTickCount();
+    tracker.update(frame, points, boxes);
+    if (f > 0)
+      local_ticks += getTickCount() - start;
+    global_searches += tracker.searchedGlobally();
+    if (points.size() != 1) {
+      failures++;
+      continue;
+    }
+    if (f == 0)
+      first = points[0];
+    failures += abs(points[0][0] - first[0] - 4 * f) > 1 ||
+                abs(points[0][1] - first[1] - 2 * f) > 1;
+  }
+  failures += global_searches != 1;
+  cout << cv::format("%d global searches, %.3f ms per tracked frame",
+                     global_searches,
+                     local_ticks * 1000.0 / getTickFrequency() / 9)
+       << endl;
+
+  // 物体每帧旋转 2 度并平移 (3, 1) 像素, 局部搜索的位姿与选框须跟上物体
+  const vector<Point2f> polygon2f(polygon.begin(), polygon.end());
+  const RotatedRect polygon_box = minAreaRect(polygon2f);
+  Tracker rotating_tracker(detector, "default", 80);
+  global_searches = 0;
+  for (int f = 0; f < 10; f++) {
+    const float rotation = 10.0f + 2.0f * f;
+    Mat motion = getRotationMatrix2D(Point2f(100, 100), rotation, 1.0);
+    motion.at<double>(0, 2) += 150 + 3 * f;
+    motion.at<double>(1, 2) += 120 + f;
+    vector<Point2f> vertices, center;
+    cv::transform(polygon2f, vertices, motion);
+    cv::transform(vector<Point2f>(1, polygon_box.center), center, motion);
+    vector<Point> moved;
+    for (const Point2f &v : vertices)
+      moved.push_back(Point(cvRound(v.x), cvRound(v.y)));
+    Mat frame = Mat::zeros(480, 640, CV_8UC3);
+    fillPoly(frame, vector<vector<Point> >(1, moved), Scalar::all(255));
+
+    vector<Vec6f> points;
+    vector<RotatedRect> boxes;
+    rotating_tracker.update(frame, points, boxes);
+    global_searches += rotating_tracker.searchedGlobally();
+    if (points.size() != 1) {
+      failures++;
+      continue;
+    }
+    // 模板角度与生成时的旋转角度相反
+    float angle_error = abs(points[0][3] - (360.0f - rotation));
+    angle_error = min(angle_error, 360.0f - angle_error);
+    failures += norm(boxes[0].center - center[0]) > 4.0f || angle_error > 2.0f;
+  }
+  failures += global_searches != 1;
+  cout << cv::format("rotating part: %d global searches", global_searches)
+       << endl;
+  cout << (failures ? "FAILED" : "passed") << " (" << failures
+       << " failures)" << endl;
+  cout << "-------------" << endl << endl;
+}
+
+void MATCHBATCH_test() {
+  cout << "batch matching tests" << endl;
+  cout << "--------------------" << endl << endl;
+
+  const vector<Point> polygon = {{60, 50},  {150, 60}, {140, 100},
+                                 {110, 95}, {120, 150}, {55, 140}};
+  Mat templateImage = Mat::zeros(200, 200, CV_8UC3);
+  fillPoly(templateImage, vector<vector<Point> >(1, polygon), Scalar::all(255));
+
+  Ptr<TemplateSet> templates = makePtr<TemplateSet>();
+  templates->addTemplate(templateImage);
+  line2Dup::Detector detector(templates);
+
+  vector<Mat> frames;
+  for (int f = 0; f < 12; f++) {
+    Mat frame = Mat::zeros(480, 640, CV_8UC3);
+    vector<Point> moved;
+    for (const Point &p : polygon)
+      moved.push_back(p + Point(20 * f, 10 * f));
+    fillPoly(frame, vector<vector<Point> >(1, moved), Scalar::all(255));
+    frames.push_back(frame);
+  }
+
+  // 逐帧匹配作为参照
+  int64 start = getTickCount();
+  vector<vector<Vec6f> > expected(frames.size());
+  MatchContext context;
+  for (size_t f = 0; f < frames.size(); f++) {
+    vector<RotatedRect> boxes;
+    detector.match(context, frames[f], 80);
+    detector.detectBestMatch(context, expected[f], boxes);
+  }
+  const double sequential_ms = (getTickCount() - start) * 1000.0 / getTickFrequency();
+
+  vector<vector<Vec6f> > refined(frames.size());
+  for (size_t f = 0; f < frames.size(); f++) {
+    vector<RotatedRect> boxes;
+    detector.match(context, frames[f], 80);
+    detector.detectBestMatch(context, refined[f], boxes);
+    detector.refineMatches(context, refined[f], boxes);
+  }
+
+  start = getTickCount();
+  vector<vector<Vec6f> > points;
+  vector<vector<RotatedRect> > boxes;
+  detector.matchBatch(frames, 80, points, boxes);
+  const double batch_ms = (getTickCount() - start) * 1000.0 / getTickFrequency();
+
+  int failures = points.size() != frames.size();
+  for (size_t f = 0; f < frames.size() && !failures; f++) {
+    failures += points[f].size() != expected[f].size();
+    for (size_t i = 0; i < points[f].size() && i < expected[f].size(); i++)
+      failures += points[f][i] != expected[f][i];
+  }
+
+  // 从读取到交付, 同时处于流水线中的帧数不超过 max_in_flight; 精化与相似度
+  // 轮流使用线程池, 结果与逐帧精化一致
+  for (int max_in_flight : {1, 2, 4}) {
+    atomic<int> in_flight(0), peak(0);
+    size_t next = 0;
+    int delivered = 0;
+    detector.matchBatch(
+        [&](Mat &frame) {
+          if (next == frames.size())
+            return false;
+          frame = frames[next++];
+          const int now = ++in_flight;
+          int seen = peak;
+          while (now > seen && !peak.compare_exchange_weak(seen, now))
+            ;
+          return true;
+        },
+        [&](int index, const vector<Vec6f> &frame_points,
+            const vector<RotatedRect> &) {
+          failures += index != delivered++;
+          failures += frame_points.size() != refined[index].size();
+          for (size_t i = 0; i < frame_points.size() && i < refined[index].size(); i++)
+            failures += frame_points[i] != refined[index][i];
+          --in_flight;
+        },
+        80, "default", max_in_flight, true);
+    failures += delivered != int(frames.size()) || peak > max_in_flight;
+    cout << cv::format("max_in_flight %d: peak %d", max_in_flight, int(peak))
+         << endl;
+  }
+
+  cout << cv::format("sequential %.1f ms, batch %.1f ms", sequential_ms, batch_ms)
+       << endl;
+  cout << (failures ? "FAILED" : "passed") << " (" << failures
+       << " failures)" << endl;
+  cout << "--------------------" << endl << endl;
+}
+
+void PROFILE_test() {
+  cout << "profile tests" << endl;
+  cout << "--------------------" << endl << endl;
+
+  const vector<Point> polygon = {{60, 50},  {150, 60}, {140, 100},
+                                 {110, 95}, {120, 150}, {55, 140}};
+  Mat templateImage = Mat::zeros(200, 200, CV_8UC3);
+  fillPoly(templateImage, vector<vector<Point> >(1, polygon), Scalar::all(255));
+  Mat sourceImage = Mat::zeros(480, 640, CV_8UC3);
+  vector<Point> moved;
+  for (const Point &p : polygon)
+    moved.push_back(p + Point(200, 150));
+  fillPoly(sourceImage, vector<vector<Point> >(1, moved), Scalar::all(255));
+
+  Ptr<TemplateSet> templates = makePtr<TemplateSet>();
+  templates->addTemplate(templateImage);
+  line2Dup::Detector detector(templates);
+
+  // 统计不应改变匹配结果
+  MatchContext plain, profiled;
+  Ptr<Profile> profile = makePtr<Profile>();
+  profiled.setProfile(profile);
+
+  vector<Vec6f> expected, points;
+  vector<RotatedRect> boxes;
+  detector.match(plain, sourceImage, 80);
+  detector.detectBestMatch(plain, expected, boxes);
+  detector.match(profiled, sourceImage, 80);
+  detector.detectBestMatch(profiled, points, boxes);
+  detector.refineMatches(profiled, points, boxes);
+
+  int failures = points.size() != expected.size();
+  for (size_t i = 0; i < points.size() && i < expected.size(); i++)
+    failures += points[i][5] != expected[i][5];
+
+  // 最高层每个模板恰好计分一次
+  const TemplateClass &templs = templates->at("default");
+  const int top = templs.pyramid_level - 1;
+  failures += profile->counter(COUNTER_TEMPLATES_EVALUATED, top) !=
+              (int64)templs.top_templates.size();
+  failures += profile->counter(COUNTER_CANDIDATES, 0) == 0;
+  failures += profile->stageTime(STAGE_PREPROCESS) <= 0;
+  failures += profile->stageTime(STAGE_SIMILARITY) <= 0;
+
+  // 未设置统计时的开销
+  const int rounds = 10;
+  int64 start = getTickCount();
+  for (int i = 0; i < rounds; i++)
+    detector.match(plain, sourceImage, 80);
+  const double plain_ms =
+      (getTickCount() - start) * 1000.0 / getTickFrequency() / rounds;
+  start = getTickCount();
+  for (int i = 0; i < rounds; i++)
+    detector.match(profiled, sourceImage, 80);
+  const double profiled_ms =
+      (getTickCount() - start) * 1000.0 / getTickFrequency() / rounds;
+
+  cout << profile->toJson() << endl;
+  cout << cv::format("match %.2f ms, with profile %.2f ms", plain_ms,
+                     profiled_ms)
+       << endl;
+  cout << (failures ? "FAILED" : "passed") << " (" << failures
+       << " failures)" << endl;
+  cout << "--------------------" << endl << endl;
+}
+
+void ORIENTATIONS_test() {
+  cout << "orientation count and block size tests" << endl;
+  cout << "--------------------" << endl << endl;
+
+  // 方向数与分块边长的每种组合都与标量参考实现一致
+  RNG rng(0x2023);
+  int failures = 0;
+  for (int num_orientations : {16, 8}) {
+    for (int T : {4, 8}) {
+      vector<LinearMemory> response_map(num_orientations, LinearMemory(T));
+      for (auto &memory : response_map) {
+        Mat response(101, 133, CV_8U);
+        rng.fill(response, RNG::UNIFORM, 0, 9);
+        memory.linearize(response);
+      }
+
+      ShapeTemplate templ(0, 1.0f, 0.0f);
+      for (int k = 0; k < 150; k++) {
+        Gradient point;
+        point.x = rng.uniform(-40, 40);
+        point.y = rng.uniform(-40, 40);
+        point.label = rng.uniform(0, QUANTIZE_BASE);
+        templ.features.push_back(point);
+      }
+
+      LinearMemory similarity(T);
+      Mat expected;
+      computeSimilarity(response_map.data(), templ, similarity,
+                        num_orientations);
+      computeSimilarityNaive(response_map.data(), templ, expected,
+                             num_orientations);
+      int mismatches = 0;
+      for (int i = 0; i < T * T; i++)
+        for (int j = 0; j < (int)similarity.linear_size(); j++)
+          mismatches += similarity.ptr<short>(i)[j] != expected.at<short>(i, j);
+      cout << num_orientations << " orientations, T = " << T << ": "
+           << (mismatches ? "FAILED" : "passed") << endl;
+      failures += mismatches != 0;
+    }
+  }
+
+  // 8 个方向的量化图像: 每个像素至多一个方向位, 扩散与 16 位一致
+  Mat quantized(64, 80, CV_8U);
+  for (int r = 0; r < quantized.rows; r++)
+    for (int c = 0; c < quantized.cols; c++)
+      quantized.at<uchar>(r, c) =
+          rng.uniform(0, 3) ? 0 : static_cast<uchar>(1 << rng.uniform(0, 8));
+  Mat quantized16, spread8, spread16;
+  quantized.convertTo(quantized16, CV_16U);
+  line2Dup::spread(quantized, spread8, 3);
+  line2Dup::spread(quantized16, spread16, 3);
+  spread8.convertTo(spread8, CV_16U);
+  failures += countNonZero(spread8 != spread16) != 0;
+
+  // 粗定位配置与默认配置找到同一物体
+  const vector<Point> polygon = {{60, 50},  {150, 60}, {140, 100},
+                                 {110, 95}, {120, 150}, {55, 140}};
+  Mat templateImage = Mat::zeros(200, 200, CV_8UC3);
+  fillPoly(templateImage, vector<vector<Point> >(1, polygon), Scalar::all(255));
+  Mat sourceImage = Mat::zeros(480, 640, CV_8UC3);
+  vector<Point> moved;
+  for (const Point &p : polygon)
+    moved.push_back(p + Point(300, 180));
+  fillPoly(sourceImage, vector<vector<Point> >(1, moved), Scalar::all(255));
+
+  Ptr<TemplateSet> templates = makePtr<TemplateSet>();
+  templates->addTemplate(templateImage);
+  line2Dup::Detector precise(templates);
+  line2Dup::Detector coarse(templates, 0, 8, 8);
+
+  MatchContext precise_context, coarse_context;
+  vector<Vec6f> precise_points, coarse_points;
+  vector<RotatedRect> boxes;
+  precise.match(precise_context, sourceImage, 80);
+  precise.detectBestMatch(precise_context, precise_points, boxes);
+  coarse.match(coarse_context, sourceImage, 80);
+  coarse.detectBestMatch(coarse_context, coarse_points, boxes);
+
+  failures += precise_points.size() != 1 || coarse_points.size() != 1;
+  if (precise_points.size() == 1 && coarse_points.size() == 1)
+    failures += abs(precise_points[0][0] - coarse_points[0][0]) > 2 ||
+                abs(precise_points[0][1] - coarse_points[0][1]) > 2;
+
+  cout << (failures ? "FAILED" : "passed") << " (" << failures
+       << " failures)" << endl;
+  cout << "--------------------" << endl << endl;
+}
+
+void KERNELS_test() {
+  cout << "kernel dispatch tests" << endl;
+  cout << "--------------------" << endl << endl;
+
+  // 各指令集的内核与最低指令集的结果逐字节一致
+  const KernelTable &base = *kernelsSSE2();
+  const vector<const KernelTable *> tables = availableKernels();
+  cout << "selected " << kernels().name << ", available";
+  for (const KernelTable *table : tables)
+    cout << " " << table->name;
+  cout << endl;
+
+  RNG rng(7);
+  const int width = 203, height = 37, total = width * height;
+  Mat quantized(height, width, CV_16U), nibbles(4, total, CV_8U);
+  Mat responses(8, total, CV_8U), lut(1, 64, CV_8U);
+  Mat quantized8(height, width, CV_8U);
+  rng.fill(quantized, RNG::UNIFORM, 0, 65536);
+  rng.fill(quantized8, RNG::UNIFORM, 0, 256);
+  rng.fill(nibbles, RNG::UNIFORM, 0, 16);
+  rng.fill(responses, RNG::UNIFORM, 0, 9);
+  rng.fill(lut, RNG::UNIFORM, 0, 9);
+
+  vector<const uint8_t *> src;
+  for (int k = 0; k < responses.rows; k++)
+    src.push_back(responses.ptr(k) + k);
+  const int length = total - responses.rows;
+
+  int failures = 0;
+  for (const KernelTable *table : tables) {
+    Mat expected_or = Mat::zeros(height, width, CV_16U), or_ = expected_or.clone();
+    base.orRows16u(quantized.ptr<uint16_t>(1) + 1, (int)quantized.step1(),
+                   expected_or.ptr<uint16_t>(), (int)expected_or.step1(),
+                   width - 1, height - 1);
+    table->orRows16u(quantized.ptr<uint16_t>(1) + 1, (int)quantized.step1(),
+                     or_.ptr<uint16_t>(), (int)or_.step1(), width - 1,
+                     height - 1);
+    failures += countNonZero(expected_or != or_) != 0;
+
+    Mat expected_or8 = Mat::zeros(height, width, CV_8U), or8 = expected_or8.clone();
+    base.orRows8u(quantized8.ptr(1) + 1, (int)quantized8.step1(),
+                  expected_or8.ptr(), (int)expected_or8.step1(), width - 1,
+                  height - 1);
+    table->orRows8u(quantized8.ptr(1) + 1, (int)quantized8.step1(), or8.ptr(),
+                    (int)or8.step1(), width - 1, height - 1);
+    failures += countNonZero(expected_or8 != or8) != 0;
+
+    Mat expected_map(1, total, CV_8U), map(1, total, CV_8U);
+    base.lookupResponses(nibbles.ptr(), 4, lut.ptr(), expected_map.ptr(), total);
+    table->lookupResponses(nibbles.ptr(), 4, lut.ptr(), map.ptr(), total);
+    failures += countNonZero(expected_map != map) != 0;
+
+    Mat expected_sim = Mat::zeros(1, length, CV_16S), sim = expected_sim.clone();
+    base.accumulateSimilarity(src.data(), (int)src.size(),
+                              expected_sim.ptr<int16_t>(), 3, length - 5);
+    table->accumulateSimilarity(src.data(), (int)src.size(),
+                                sim.ptr<int16_t>(), 3, length - 5);
+    failures += countNonZero(expected_sim != sim) != 0;
+
+    int16_t expected_row[16], row[16];
+    base.accumulateWindowRow(src.data(), (int)src.size(), expected_row);
+    table->accumulateWindowRow(src.data(), (int)src.size(), row);
+    failures += !std::equal(row, row + 16, expected_row);
+  }
+
+  // LINE2DUP_CPU 只限制上限: 取不高于所请求一级的最高可用内核, 未知的名称
+  // 退到最低一级
+  KernelTable avx2 = base;
+  avx2.name = "AVX2";
+  const vector<const KernelTable *> levels = {&base, &avx2};
+  failures += selectKernels(levels, nullptr) != &avx2;
+  failures += selectKernels(levels, "AVX-512") != &avx2;
+  failures += selectKernels(levels, "AVX2") != &avx2;
+  failures += selectKernels(levels, "SSE4.2") != &base;
+  failures += selectKernels(levels, "SSE2") != &base;
+  failures += selectKernels(levels, "avx2") != &base;
+
+  cout << (failures ? "FAILED" : "passed") << " (" << failures
+       << " failures)" << endl;
+  cout << "--------------------" << endl << endl;
+}
+
 int main() {
+  // MIPP_test();
+  // SPREAD_test();
+  // QUANTIZE_test();
+  // SCATTERED_test();
+  // SIMILARITY_bench();
+  // THREADPOOL_test();
+  // NMS_test();
+  // ROTATEDMATCH_test();
+  // TEMPLATELIB_test();
+  // RESPONSECACHE_test();
+  // LAZYTEMPLATES_test();
+  // POSESEARCH_test();
+  // REFINEPOSE_test();
+  // ROISEARCH_test();
+  // TRACKER_test();
+  // MATCHBATCH_test();
+  // PROFILE_test();
+  // KERNELS_test();
+  // ORIENTATIONS_test();
+
   Mat sourceImage = imread("../../imagelib/source_0.bmp", IMREAD_COLOR);
   Mat templateImage = imread("../../imagelib/template_0.bmp", IMREAD_COLOR);
 
-  line2Dup::Detector detector;
-  detector.match(sourceImage, templateImage, 90);
+  // 模板集合训练后只读, 可以被多个 Detector 或线程共享
+  Ptr<TemplateSet> templates = makePtr<TemplateSet>();
+  templates->addTemplate(templateImage);
+
+  line2Dup::Detector detector(templates);
+  MatchContext context;
+  detector.match(context, sourceImage, 90);
 
   vector<Vec6f> points;
   vector<RotatedRect> boxes;
-  detector.detectBestMatch(points, boxes);
+  detector.detectBestMatch(context, points, boxes);
+  detector.refineMatches(context, points, boxes);
 
   return 0;
 }
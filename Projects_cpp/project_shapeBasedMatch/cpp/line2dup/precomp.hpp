@@ -9,6 +9,7 @@
 #include <list>
 #include <set>
 #include <map>
+#include <type_traits>
 
 #include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
@@ -0,0 +1,329 @@
+#ifndef LINE2DUP_PROFILER_HPP
+#define LINE2DUP_PROFILER_HPP
+
+#include <opencv2/core.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// 热路径的统计: 各阶段耗时, 计数与内存分配, line2dup, line2d 与 linemod
+/// 共用. 统计写入当前线程绑定的 Profile, 未绑定时每个统计点只读一次线程
+/// 局部指针; 定义 LINE2DUP_NO_PROFILE 时统计点在编译期消失
+namespace line2Dup {
+
+/// @brief 计时的阶段. 阶段可以嵌套, 耗时包含内层阶段
+enum ProfileStage {
+  STAGE_PREPROCESS,         // 源图像预处理的总耗时
+  STAGE_GRADIENT,           // 梯度与方向量化
+  STAGE_SPREAD,             // 方向扩散
+  STAGE_RESPONSE_MAPS,      // 响应图
+  STAGE_LINEARIZE,          // 线性化
+  STAGE_MATCH,              // 模板匹配的总耗时
+  STAGE_SIMILARITY,         // 最高层全图相似度
+  STAGE_PYRAMID_REFINE,     // 逐层精化
+  STAGE_TEMPLATE_TRANSFORM, // 模板的旋转缩放
+  STAGE_CANDIDATE_REGIONS,  // 候选区域提取
+  STAGE_LOCAL_SEARCH,       // 局部搜索
+  STAGE_NMS,                // 重复匹配的抑制
+  STAGE_POSE_REFINE,        // 亚像素位姿精化
+  NUM_PROFILE_STAGES
+};
+
+/// @brief 按金字塔层分别累加的计数
+enum ProfileCounter {
+  COUNTER_CANDIDATES,          // 通过阈值的候选点
+  COUNTER_TEMPLATES_EVALUATED, // 计分的模板 (位姿)
+  COUNTER_TEMPLATES_PRUNED,    // 候选点全部被淘汰的模板
+  COUNTER_FEATURES_EVALUATED,  // 累加到相似度图中的特征
+  COUNTER_REFINE_ITERATIONS,   // 位姿精化的迭代
+  NUM_PROFILE_COUNTERS
+};
+
+/// 计数区分的金字塔层数, 更高的层计入最后一层
+#define PROFILE_MAX_LEVELS 8
+
+/// @brief 一次请求 (通常为一帧) 的统计. 每个写入过的线程独占一个槽位, 写入
+/// 时不加锁; 读取 (toJson, stageTime, counter) 须在所有写入线程完成之后
+class Profile {
+public:
+  Profile() : id(nextId()) {}
+
+  Profile(const Profile &) = delete;
+  Profile &operator=(const Profile &) = delete;
+
+  /// @brief 当前线程绑定的统计, 未绑定时为空
+  static Profile *current() {
+#ifdef LINE2DUP_NO_PROFILE
+    return nullptr;
+#else
+    return binding();
+#endif
+  }
+
+  /// @brief 清零, 槽位保留
+  void reset() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &slot : slots)
+      slot->clear();
+  }
+
+  void addTime(ProfileStage stage, int64_t ns) {
+    StageStat &stat = slot().stages[stage];
+    stat.calls++;
+    stat.total_ns += ns;
+    stat.max_ns = std::max(stat.max_ns, ns);
+  }
+
+  void count(ProfileCounter counter, int level, int64_t value) {
+    level = std::min(std::max(level, 0), PROFILE_MAX_LEVELS - 1);
+    slot().counters[counter][level] += value;
+  }
+
+  void countAllocation(size_t bytes) {
+    Slot &s = slot();
+    s.allocations++;
+    s.allocated_bytes += static_cast<int64_t>(bytes);
+  }
+
+  /// @brief 各线程合计的阶段耗时 (毫秒)
+  double stageTime(ProfileStage stage) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    int64_t ns = 0;
+    for (const auto &slot : slots)
+      ns += slot->stages[stage].total_ns;
+    return ns * 1e-6;
+  }
+
+  /// @brief 各线程合计的计数, level 小于 0 时为各层之和
+  int64_t counter(ProfileCounter which, int level = -1) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    int64_t value = 0;
+    for (const auto &slot : slots)
+      for (int l = 0; l < PROFILE_MAX_LEVELS; l++)
+        if (level < 0 || l == std::min(level, PROFILE_MAX_LEVELS - 1))
+          value += slot->counters[which][l];
+    return value;
+  }
+
+  /// @brief 导出为 JSON: 各阶段合计的调用次数, 总耗时与单次最大耗时 (毫秒),
+  /// 按层的计数, 内存分配, 以及各线程的阶段耗时 (用于观察负载是否均衡)
+  std::string toJson() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    Slot total;
+    for (const auto &slot : slots)
+      total.merge(*slot);
+
+    std::ostringstream json;
+    json << "{\"stages\":{";
+    bool first = true;
+    for (int s = 0; s < NUM_PROFILE_STAGES; s++) {
+      const StageStat &stat = total.stages[s];
+      if (stat.calls == 0)
+        continue;
+      json << (first ? "" : ",") << '"' << stageName(s) << "\":{\"calls\":"
+           << stat.calls << ",\"total_ms\":" << stat.total_ns * 1e-6
+           << ",\"max_ms\":" << stat.max_ns * 1e-6 << '}';
+      first = false;
+    }
+
+    json << "},\"counters\":{";
+    first = true;
+    for (int c = 0; c < NUM_PROFILE_COUNTERS; c++) {
+      int levels = PROFILE_MAX_LEVELS;
+      while (levels > 0 && total.counters[c][levels - 1] == 0)
+        levels--;
+      if (levels == 0)
+        continue;
+      json << (first ? "" : ",") << '"' << counterName(c) << "\":[";
+      for (int l = 0; l < levels; l++)
+        json << (l ? "," : "") << total.counters[c][l];
+      json << ']';
+      first = false;
+    }
+
+    json << "},\"allocations\":{\"count\":" << total.allocations
+         << ",\"bytes\":" << total.allocated_bytes << "},\"threads\":[";
+    for (size_t t = 0; t < slots.size(); t++) {
+      json << (t ? "," : "") << '{';
+      first = true;
+      for (int s = 0; s < NUM_PROFILE_STAGES; s++) {
+        const StageStat &stat = slots[t]->stages[s];
+        if (stat.calls == 0)
+          continue;
+        json << (first ? "" : ",") << '"' << stageName(s)
+             << "\":" << stat.total_ns * 1e-6;
+        first = false;
+      }
+      json << '}';
+    }
+    json << "]}";
+    return json.str();
+  }
+
+  static const char *stageName(int stage) {
+    static const char *const names[NUM_PROFILE_STAGES] = {
+        "preprocess",         "gradient",          "spread",
+        "response_maps",      "linearize",         "match",
+        "similarity",         "pyramid_refine",    "template_transform",
+        "candidate_regions",  "local_search",      "nms",
+        "pose_refine"};
+    return names[stage];
+  }
+
+  static const char *counterName(int counter) {
+    static const char *const names[NUM_PROFILE_COUNTERS] = {
+        "candidates", "templates_evaluated", "templates_pruned",
+        "features_evaluated", "refine_iterations"};
+    return names[counter];
+  }
+
+private:
+  friend class ProfileBinding;
+
+  struct StageStat {
+    int64_t calls = 0;
+    int64_t total_ns = 0;
+    int64_t max_ns = 0;
+  };
+
+  struct Slot {
+    std::thread::id thread;
+    StageStat stages[NUM_PROFILE_STAGES];
+    int64_t counters[NUM_PROFILE_COUNTERS][PROFILE_MAX_LEVELS] = {};
+    int64_t allocations = 0;
+    int64_t allocated_bytes = 0;
+    char padding[64]; // 隔开相邻的槽位, 避免不同线程的写入伪共享
+
+    void clear() {
+      const std::thread::id owner = thread;
+      *this = Slot();
+      thread = owner;
+    }
+
+    void merge(const Slot &other) {
+      for (int s = 0; s < NUM_PROFILE_STAGES; s++) {
+        stages[s].calls += other.stages[s].calls;
+        stages[s].total_ns += other.stages[s].total_ns;
+        stages[s].max_ns = std::max(stages[s].max_ns, other.stages[s].max_ns);
+      }
+      for (int c = 0; c < NUM_PROFILE_COUNTERS; c++)
+        for (int l = 0; l < PROFILE_MAX_LEVELS; l++)
+          counters[c][l] += other.counters[c][l];
+      allocations += other.allocations;
+      allocated_bytes += other.allocated_bytes;
+    }
+  };
+
+  // 线程最近一次写入的统计与槽位, 命中时不加锁
+  struct SlotCache {
+    uint64_t profile_id = 0;
+    Slot *slot = nullptr;
+  };
+
+  static Profile *&binding() {
+    static thread_local Profile *profile = nullptr;
+    return profile;
+  }
+
+  static uint64_t nextId() {
+    static std::atomic<uint64_t> counter(0);
+    return ++counter;
+  }
+
+  Slot &slot() {
+    static thread_local SlotCache cache;
+    if (cache.profile_id == id)
+      return *cache.slot;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    const std::thread::id self = std::this_thread::get_id();
+    Slot *found = nullptr;
+    for (auto &slot : slots)
+      if (slot->thread == self)
+        found = slot.get();
+    if (!found) {
+      slots.emplace_back(new Slot());
+      found = slots.back().get();
+      found->thread = self;
+    }
+    cache.profile_id = id;
+    cache.slot = found;
+    return *found;
+  }
+
+  const uint64_t id; // 进程内唯一, 地址复用时缓存不会误命中
+  mutable std::mutex mutex;
+  std::vector<std::unique_ptr<Slot> > slots;
+};
+
+/// @brief 在作用域内把 profile 绑定到当前线程, 结束时恢复原绑定.
+/// profile 为空时保持原绑定不变
+class ProfileBinding {
+public:
+  explicit ProfileBinding(Profile *profile) : previous(Profile::binding()) {
+    if (profile)
+      Profile::binding() = profile;
+  }
+  ~ProfileBinding() { Profile::binding() = previous; }
+
+  ProfileBinding(const ProfileBinding &) = delete;
+  ProfileBinding &operator=(const ProfileBinding &) = delete;
+
+private:
+  Profile *previous;
+};
+
+/// @brief 作用域计时, 析构时计入当前线程绑定的统计
+class ProfileScope {
+public:
+  explicit ProfileScope(ProfileStage _stage)
+      : profile(Profile::current()), stage(_stage) {
+    if (profile)
+      start = std::chrono::steady_clock::now();
+  }
+  ~ProfileScope() {
+    if (profile)
+      profile->addTime(stage, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                  std::chrono::steady_clock::now() - start)
+                                  .count());
+  }
+
+  ProfileScope(const ProfileScope &) = delete;
+  ProfileScope &operator=(const ProfileScope &) = delete;
+
+private:
+  Profile *profile;
+  ProfileStage stage;
+  std::chrono::steady_clock::time_point start;
+};
+
+/// @brief 累加 level 层的计数
+inline void profileCount(ProfileCounter counter, int64_t value, int level = 0) {
+  if (Profile *profile = Profile::current())
+    profile->count(counter, level, value);
+}
+
+/// @brief 记录一次 bytes 字节的分配, 只在缓冲区确实重新分配时调用
+inline void profileAllocation(size_t bytes) {
+  if (Profile *profile = Profile::current())
+    profile->countAllocation(bytes);
+}
+
+/// @brief 记录 dst.create(size, type) 是否重新分配了内存, 之后调用 create
+inline void profileCreate(cv::Mat &dst, cv::Size size, int type) {
+  if (Profile::current() && (dst.size() != size || dst.type() != type))
+    profileAllocation(size.area() * CV_ELEM_SIZE(type));
+  dst.create(size, type);
+}
+
+} // namespace line2Dup
+
+#endif // LINE2DUP_PROFILER_HPP
@@ -0,0 +1,114 @@
+#ifndef LINE2DUP_SCATTEREDSELECTION_HPP
+#define LINE2DUP_SCATTEREDSELECTION_HPP
+
+#include <opencv2/core.hpp>
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <vector>
+
+namespace line2Dup {
+
+/// @brief 从候选点中贪心地选出 num_features 个分散的特征点, line2dup 与
+/// line2d 共用. 在给定距离下按 candidates 的顺序 (通常为梯度幅值降序) 逐个
+/// 检查, 与已选特征的距离都不小于该距离的候选点被选中. 距离从 distance,
+/// distance - 1, ..., 1 中二分查找能选够 num_features 个特征的最大者, 每轮
+/// 从头选择, 至多约 log2(distance) + 1 轮. 已选特征存放在边长不小于当前
+/// 距离的网格中, 每个候选点只需检查相邻的 3 x 3 个格子, 每轮代价为
+/// O(candidates)
+/// @tparam Candidate 具有整型成员 x, y 的候选点类型
+/// @tparam Feature 可由 Candidate 构造的特征类型
+/// @param candidates 候选点, 坐标互不相同, 数量不少于 num_features
+/// @param features 输出的特征点, 按选中的先后排列
+/// @return 选择所用的距离, 各特征两两之间的距离都不小于该值
+template <typename Candidate, typename Feature>
+float selectScatteredFeatures(const std::vector<Candidate> &candidates,
+                              std::vector<Feature> &features,
+                              size_t num_features, float distance) {
+  CV_Assert(candidates.size() >= num_features);
+  features.clear();
+  // distance 不大于 1 时坐标互不相同的候选点都会被选中, 不必继续减小
+  distance = std::max(distance, 1.0f);
+  if (num_features == 0)
+    return distance;
+  features.reserve(num_features);
+
+  int min_x = INT_MAX, min_y = INT_MAX, max_x = INT_MIN, max_y = INT_MIN;
+  for (const Candidate &c : candidates) {
+    min_x = std::min(min_x, static_cast<int>(c.x));
+    min_y = std::min(min_y, static_cast<int>(c.y));
+    max_x = std::max(max_x, static_cast<int>(c.x));
+    max_y = std::max(max_y, static_cast<int>(c.y));
+  }
+
+  // 网格中按单链表存放已选候选点的下标, 每轮重建
+  std::vector<int> head, next(candidates.size(), -1);
+  std::vector<int> selected, best;
+  selected.reserve(num_features);
+
+  // 在距离 d 下从头选择, 选够 num_features 个时提前结束
+  auto select = [&](float d) {
+    const int cell = std::max(1, static_cast<int>(std::ceil(d)));
+    const int grid_cols = (max_x - min_x) / cell + 1;
+    const int grid_rows = (max_y - min_y) / cell + 1;
+    const float distance_sq = d * d;
+    head.assign(static_cast<size_t>(grid_cols) * grid_rows, -1);
+    selected.clear();
+
+    for (size_t i = 0; i < candidates.size() && selected.size() < num_features; i++) {
+      const Candidate &c = candidates[i];
+      const int gx = (static_cast<int>(c.x) - min_x) / cell;
+      const int gy = (static_cast<int>(c.y) - min_y) / cell;
+
+      bool keep = true;
+      for (int y = std::max(gy - 1, 0); y <= std::min(gy + 1, grid_rows - 1) && keep; y++) {
+        for (int x = std::max(gx - 1, 0); x <= std::min(gx + 1, grid_cols - 1) && keep; x++) {
+          for (int j = head[y * grid_cols + x]; j >= 0 && keep; j = next[j]) {
+            const float dx = static_cast<float>(c.x - candidates[j].x);
+            const float dy = static_cast<float>(c.y - candidates[j].y);
+            keep = dx * dx + dy * dy >= distance_sq;
+          }
+        }
+      }
+      if (!keep)
+        continue;
+
+      selected.push_back(static_cast<int>(i));
+      int &h = head[gy * grid_cols + gx];
+      next[i] = h;
+      h = static_cast<int>(i);
+    }
+    return selected.size() == num_features;
+  };
+
+  // steps 为距离减小的次数, 在 (infeasible, feasible] 中二分. 距离为 1 时
+  // 必然能选够, 作为初始的 feasible. 选够的数量随距离增大近似单调递减,
+  // 个别不单调处二分得到的是其中一个可行的距离
+  auto distanceAt = [&](int steps) {
+    return std::max(distance - static_cast<float>(steps), 1.0f);
+  };
+  int infeasible = -1;
+  int feasible = static_cast<int>(std::ceil(distance - 1.0f));
+  while (feasible - infeasible > 1) {
+    const int steps = infeasible + (feasible - infeasible) / 2;
+    if (select(distanceAt(steps))) {
+      feasible = steps;
+      best.swap(selected);
+    } else {
+      infeasible = steps;
+    }
+  }
+  if (best.empty()) {
+    CV_Assert(select(distanceAt(feasible)));
+    best.swap(selected);
+  }
+
+  for (int i : best)
+    features.push_back(Feature(candidates[i]));
+  return distanceAt(feasible);
+}
+
+} // namespace line2Dup
+
+#endif // LINE2DUP_SCATTEREDSELECTION_HPP
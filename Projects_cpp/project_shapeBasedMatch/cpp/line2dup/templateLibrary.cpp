@@ -0,0 +1,313 @@
+#include "templateLibrary.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <type_traits>
+
+#if defined(_WIN32)
+#define LINE2DUP_NO_MMAP
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace cv;
+using namespace std;
+using namespace line2Dup;
+
+namespace {
+
+const char MAGIC[8] = {'L', '2', 'D', 'U', 'P', 'L', 'I', 'B'};
+const uint32_t BYTE_ORDER_MARK = 0x01020304;
+const size_t SECTION_ALIGNMENT = 64;
+const int MAX_NAME = 64;
+
+struct LibraryHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t header_size;
+  uint32_t num_classes;
+  uint32_t num_templates;
+  uint32_t reserved;
+  uint64_t num_features;
+  uint64_t class_offset;
+  uint64_t template_offset;
+  uint64_t feature_offset;
+  uint64_t file_size;
+};
+
+struct ClassRecord {
+  char name[MAX_NAME];
+  uint32_t pyramid_level;
+  uint32_t num_templates; // 各层模板总数
+  uint32_t first_template;
+  uint32_t reserved;
+  float scale[3]; // lower_bound, upper_bound, step
+  float angle[3];
+};
+
+struct TemplateRecord {
+  float center[2];
+  float size[2];
+  float box_angle;
+  float scale;
+  float angle;
+  int32_t pyramid_level;
+  uint64_t first_feature;
+  uint32_t num_features;
+  uint32_t reserved;
+};
+
+// 特征数组按 Gradient 的内存布局原地使用
+static_assert(std::is_trivially_copyable<Gradient>::value,
+              "Gradient must be trivially copyable");
+static_assert(sizeof(Gradient) == 4 * sizeof(int32_t),
+              "unexpected Gradient layout");
+static_assert(sizeof(LibraryHeader) == 72, "unexpected header layout");
+static_assert(sizeof(ClassRecord) == 104, "unexpected class record layout");
+static_assert(sizeof(TemplateRecord) == 48, "unexpected template record layout");
+
+inline const LibraryHeader &header(const uchar *data) {
+  return *reinterpret_cast<const LibraryHeader *>(data);
+}
+
+inline const ClassRecord *classRecords(const uchar *data) {
+  return reinterpret_cast<const ClassRecord *>(data + header(data).class_offset);
+}
+
+inline const TemplateRecord *templateRecords(const uchar *data) {
+  return reinterpret_cast<const TemplateRecord *>(data +
+                                                  header(data).template_offset);
+}
+
+inline const Gradient *featureArray(const uchar *data) {
+  return reinterpret_cast<const Gradient *>(data + header(data).feature_offset);
+}
+
+/// @brief 段 [offset, offset + count * elem_size) 是否位于文件内且按 64 字节对齐
+inline bool sectionInFile(uint64_t offset, uint64_t count, size_t elem_size,
+                          size_t file_size) {
+  return offset % SECTION_ALIGNMENT == 0 && offset <= file_size &&
+         count <= (file_size - offset) / elem_size;
+}
+
+inline void writePadding(ofstream &out, size_t from, size_t to) {
+  static const char zeros[SECTION_ALIGNMENT] = {0};
+  while (from < to) {
+    size_t n = min(to - from, SECTION_ALIGNMENT);
+    out.write(zeros, n);
+    from += n;
+  }
+}
+
+} // namespace
+
+/// class TemplateLibrary
+
+Ptr<TemplateLibrary> TemplateLibrary::open(const String &path) {
+  Ptr<TemplateLibrary> library(new TemplateLibrary());
+
+#ifndef LINE2DUP_NO_MMAP
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    CV_Error(Error::StsError, "cannot open template library: " + path);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(LibraryHeader)) {
+    ::close(fd);
+    CV_Error(Error::StsParseError, "truncated template library: " + path);
+  }
+  void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (addr == MAP_FAILED)
+    CV_Error(Error::StsError, "cannot map template library: " + path);
+  library->data = static_cast<const uchar *>(addr);
+  library->size = st.st_size;
+  library->mapped = true;
+#else
+  ifstream in(path, ios::binary | ios::ate);
+  if (!in)
+    CV_Error(Error::StsError, "cannot open template library: " + path);
+  const size_t size = static_cast<size_t>(in.tellg());
+  if (size < sizeof(LibraryHeader))
+    CV_Error(Error::StsParseError, "truncated template library: " + path);
+  library->buffer.create(1, static_cast<int>(size), CV_8U);
+  in.seekg(0);
+  in.read(reinterpret_cast<char *>(library->buffer.ptr()), size);
+  library->data = library->buffer.ptr();
+  library->size = size;
+#endif
+
+  library->validate();
+  return library;
+}
+
+TemplateLibrary::~TemplateLibrary() {
+#ifndef LINE2DUP_NO_MMAP
+  if (mapped)
+    munmap(const_cast<uchar *>(data), size);
+#endif
+}
+
+void TemplateLibrary::validate() const {
+  const LibraryHeader &h = header(data);
+  if (memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0)
+    CV_Error(Error::StsParseError, "not a line2dup template library");
+  if (h.byte_order != BYTE_ORDER_MARK)
+    CV_Error(Error::StsParseError, "template library has foreign byte order");
+  if (h.version != VERSION)
+    CV_Error(Error::StsParseError,
+             cv::format("unsupported template library version %u", h.version));
+  if (h.header_size != sizeof(LibraryHeader) || h.file_size != size ||
+      !sectionInFile(h.class_offset, h.num_classes, sizeof(ClassRecord), size) ||
+      !sectionInFile(h.template_offset, h.num_templates, sizeof(TemplateRecord), size) ||
+      !sectionInFile(h.feature_offset, h.num_features, sizeof(Gradient), size))
+    CV_Error(Error::StsParseError, "corrupted template library header");
+
+  // 只检查索引表, 特征数组不作解析
+  const ClassRecord *classes = classRecords(data);
+  for (uint32_t i = 0; i < h.num_classes; i++) {
+    const ClassRecord &c = classes[i];
+    if (memchr(c.name, '\0', MAX_NAME) == nullptr || c.pyramid_level == 0 ||
+        c.num_templates % c.pyramid_level != 0 ||
+        c.first_template > h.num_templates ||
+        c.num_templates > h.num_templates - c.first_template)
+      CV_Error(Error::StsParseError, "corrupted template library class table");
+  }
+
+  const TemplateRecord *templates = templateRecords(data);
+  for (uint32_t i = 0; i < h.num_templates; i++) {
+    const TemplateRecord &t = templates[i];
+    if (t.first_feature > h.num_features ||
+        t.num_features > h.num_features - t.first_feature)
+      CV_Error(Error::StsParseError, "corrupted template library index");
+  }
+}
+
+int TemplateLibrary::numClasses() const {
+  return static_cast<int>(header(data).num_classes);
+}
+
+String TemplateLibrary::className(int i) const {
+  CV_Assert(i >= 0 && i < numClasses());
+  return String(classRecords(data)[i].name);
+}
+
+int TemplateLibrary::pyramidLevel(int i) const {
+  CV_Assert(i >= 0 && i < numClasses());
+  return static_cast<int>(classRecords(data)[i].pyramid_level);
+}
+
+Search TemplateLibrary::search(int i) const {
+  CV_Assert(i >= 0 && i < numClasses());
+  const ClassRecord &c = classRecords(data)[i];
+  return Search(Range(c.scale[0], c.scale[1], c.scale[2]),
+                Range(c.angle[0], c.angle[1], c.angle[2]));
+}
+
+void TemplateLibrary::templates(int i, vector<TemplateView> &views) const {
+  CV_Assert(i >= 0 && i < numClasses());
+  const ClassRecord &c = classRecords(data)[i];
+  const TemplateRecord *records = templateRecords(data) + c.first_template;
+  const Gradient *features = featureArray(data);
+
+  views.clear();
+  views.reserve(c.num_templates);
+  for (uint32_t k = 0; k < c.num_templates; k++) {
+    const TemplateRecord &t = records[k];
+    RotatedRect box(Point2f(t.center[0], t.center[1]),
+                    Size2f(t.size[0], t.size[1]), t.box_angle);
+    views.push_back(TemplateView(box, features + t.first_feature,
+                                 static_cast<int>(t.num_features),
+                                 t.pyramid_level, t.scale, t.angle));
+  }
+}
+
+/// class TemplateLibraryWriter
+
+void TemplateLibraryWriter::addClass(const String &name, int pyramid_level,
+                                     const Search &search,
+                                     const vector<TemplateView> &templates) {
+  CV_Assert(!name.empty() && name.size() < MAX_NAME);
+  CV_Assert(pyramid_level > 0 && templates.size() % pyramid_level == 0);
+  ClassEntry entry = {name, pyramid_level, search, templates};
+  classes.push_back(entry);
+}
+
+void TemplateLibraryWriter::write(const String &path) const {
+  LibraryHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, MAGIC, sizeof(MAGIC));
+  h.version = TemplateLibrary::VERSION;
+  h.byte_order = BYTE_ORDER_MARK;
+  h.header_size = sizeof(LibraryHeader);
+  h.num_classes = static_cast<uint32_t>(classes.size());
+
+  vector<ClassRecord> class_records(classes.size());
+  vector<TemplateRecord> template_records;
+  for (size_t i = 0; i < classes.size(); i++) {
+    const ClassEntry &entry = classes[i];
+    ClassRecord &c = class_records[i];
+    memset(&c, 0, sizeof(c));
+    memcpy(c.name, entry.name.c_str(), entry.name.size());
+    c.pyramid_level = entry.pyramid_level;
+    c.num_templates = static_cast<uint32_t>(entry.templates.size());
+    c.first_template = static_cast<uint32_t>(template_records.size());
+    const Range *ranges[2] = {&entry.search.scale, &entry.search.angle};
+    float *fields[2] = {c.scale, c.angle};
+    for (int k = 0; k < 2; k++) {
+      fields[k][0] = ranges[k]->lower_bound;
+      fields[k][1] = ranges[k]->upper_bound;
+      fields[k][2] = ranges[k]->step;
+    }
+
+    for (const TemplateView &templ : entry.templates) {
+      TemplateRecord t;
+      memset(&t, 0, sizeof(t));
+      t.center[0] = templ.box.center.x;
+      t.center[1] = templ.box.center.y;
+      t.size[0] = templ.box.size.width;
+      t.size[1] = templ.box.size.height;
+      t.box_angle = templ.box.angle;
+      t.scale = templ.scale;
+      t.angle = templ.angle;
+      t.pyramid_level = templ.pyramid_level;
+      t.first_feature = h.num_features;
+      t.num_features = static_cast<uint32_t>(templ.num_features);
+      h.num_features += templ.num_features;
+      template_records.push_back(t);
+    }
+  }
+  h.num_templates = static_cast<uint32_t>(template_records.size());
+
+  h.class_offset = alignSize(sizeof(LibraryHeader), SECTION_ALIGNMENT);
+  h.template_offset = alignSize(h.class_offset + class_records.size() * sizeof(ClassRecord),
+                                SECTION_ALIGNMENT);
+  h.feature_offset = alignSize(h.template_offset + template_records.size() * sizeof(TemplateRecord),
+                               SECTION_ALIGNMENT);
+  h.file_size = h.feature_offset + h.num_features * sizeof(Gradient);
+
+  ofstream out(path, ios::binary | ios::trunc);
+  if (!out)
+    CV_Error(Error::StsError, "cannot create template library: " + path);
+
+  out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+  writePadding(out, sizeof(h), h.class_offset);
+  out.write(reinterpret_cast<const char *>(class_records.data()),
+            class_records.size() * sizeof(ClassRecord));
+  writePadding(out, h.class_offset + class_records.size() * sizeof(ClassRecord),
+               h.template_offset);
+  out.write(reinterpret_cast<const char *>(template_records.data()),
+            template_records.size() * sizeof(TemplateRecord));
+  writePadding(out, h.template_offset + template_records.size() * sizeof(TemplateRecord),
+               h.feature_offset);
+  for (const ClassEntry &entry : classes)
+    for (const TemplateView &templ : entry.templates)
+      out.write(reinterpret_cast<const char *>(templ.features),
+                templ.num_features * sizeof(Gradient));
+
+  if (!out)
+    CV_Error(Error::StsError, "failed to write template library: " + path);
+}
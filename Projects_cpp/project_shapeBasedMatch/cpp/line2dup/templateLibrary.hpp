@@ -0,0 +1,76 @@
+#ifndef LINE2DUP_TEMPLATELIBRARY_HPP
+#define LINE2DUP_TEMPLATELIBRARY_HPP
+
+#include "line2dup.hpp"
+
+namespace line2Dup {
+
+/// 二进制模板库文件格式 (版本 2, 本机字节序), 各段起始位置按 64 字节对齐:
+///   文件头   魔数 "L2DUPLIB", 版本, 字节序标记, 各段的个数与偏移, 文件长度
+///   类别表   每类一项: 名称, 金字塔层数, 搜索范围, 在模板索引表中的区间
+///   模板索引 每个模板一项: 选框 (中心以特征坐标原点为参照), 缩放, 角度,
+///            所在层, 在特征数组中的区间
+///   特征数组 所有模板的 Gradient 依次连续存放, 与内存布局相同
+/// 打开时只校验文件头与索引表, 特征数组映射后原地使用
+
+/// @brief 只读的模板库, 整个文件映射到内存, 生命期内视图保持有效
+class TemplateLibrary {
+public:
+  static const uint32_t VERSION = 2; // 版本 1 的选框中心位于模板图像坐标系
+
+  /// @brief 映射模板库文件, 文件损坏或版本不符时抛出 cv::Exception
+  static cv::Ptr<TemplateLibrary> open(const cv::String &path);
+
+  ~TemplateLibrary();
+
+  TemplateLibrary(const TemplateLibrary &) = delete;
+  TemplateLibrary &operator=(const TemplateLibrary &) = delete;
+
+  int numClasses() const;
+
+  cv::String className(int i) const;
+
+  int pyramidLevel(int i) const;
+
+  Search search(int i) const;
+
+  /// @brief 第 i 类的全部模板视图, 排列顺序与写入时相同
+  void templates(int i, std::vector<TemplateView> &views) const;
+
+private:
+  TemplateLibrary() : data(nullptr), size(0), mapped(false) {}
+
+  void validate() const;
+
+  const uchar *data;
+  size_t size;
+  bool mapped;    // data 为 mmap 所得, 否则位于 buffer 中
+  cv::Mat buffer; // 不支持 mmap 的平台上整体读入
+};
+
+/// @brief 模板库的写入器, 收集各类模板后一次写出
+class TemplateLibraryWriter {
+public:
+  /// @param name 类别名称, 不超过 63 字节
+  /// @param pyramid_level 金字塔层数, templates.size() 须为其整数倍
+  /// @param templates 各层模板, 按 [level * n + template_id] 排列
+  void addClass(const cv::String &name, int pyramid_level,
+                const Search &search,
+                const std::vector<TemplateView> &templates);
+
+  void write(const cv::String &path) const;
+
+private:
+  struct ClassEntry {
+    cv::String name;
+    int pyramid_level;
+    Search search;
+    std::vector<TemplateView> templates;
+  };
+
+  std::vector<ClassEntry> classes;
+};
+
+} // namespace line2Dup
+
+#endif // LINE2DUP_TEMPLATELIBRARY_HPP
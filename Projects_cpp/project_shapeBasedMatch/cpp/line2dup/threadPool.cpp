@@ -0,0 +1,141 @@
+#include "threadPool.hpp"
+#include "profiler.hpp"
+using namespace std;
+using namespace line2Dup;
+
+ThreadPool::ThreadPool(int num_threads)
+    : generation(0), stopping(false), job(nullptr), remaining(0) {
+  if (num_threads <= 0)
+    num_threads = max(1, static_cast<int>(thread::hardware_concurrency()));
+
+  for (int i = 0; i < num_threads; i++)
+    queues.emplace_back(new TaskQueue());
+
+  // 0 号工作线程为调用 parallel_for 的线程
+  for (int i = 1; i < num_threads; i++)
+    threads.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  start_cond.notify_all();
+  for (auto &t : threads)
+    t.join();
+}
+
+void ThreadPool::parallel_for(int begin, int end,
+                              const function<void(int, int)> &body) {
+  if (end <= begin)
+    return;
+
+  // 线程池已被其他调用占用时不等待, 在调用线程内以 0 号工作线程串行执行
+  unique_lock<std::mutex> call_lock(call_mutex, try_to_lock);
+  const int n_workers = size();
+  const int n_tasks = end - begin;
+
+  if (!call_lock.owns_lock() || n_workers == 1 || n_tasks == 1) {
+    for (int i = begin; i < end; i++)
+      body(i, 0);
+    return;
+  }
+
+  // 调用线程绑定的统计随任务传给工作线程
+  Profile *profile = Profile::current();
+  const function<void(int, int)> profiled = [&](int i, int worker_id) {
+    ProfileBinding binding(profile);
+    body(i, worker_id);
+  };
+
+  // 任务放入队列前先发布计数与任务体, 上一轮尚未退出的线程窃取到的一定是本轮任务
+  remaining = n_tasks;
+  error = nullptr;
+  job = profile ? &profiled : &body;
+
+  // 按连续区间均分初始任务, 负载不均时由窃取平衡
+  for (int w = 0; w < n_workers; w++) {
+    const int first = begin + static_cast<int>((int64_t)n_tasks * w / n_workers);
+    const int last =
+        begin + static_cast<int>((int64_t)n_tasks * (w + 1) / n_workers);
+    lock_guard<std::mutex> lock(queues[w]->mutex);
+    for (int i = first; i < last; i++)
+      queues[w]->tasks.push_back(i);
+  }
+
+  {
+    lock_guard<std::mutex> lock(mutex);
+    generation++;
+  }
+  start_cond.notify_all();
+
+  runTasks(0);
+
+  unique_lock<std::mutex> lock(mutex);
+  done_cond.wait(lock, [this] { return remaining == 0; });
+  job = nullptr;
+
+  if (error) {
+    exception_ptr e = error;
+    error = nullptr;
+    rethrow_exception(e);
+  }
+}
+
+void ThreadPool::workerLoop(int worker_id) {
+  size_t seen = 0;
+  for (;;) {
+    {
+      unique_lock<std::mutex> lock(mutex);
+      start_cond.wait(lock,
+                      [&] { return stopping || generation != seen; });
+      if (stopping)
+        return;
+      seen = generation;
+    }
+    runTasks(worker_id);
+  }
+}
+
+void ThreadPool::runTasks(int worker_id) {
+  int task;
+  while (popTask(worker_id, task) || stealTask(worker_id, task)) {
+    try {
+      (*job.load())(task, worker_id);
+    } catch (...) {
+      lock_guard<std::mutex> lock(mutex);
+      if (!error)
+        error = current_exception();
+    }
+
+    if (--remaining == 0) {
+      lock_guard<std::mutex> lock(mutex);
+      done_cond.notify_all();
+    }
+  }
+}
+
+bool ThreadPool::popTask(int worker_id, int &task) {
+  TaskQueue &queue = *queues[worker_id];
+  lock_guard<std::mutex> lock(queue.mutex);
+  if (queue.tasks.empty())
+    return false;
+  task = queue.tasks.front();
+  queue.tasks.pop_front();
+  return true;
+}
+
+bool ThreadPool::stealTask(int worker_id, int &task) {
+  const int n_workers = size();
+  for (int k = 1; k < n_workers; k++) {
+    TaskQueue &queue = *queues[(worker_id + k) % n_workers];
+    lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty())
+      continue;
+    task = queue.tasks.back();
+    queue.tasks.pop_back();
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,70 @@
+#ifndef LINE2DUP_THREADPOOL_HPP
+#define LINE2DUP_THREADPOOL_HPP
+
+#include "precomp.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace line2Dup {
+
+/// @brief 常驻的工作窃取线程池. 每个工作线程持有一个任务双端队列, 自身从队首
+/// 取任务, 空闲时从其他线程的队尾窃取任务. 调用 parallel_for 的线程作为 0 号
+/// 工作线程参与计算, 线程在多次调用之间保持休眠, 不重复创建
+class ThreadPool {
+public:
+  /// @brief 创建线程池
+  /// @param num_threads 工作线程总数 (含调用线程), 不大于 0 时取硬件并发数
+  explicit ThreadPool(int num_threads = 0);
+
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  /// @brief 工作线程总数, 可用于按线程分配临时缓冲区
+  int size() const { return static_cast<int>(queues.size()); }
+
+  /// @brief 并行执行 body(i, worker_id), i 属于 [begin, end), 阻塞直到全部
+  /// 完成. worker_id 属于 [0, size()), 同一次调用中同一时刻不会有两个任务
+  /// 使用同一 worker_id. 任务中抛出的第一个异常在调用线程中重新抛出. 线程池
+  /// 正被其他线程的调用占用时, 本次调用不等待, 在调用线程内以 worker_id = 0
+  /// 串行执行, 因此临时缓冲区应属于各次调用而不是线程池
+  void parallel_for(int begin, int end,
+                    const std::function<void(int, int)> &body);
+
+private:
+  struct TaskQueue {
+    std::mutex mutex;
+    std::deque<int> tasks;
+  };
+
+  void workerLoop(int worker_id);
+  void runTasks(int worker_id);
+  bool popTask(int worker_id, int &task);
+  bool stealTask(int worker_id, int &task);
+
+  std::vector<std::unique_ptr<TaskQueue> > queues;
+  std::vector<std::thread> threads;
+
+  std::mutex call_mutex; // 同一时刻只有一个 parallel_for 调用使用工作线程
+  std::mutex mutex;
+  std::condition_variable start_cond;
+  std::condition_variable done_cond;
+  size_t generation;
+  bool stopping;
+
+  std::atomic<const std::function<void(int, int)> *> job;
+  std::atomic<int> remaining;
+  std::exception_ptr error;
+};
+
+} // namespace line2Dup
+
+#endif // LINE2DUP_THREADPOOL_HPP
@@ -6,6 +6,7 @@
 // file found in this module's directory
 
 #include "precomp.hpp"
+#include "../line2dup/profiler.hpp"
 
 namespace cv {
 namespace linemod {
@@ -429,6 +430,7 @@ ColorGradientPyramid::ColorGradientPyramid(const Mat &_src, const Mat &_mask,
 }
 
 void ColorGradientPyramid::update() {
+  line2Dup::ProfileScope scope(line2Dup::STAGE_GRADIENT);
   quantizedOrientations(src, magnitude, angle, weak_threshold);
 }
 
@@ -852,13 +854,28 @@ void DepthNormal::write(FileStorage &fs) const {
 *                                 Response maps *
 \****************************************************************************************/
 
+/// @brief CPU 支持的指令集, 首次使用时查询一次. 各内核每次调用都查询
+/// checkHardwareSupport 的开销在小图和局部相似度上并不可忽略
+struct CpuFeatures {
+  bool sse2, sse3, ssse3;
+  CpuFeatures()
+      : sse2(checkHardwareSupport(CV_CPU_SSE2)),
+        sse3(checkHardwareSupport(CV_CPU_SSE3)),
+        ssse3(checkHardwareSupport(CV_CPU_SSSE3)) {}
+};
+
+static const CpuFeatures &cpuFeatures() {
+  static const CpuFeatures features;
+  return features;
+}
+
 static void orUnaligned8u(const uchar *src, const int src_stride, uchar *dst,
                           const int dst_stride, const int width,
                           const int height) {
 #if CV_SSE2
-  volatile bool haveSSE2 = checkHardwareSupport(CPU_SSE2);
+  const bool haveSSE2 = cpuFeatures().sse2;
 #if CV_SSE3
-  volatile bool haveSSE3 = checkHardwareSupport(CPU_SSE3);
+  const bool haveSSE3 = cpuFeatures().sse3;
 #endif
   bool src_aligned = reinterpret_cast<unsigned long long>(src) % 16 == 0;
 #endif
@@ -915,8 +932,10 @@ static void orUnaligned8u(const uchar *src, const int src_stride, uchar *dst,
  * \param      T   Sampling step. Spread labels T/2 pixels in each direction.
  */
 static void spread(const Mat &src, Mat &dst, int T) {
+  line2Dup::ProfileScope scope(line2Dup::STAGE_SPREAD);
   // Allocate and zero-initialize spread (OR'ed) image
   dst = Mat::zeros(src.size(), CV_8U);
+  line2Dup::profileAllocation(dst.total());
 
   // Fill in spread gradient image (section 2.3)
   for (int r = 0; r < T; ++r) {
@@ -955,6 +974,7 @@ static const unsigned char SIMILARITY_LUT[256] = {
 static void computeResponseMaps(const Mat &src,
                                 std::vector<Mat> &response_maps) {
   CV_Assert((src.rows * src.cols) % 16 == 0);
+  line2Dup::ProfileScope scope(line2Dup::STAGE_RESPONSE_MAPS);
 
   // Allocate response maps
   response_maps.resize(8);
@@ -978,7 +998,7 @@ static void computeResponseMaps(const Mat &src,
   }
 
 #if CV_SSSE3
-  volatile bool haveSSSE3 = checkHardwareSupport(CV_CPU_SSSE3);
+  const bool haveSSSE3 = cpuFeatures().ssse3;
   if (haveSSSE3) {
     const __m128i *lut = reinterpret_cast<const __m128i *>(SIMILARITY_LUT);
     for (int ori = 0; ori < 8; ++ori) {
@@ -1030,6 +1050,7 @@ static void computeResponseMaps(const Mat &src,
 static void linearize(const Mat &response_map, Mat &linearized, int T) {
   CV_Assert(response_map.rows % T == 0);
   CV_Assert(response_map.cols % T == 0);
+  line2Dup::ProfileScope scope(line2Dup::STAGE_LINEARIZE);
 
   // linearized has T^2 rows, where each row is a linear memory
   int mem_width = response_map.cols / T;
@@ -1098,6 +1119,7 @@ accessLinearMemory(const std::vector<Mat> &linear_memories, const Feature &f,
  */
 static void similarity(const std::vector<Mat> &linear_memories,
                        const Template &templ, Mat &dst, Size size, int T) {
+  line2Dup::ProfileScope scope(line2Dup::STAGE_SIMILARITY);
   // 63 features or less is a special case because the max similarity
   // per-feature is 4. 255/4 = 63, so up to that many we can add up similarities
   // in 8 bits without worrying about overflow. Therefore here we use
@@ -1131,9 +1153,9 @@ static void similarity(const std::vector<Mat> &linear_memories,
   uchar *dst_ptr = dst.ptr<uchar>();
 
 #if CV_SSE2
-  volatile bool haveSSE2 = checkHardwareSupport(CV_CPU_SSE2);
+  const bool haveSSE2 = cpuFeatures().sse2;
 #if CV_SSE3
-  volatile bool haveSSE3 = checkHardwareSupport(CV_CPU_SSE3);
+  const bool haveSSE3 = cpuFeatures().sse3;
 #endif
 #endif
 
@@ -1210,9 +1232,9 @@ static void similarityLocal(const std::vector<Mat> &linear_memories,
   int offset_y = (center.y / T - 8) * T;
 
 #if CV_SSE2
-  volatile bool haveSSE2 = checkHardwareSupport(CV_CPU_SSE2);
+  const bool haveSSE2 = cpuFeatures().sse2;
 #if CV_SSE3
-  volatile bool haveSSE3 = checkHardwareSupport(CV_CPU_SSE3);
+  const bool haveSSE3 = cpuFeatures().sse3;
 #endif
   __m128i *dst_ptr_sse = dst.ptr<__m128i>();
 #endif
@@ -1386,6 +1408,7 @@ void Detector::match(const std::vector<Mat> &sources, float threshold,
 
   // Sort matches by similarity, and prune any duplicates introduced by pyramid
   // refinement
+  line2Dup::ProfileScope nms_scope(line2Dup::STAGE_NMS);
   std::sort(matches.begin(), matches.end());
   std::vector<Match>::iterator new_end =
       std::unique(matches.begin(), matches.end());
@@ -1403,6 +1426,7 @@ void Detector::matchClass(
     const LinearMemoryPyramid &lm_pyramid, const std::vector<Size> &sizes,
     float threshold, std::vector<Match> &matches, const String &class_id,
     const std::vector<TemplatePyramid> &template_pyramids) const {
+  line2Dup::ProfileScope scope(line2Dup::STAGE_MATCH);
   // For each template...
   for (size_t template_id = 0; template_id < template_pyramids.size();
        ++template_id) {
@@ -1422,6 +1446,10 @@ void Detector::matchClass(
       num_features += static_cast<int>(templ.features.size());
       similarity(lowest_lm[i], templ, similarities[i], sizes.back(), lowest_T);
     }
+    line2Dup::profileCount(line2Dup::COUNTER_TEMPLATES_EVALUATED, 1,
+                           pyramid_levels - 1);
+    line2Dup::profileCount(line2Dup::COUNTER_FEATURES_EVALUATED, num_features,
+                           pyramid_levels - 1);
 
     // Combine into overall similarity
     /// @todo Support weighting the modalities
@@ -1453,8 +1481,15 @@ void Detector::matchClass(
       }
     }
 
+    line2Dup::profileCount(line2Dup::COUNTER_CANDIDATES, candidates.size(),
+                           pyramid_levels - 1);
+    if (candidates.empty())
+      line2Dup::profileCount(line2Dup::COUNTER_TEMPLATES_PRUNED, 1,
+                             pyramid_levels - 1);
+
     // Locally refine each match by marching up the pyramid
-    for (int l = pyramid_levels - 2; l >= 0; --l) {
+    line2Dup::ProfileScope refine_scope(line2Dup::STAGE_PYRAMID_REFINE);
+    for (int l = pyramid_levels - 2; l >= 0 && !candidates.empty(); --l) {
       const std::vector<LinearMemories> &lms = lm_pyramid[l];
       int T = T_at_level[l];
       int start = static_cast<int>(l * modalities.size());
@@ -1488,6 +1523,8 @@ void Detector::matchClass(
                           Point(x, y));
         }
         addSimilarities(similarities2, total_similarity2);
+        line2Dup::profileCount(line2Dup::COUNTER_TEMPLATES_EVALUATED, 1, l);
+        line2Dup::profileCount(line2Dup::COUNTER_FEATURES_EVALUATED, numFeatures, l);
 
         // Find best local adjustment
         int best_score = 0;
@@ -1513,6 +1550,9 @@ void Detector::matchClass(
       std::vector<Match>::iterator new_end = std::remove_if(
           candidates.begin(), candidates.end(), MatchPredicate(threshold));
       candidates.erase(new_end, candidates.end());
+      line2Dup::profileCount(line2Dup::COUNTER_CANDIDATES, candidates.size(), l);
+      if (candidates.empty())
+        line2Dup::profileCount(line2Dup::COUNTER_TEMPLATES_PRUNED, 1, l);
     }
 
     matches.insert(matches.end(), candidates.begin(), candidates.end());
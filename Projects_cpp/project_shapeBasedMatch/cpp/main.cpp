@@ -1,9 +1,8 @@
 #include "line2d.hpp"
+#include "line2dup/profiler.hpp"
 using namespace cv;
 using namespace std;
 using namespace line2d;
-extern double __time__relocate__;
-extern double __time__produceroi__;
 
 void template_test() {
     Mat image = imread("../imagelib/mount.png", IMREAD_COLOR);
@@ -58,11 +57,18 @@ int main() {
     params.scatter_distance = 12.0f;
 
     Timer time;
+    line2Dup::Profile profile;
     Detector detector;
-    detector.match(sourceImage, templateImage, 70, params);
+    {
+        line2Dup::ProfileBinding binding(&profile);
+        detector.match(sourceImage, templateImage, 70, params);
+    }
     time.out("模板匹配运行完毕!");
-    cout << "特征点旋转运算时间: " << __time__relocate__ << endl;
-    cout << "联通域分析运算时间: " << __time__produceroi__ << endl;
+    cout << "特征点旋转运算时间: "
+         << profile.stageTime(line2Dup::STAGE_TEMPLATE_TRANSFORM) << "ms" << endl;
+    cout << "联通域分析运算时间: "
+         << profile.stageTime(line2Dup::STAGE_CANDIDATE_REGIONS) << "ms" << endl;
+    cout << profile.toJson() << endl;
 
     detector.draw();
 